@@ -273,7 +273,9 @@ struct BjEmit
                     // remove ref from current key without decreasing refcount,
                     // then use as key without increasing refcount
                     assert(currentFrame.currentKey.type() == Var::TYPE_STRING);
-                    Var *ins = currentFrame.u.m->put(mem, currentFrame.currentKey.asStrRef(), std::move(v));
+                    const StrRef k = currentFrame.currentKey.asKeyRef(mem);
+                    Var *ins = k ? currentFrame.u.m->put(mem, k, std::move(v)) : NULL;
+                    mem.freeS(k); // the map holds its own ref if it took the key
                     currentFrame.currentKey.clear(mem);
                     if(!ins)
                         goto fail;
@@ -675,14 +677,25 @@ bool decode_json(VarRef dst, BufferedReadStream& src)
 
 struct WriteState
 {
-    static bool _RemoveIf(const StringPool::StrAndCount& a)
+    struct PooledStr
     {
-        return a.count < 2;
+        PoolStr s;
+        size_t count;
+        StrRef ref;
+    };
+    static void _Collect(void *ud, StrRef ref, PoolStr s, size_t refcount)
+    {
+        if(refcount < 2) // not worth pooling
+            return;
+        PooledStr ps { s, refcount, ref };
+        static_cast<std::vector<PooledStr>*>(ud)->push_back(ps);
     }
-    static bool _Order(const StringPool::StrAndCount& a, const StringPool::StrAndCount& b)
+    static bool _Order(const PooledStr& a, const PooledStr& b)
     {
-        return a.count > b.count // highest count comes first
-            || (a.count == b.count && a.s < b.s);
+        if(a.count != b.count)
+            return a.count > b.count; // highest count comes first
+        const int c = memcmp(a.s.s, b.s.s, std::min(a.s.len, b.s.len));
+        return c < 0 || (!c && a.s.len < b.s.len);
     }
     WriteState(BufferedWriteStream& dst, const TreeMem& mem, BlockAllocator *alloc)
         : dst(dst), mem(mem), balloc(alloc)
@@ -818,10 +831,8 @@ size_t WriteState::poolAndEmitStrings()
     if(!balloc)
         return 0;
 
-    StringPool::StrColl strcoll = mem.collate();
-
-    // remove strings that are not worth pooling
-    strcoll.erase(std::remove_if(strcoll.begin(), strcoll.end(), _RemoveIf), strcoll.end());
+    std::vector<PooledStr> strcoll;
+    mem.iterate(_Collect, &strcoll);
 
     ref2idx.reserve(*balloc, (u32)strcoll.size());
 
@@ -840,7 +851,7 @@ size_t WriteState::poolAndEmitStrings()
             if(!dst)
                 break;
             *dst = i;
-            ret += putStrRaw(*this, strcoll[i].s.c_str(), strcoll[i].s.length());
+            ret += putStrRaw(*this, strcoll[i].s.s, strcoll[i].s.len);
         }
     }
     return ret;
@@ -893,7 +904,13 @@ static size_t encodeVal(WriteState& wr, const Var& in)
         }
 
         case Var::TYPE_STRING:
-            return putStr(wr, in.asStrRef(), in._size());
+            if(StrRef ref = in.asStrRef())
+                return putStr(wr, ref, in._size());
+            else // short string, not pooled
+            {
+                const PoolStr ps = in.asString(wr.mem);
+                return putStrRaw(wr, ps.s, ps.len);
+            }
 
         case Var::TYPE_ARRAY:
         {
@@ -5,18 +5,45 @@
 #include "treeiter.h"
 #include "pathiter.h"
 #include "fetcher.h"
+#include "memaccounting.h"
 
 
 DataTree::DataTree(StringPool::PoolSize size)
-    : TreeMem(size)
+    : TreeMem(size), _memtagged(false)
 {
 }
 
 DataTree::~DataTree()
 {
+    if(_memtagged)
+        MemAccounting::Remove(this);
     _root.clear(*this);
 }
 
+void DataTree::setMemTag(const char* tag)
+{
+    MemAccounting::Add(this, tag, _CollectStats);
+    _memtagged = true;
+}
+
+bool DataTree::_CollectStats(const void* self, MemStats& st)
+{
+    const DataTree *tree = static_cast<const DataTree*>(self);
+    std::shared_lock<acme::upgrade_mutex> lock(tree->mutex, std::chrono::milliseconds(50));
+    if(!lock.owns_lock())
+        return false;
+    tree->addStats(st);
+    return true;
+}
+
+void DataTree::swap(DataTree& o)
+{
+    TreeMem::swap(o);
+    Var tmp(std::move(_root));
+    _root = std::move(o._root);
+    o._root = std::move(tmp);
+}
+
 VarRef DataTree::root()
 {
     return VarRef(*this, &_root);
@@ -72,3 +99,48 @@ void DataTree::fillExpiredSubnodes(std::vector<Var*>& v)
     CollectExpiredVars f(timeNowMS(), v);
     treeIter_T(f, root());
 }
+
+
+struct ScratchTreeCache
+{
+    std::vector<DataTree*> trees[3]; // indexed by StringPool::PoolSize
+
+    ~ScratchTreeCache()
+    {
+        for(size_t i = 0; i < Countof(trees); ++i)
+            for(size_t k = 0; k < trees[i].size(); ++k)
+                delete trees[i][k];
+    }
+};
+
+static thread_local ScratchTreeCache s_scratchCache;
+
+ScratchTree::ScratchTree(StringPool::PoolSize size)
+    : _tree(NULL), _size(size)
+{
+    std::vector<DataTree*>& v = s_scratchCache.trees[size];
+    if(v.size())
+    {
+        _tree = v.back();
+        v.pop_back();
+    }
+    else
+        _tree = new DataTree(size);
+}
+
+ScratchTree::~ScratchTree()
+{
+    _tree->root().clear();
+    const size_t strbytes = _tree->StringPool::usedBytes();
+    _tree->StringPool::clear();
+
+    std::vector<DataTree*>& v = s_scratchCache.trees[_size];
+    if(!_tree->BlockAllocator::usedBytes() && _tree->peakBytes() + strbytes <= MAX_REUSE_BYTES
+        && v.size() < MAX_CACHED_PER_THREAD)
+    {
+        _tree->resetPeak();
+        v.push_back(_tree);
+    }
+    else
+        delete _tree;
+}
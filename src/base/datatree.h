@@ -61,7 +61,47 @@ public:
     // Maintenance
     void fillExpiredSubnodes(std::vector<Var*>& v);
 
+    // Exchange root and memory with another tree. The mutexes stay where they are;
+    // the caller must hold the write lock of both trees, if needed.
+    void swap(DataTree& o);
+
+    // Make this tree show up in memory stats under tag (see memaccounting.h). tag must be a string literal.
+    // The tree is unregistered when it is deleted.
+    void setMemTag(const char *tag);
+
     Var _root;
 
     mutable acme::upgrade_mutex mutex;
+
+private:
+    static bool _CollectStats(const void *self, MemStats& st);
+    bool _memtagged;
+};
+
+// Short-lived tree for per-request scratch work, borrowed from a per-thread cache of trees.
+// Declare it before anything that allocates from it; when it goes out of scope, the root and all strings
+// are dropped and the tree goes back to the cache, so the next request starts with warmed-up memory.
+// A tree that grew too large, or that still has memory allocated after clearing,
+// is deleted instead so that one big request doesn't pin its memory forever.
+class ScratchTree
+{
+    ScratchTree(const ScratchTree&) = delete;
+    ScratchTree& operator=(const ScratchTree&) = delete;
+
+public:
+    ScratchTree(StringPool::PoolSize size = StringPool::TINY);
+    ~ScratchTree();
+
+    inline DataTree& operator*() { return *_tree; }
+    inline DataTree *operator->() { return _tree; }
+
+    enum
+    {
+        MAX_CACHED_PER_THREAD = 4,
+        MAX_REUSE_BYTES = 16 * 1024 * 1024, // trees that ever used more than this are not kept
+    };
+
+private:
+    DataTree *_tree;
+    const StringPool::PoolSize _size;
 };
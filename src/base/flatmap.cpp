@@ -0,0 +1,256 @@
+#include "flatmap.h"
+#include "treemem.h"
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <algorithm>
+
+namespace flatmap {
+
+static const char MAGIC[4] = { 'F', 'L', 'M', '1' };
+
+static inline u32 rd32(const char *p)
+{
+    const unsigned char *u = (const unsigned char*)p;
+    return u32(u[0]) | (u32(u[1]) << 8) | (u32(u[2]) << 16) | (u32(u[3]) << 24);
+}
+
+static inline void wr32(char *p, u32 x)
+{
+    p[0] = char(x);
+    p[1] = char(x >> 8);
+    p[2] = char(x >> 16);
+    p[3] = char(x >> 24);
+}
+
+static inline void put32(std::vector<char>& out, u32 x)
+{
+    const size_t pos = out.size();
+    out.resize(pos + 4);
+    wr32(&out[pos], x);
+}
+
+static inline int cmpkey(const char *a, size_t alen, const char *b, size_t blen)
+{
+    const int c = memcmp(a, b, std::min(alen, blen));
+    return c ? c : (alen < blen ? -1 : alen > blen ? 1 : 0);
+}
+
+bool Value::isString() const
+{
+    return _p && *_p == 's';
+}
+
+bool Value::isMap() const
+{
+    return _p && *_p == 'm';
+}
+
+PoolStr Value::str() const
+{
+    PoolStr ps = { NULL, 0 };
+    if(isString() && size_t(_end - _p) >= 5)
+    {
+        const u32 len = rd32(_p + 1);
+        if(size_t(_end - _p - 5) > len) // must also have the terminator
+        {
+            ps.s = _p + 5;
+            ps.len = len;
+        }
+    }
+    return ps;
+}
+
+Node Value::map() const
+{
+    return isMap() ? Node(_p + 1, _end) : Node();
+}
+
+Node::Node(const char *p, const char *end)
+    : _p(NULL), _end(end), _n(0)
+{
+    if(p < end && size_t(end - p) >= 4)
+    {
+        const size_t n = rd32(p);
+        if(size_t(end - p - 4) / 4 >= n)
+        {
+            _p = p;
+            _n = n;
+        }
+    }
+}
+
+const char *Node::_entry(size_t i) const
+{
+    if(i >= _n)
+        return NULL;
+    // Check offsets against the size before making pointers from them; they come from the file
+    const u32 off = rd32(_p + 4 + 4 * i);
+    if(off > size_t(_end - _p) || size_t(_end - _p) - off < 4)
+        return NULL;
+    const char *e = _p + off;
+    const u32 keylen = rd32(e);
+    if(size_t(_end - e - 4) <= keylen) // need at least the type byte after the key
+        return NULL;
+    return e;
+}
+
+PoolStr Node::key(size_t i) const
+{
+    PoolStr ps = { NULL, 0 };
+    if(const char *e = _entry(i))
+    {
+        ps.s = e + 4;
+        ps.len = rd32(e);
+    }
+    return ps;
+}
+
+Value Node::value(size_t i) const
+{
+    const char *e = _entry(i);
+    return e ? Value(e + 4 + rd32(e), _end) : Value(); // _entry() made sure the key and type byte fit
+}
+
+Value Node::lookup(const char *key, size_t len) const
+{
+    size_t lo = 0, hi = _n;
+    while(lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+        const char *e = _entry(mid);
+        if(!e)
+            break;
+        const int c = cmpkey(e + 4, rd32(e), key, len);
+        if(!c)
+            return Value(e + 4 + rd32(e), _end); // _entry() made sure the key and type byte fit
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return Value();
+}
+
+bool File::open(const char *fn)
+{
+    if(!_mf.open(fn))
+        return false;
+    if(_mf.size() >= sizeof(MAGIC) && !memcmp(_mf.data(), MAGIC, sizeof(MAGIC)))
+        return true;
+    _mf.close(); // not ours, don't let root() look at it
+    return false;
+}
+
+Node File::root() const
+{
+    return _mf.data() ? Node(_mf.data() + sizeof(MAGIC), _mf.data() + _mf.size()) : Node();
+}
+
+struct Entry
+{
+    PoolStr k;
+    const Var *v;
+    inline bool operator<(const Entry& o) const { return cmpkey(k.s, k.len, o.k.s, o.k.len) < 0; }
+};
+
+static bool encodeMap(std::vector<char>& out, VarCRef src)
+{
+    std::vector<Entry> ents;
+    const Var::Map *m = src.v->map();
+    ents.reserve(m->size());
+    for(Var::Map::Iterator it = m->begin(); it != m->end(); ++it)
+    {
+        const Var::Type t = it.value().type();
+        if(t == Var::TYPE_STRING || t == Var::TYPE_MAP)
+        {
+            Entry e { src.mem->getSL(it.key()), &it.value() };
+            ents.push_back(e);
+        }
+    }
+    std::sort(ents.begin(), ents.end());
+
+    const size_t start = out.size();
+    const size_t n = ents.size();
+    put32(out, u32(n));
+    out.resize(out.size() + 4 * n);
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        const size_t off = out.size() - start;
+        if(off > u32(-1))
+            return false;
+        wr32(&out[start + 4 + 4 * i], u32(off));
+
+        const Entry& e = ents[i];
+        put32(out, u32(e.k.len));
+        out.insert(out.end(), e.k.s, e.k.s + e.k.len);
+        if(e.v->type() == Var::TYPE_STRING)
+        {
+            const PoolStr s = e.v->asString(*src.mem);
+            out.push_back('s');
+            put32(out, u32(s.len));
+            out.insert(out.end(), s.s, s.s + s.len);
+            out.push_back(0);
+        }
+        else
+        {
+            out.push_back('m');
+            if(!encodeMap(out, VarCRef(src.mem, e.v)))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool encode(std::vector<char>& out, VarCRef src)
+{
+    out.assign(MAGIC, MAGIC + sizeof(MAGIC));
+    return src.v->map() && encodeMap(out, src);
+}
+
+bool write(const char *fn, const std::vector<char>& buf)
+{
+    const std::string tmpfn = std::string(fn) + ".tmp";
+    FILE *f = fopen(tmpfn.c_str(), "wb");
+    if(!f)
+        return false;
+    bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+    ok = !fclose(f) && ok;
+    ok = ok && replaceFile(fn, tmpfn.c_str());
+    if(!ok)
+        remove(tmpfn.c_str());
+    return ok;
+}
+
+bool decode(VarRef dst, const Node& n)
+{
+    if(!n)
+        return false;
+    dst.makeMap(n.size());
+    for(size_t i = 0; i < n.size(); ++i)
+    {
+        const PoolStr k = n.key(i);
+        const Value v = n.value(i);
+        if(!k.s || !v)
+            return false;
+        if(v.isString())
+        {
+            const PoolStr s = v.str();
+            if(!s.s)
+                return false;
+            dst[k].setStr(s.s, s.len);
+        }
+        else if(v.isMap())
+        {
+            const Node sub = v.map();
+            if(!decode(dst[k], sub))
+                return false;
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+} // end namespace flatmap
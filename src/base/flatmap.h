@@ -0,0 +1,79 @@
+#pragma once
+
+// Flat, read-in-place encoding for trees of maps and strings.
+// Intended to be memory-mapped and queried directly, without decoding anything up front.
+// Layout (all integers are u32, little endian):
+//   file:  "FLM1" node
+//   node:  count offsets[count] entries...   -- offsets are relative to the node start
+//   entry: keylen key type value             -- entries are sorted by key
+//   type 's': len bytes '\0'                 -- strings are stored inline
+//   type 'm': node                           -- so are child maps
+// Anything that isn't a map or a string (including null) is skipped when encoding.
+// Offsets and lengths come from the file and are checked before use; corrupt input fails to decode.
+// Only used for derived, read-only data (search cache, 3pid maps). The base tree is still saved as BJ
+// and fully decoded when loading.
+
+#include <vector>
+#include <memory>
+#include "types.h"
+#include "variant.h"
+#include "osfunc.h"
+
+namespace flatmap {
+
+class Node;
+
+class Value
+{
+public:
+    Value() : _p(NULL), _end(NULL) {}
+    Value(const char *p, const char *end) : _p(p), _end(end) {}
+    inline operator bool() const { return !!_p; }
+    bool isString() const;
+    bool isMap() const;
+    PoolStr str() const; // { NULL, 0 } if not string
+    Node map() const; // invalid if not map
+
+private:
+    const char *_p; // points to type
+    const char *_end;
+};
+
+class Node
+{
+public:
+    Node() : _p(NULL), _end(NULL), _n(0) {}
+    Node(const char *p, const char *end);
+    inline operator bool() const { return !!_p; }
+    inline size_t size() const { return _n; }
+    PoolStr key(size_t i) const;
+    Value value(size_t i) const;
+    Value lookup(const char *key, size_t len) const; // binary search
+
+private:
+    const char *_entry(size_t i) const; // NULL if out of bounds
+    const char *_p;
+    const char *_end;
+    size_t _n;
+};
+
+// Read-only view of an encoded file
+class File
+{
+public:
+    bool open(const char *fn);
+    Node root() const;
+private:
+    MappedFile _mf;
+};
+
+// Encode src, which must be a map. Fails if it gets too large for 32 bit offsets.
+bool encode(std::vector<char>& out, VarCRef src);
+
+// Write an encoded buffer to fn. Goes through a temp file, so fn is either replaced as a whole or left untouched.
+bool write(const char *fn, const std::vector<char>& buf);
+
+// Decode everything under n into dst (as map)
+bool decode(VarRef dst, const Node& n);
+
+} // end namespace flatmap
@@ -7,6 +7,7 @@
 
 #include "datatree.h"
 #include "jsonstreamwrapper.h"
+#include "keyfilter.h"
 
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/document.h"
@@ -78,13 +79,13 @@ struct JsonLoader
 
 // ---- begin rapidjson stuff -----
 
-    bool Null() { return _emit(Var()); }
-    bool Bool(bool b) { return _emit(b); }
+    bool Null() { return _skipped() || _emit(Var()); }
+    bool Bool(bool b) { return _skipped() || _emit(b); }
     bool Int(int i) { return Int64(i); }
     bool Uint(unsigned u) { return Uint64(u); }
-    bool Int64(int64_t i) { return _emit((s64)i); }
-    bool Uint64(uint64_t u) { return _emit((u64)u); }
-    bool Double(double d) { return _emit(d); }
+    bool Int64(int64_t i) { return _skipped() || _emit((s64)i); }
+    bool Uint64(uint64_t u) { return _skipped() || _emit((u64)u); }
+    bool Double(double d) { return _skipped() || _emit(d); }
     bool RawNumber(const char* str, size_t length, bool copy) // only when kParseNumbersAsStringsFlag is set, which is not.
     {
         assert(false); // not reached
@@ -92,15 +93,25 @@ struct JsonLoader
     }
     bool String(const char* str, size_t length, bool copy)
     {
-        return _emit(Var(_mem, str, length));
+        return _skipped() || _emit(Var(_mem, str, length));
     }
     bool StartObject()
     {
-        _pushframe(true);
+        if(skip)
+            ++skip;
+        else
+            _pushframe(true);
         return true;
     }
     bool Key(const char* str, size_t length, bool copy)
     {
+        if(skip)
+            return true;
+        if(filter && frameidx == filter->depth + 1 && !filter->keep(str, length))
+        {
+            skip = 1; // drop the value that follows
+            return true;
+        }
         Frame& f = _topframe();
         assert(f.m);
         assert(!f.lastkey);
@@ -110,17 +121,24 @@ struct JsonLoader
     }
     bool EndObject(size_t memberCount)
     {
+        if(skip)
+            return _skipEnd();
         // FIXME: make sure this is caught in rapidjson and can't crash here
         assert(_topframe().m);
         return _emit(_popframe());
     }
     bool StartArray()
     {
-        _pushframe(false);
+        if(skip)
+            ++skip;
+        else
+            _pushframe(false);
         return true;
     }
     bool EndArray(size_t elementCount)
     {
+        if(skip)
+            return _skipEnd();
         assert(!_topframe().m);
         return _emit(_popframe());
     }
@@ -129,8 +147,11 @@ struct JsonLoader
 
     Var root;
     TreeMem& _mem;
+    const KeyFilter * const filter;
+    // While skipping a value: 1 + how deep we are inside of it. 0 when not skipping.
+    size_t skip;
 
-    JsonLoader(TreeMem& mem) : _mem(mem), frameidx(0) {}
+    JsonLoader(TreeMem& mem, const KeyFilter *filter) : _mem(mem), filter(filter), skip(0), frameidx(0) {}
     ~JsonLoader()
     {
         root.clear(_mem); // in case we failed to load and there's leftover crap
@@ -144,8 +165,18 @@ struct JsonLoader
     }
 
     bool _emit(Var&& x);
+    // A scalar that is being skipped either is the skipped value, or is somewhere inside of it
+    inline bool _skipped()
+    {
+        if(!skip)
+            return false;
+        if(skip == 1)
+            skip = 0;
+        return true;
+    }
     Frame& _pushframe(bool ismap);
     Var _popframe();
+    bool _skipEnd();
     Frame& _topframe() { assert(frameidx); return frames[frameidx - 1]; }
 
 private:
@@ -190,6 +221,13 @@ JsonLoader::Frame& JsonLoader::_pushframe(bool ismap)
     return f;
 }
 
+bool JsonLoader::_skipEnd()
+{
+    if(--skip == 1) // the skipped map or array is complete
+        skip = 0;
+    return true;
+}
+
 Var JsonLoader::_popframe()
 {
     assert(frames.size());
@@ -215,10 +253,10 @@ Var JsonLoader::_popframe()
 }
 
 template<typename STREAM>
-static bool _loadJsonDestructive(VarRef dst, STREAM& stream)
+static bool _loadJsonDestructive(VarRef dst, STREAM& stream, const KeyFilter *filter)
 {
 
-    JsonLoader ld(*dst.mem);
+    JsonLoader ld(*dst.mem, filter);
     if(!ld.parseDestructive(stream))
         return false;
 
@@ -227,14 +265,14 @@ static bool _loadJsonDestructive(VarRef dst, STREAM& stream)
     return true;
 }
 
-bool loadJsonDestructive(VarRef dst, BufferedReadStream& stream)
+bool loadJsonDestructive(VarRef dst, BufferedReadStream& stream, const KeyFilter *filter)
 {
     stream.init();
-    return _loadJsonDestructive(dst, stream);
+    return _loadJsonDestructive(dst, stream, filter);
 }
 
 bool loadJsonDestructive(VarRef dst, const char* data, size_t len)
 {
     rapidjson::MemoryStream ms(data, len);
-    return _loadJsonDestructive(dst, ms);
+    return _loadJsonDestructive(dst, ms, NULL);
 }
@@ -3,7 +3,9 @@
 #include "datatree.h"
 
 class BufferedReadStream;
+struct KeyFilter;
 
  // one-shot loader. replaces tree contents on success. shreds json.
-bool loadJsonDestructive(VarRef dst, BufferedReadStream& stream);
+ // If filter is given, keys dropped by the filter are skipped while parsing and never stored.
+bool loadJsonDestructive(VarRef dst, BufferedReadStream& stream, const KeyFilter *filter = NULL);
 bool loadJsonDestructive(VarRef dst, const char *data, size_t len);
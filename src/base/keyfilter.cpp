@@ -0,0 +1,57 @@
+#include "keyfilter.h"
+#include "treemem.h"
+
+bool KeyFilter::keep(const char* k, size_t len) const
+{
+    return keys.find(std::string(k, len)) != keys.end();
+}
+
+static size_t applyAt(const KeyFilter& f, TreeMem& mem, Var& v, unsigned depth)
+{
+    size_t dropped = 0;
+    if(depth < f.depth)
+    {
+        if(Var::Map *m = v.map())
+        {
+            for(Var::Map::MutIterator it = m->begin(); it != m->end(); ++it)
+                dropped += applyAt(f, mem, it.value(), depth + 1);
+        }
+        else if(Var *a = v.array())
+        {
+            const size_t n = v.size();
+            for(size_t i = 0; i < n; ++i)
+                dropped += applyAt(f, mem, a[i], depth + 1);
+        }
+        return dropped;
+    }
+
+    Var::Map *m = v.map();
+    if(!m)
+        return 0;
+
+    for(Var::Map::MutIterator it = m->begin(); it != m->end(); ++it)
+    {
+        const PoolStr k = mem.getSL(it.key());
+        dropped += !f.keep(k.s, k.len);
+    }
+    if(!dropped)
+        return 0;
+
+    // Rebuild the map with only the kept keys. Values are moved over, nothing is copied.
+    Var tmp;
+    Var::Map *nm = tmp.makeMap(mem, m->size() - dropped);
+    for(Var::Map::MutIterator it = m->begin(); it != m->end(); ++it)
+    {
+        const PoolStr k = mem.getSL(it.key());
+        if(f.keep(k.s, k.len))
+            nm->put(mem, it.key(), std::move(it.value()));
+    }
+    v.clear(mem);
+    v = std::move(tmp);
+    return dropped;
+}
+
+size_t KeyFilter::apply(VarRef v) const
+{
+    return applyAt(*this, *v.mem, *v.v, 0);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+// Keeps only some keys of all maps at a certain depth and drops the rest.
+// Depth counts nested maps and arrays: 0 is the root, 1 is anything stored directly in the root, and so on.
+// Intended to get rid of unused data as early as possible, preferably while loading,
+// so that it never ends up in memory (see loadJsonDestructive()).
+
+#include <string>
+#include <unordered_set>
+#include "variant.h"
+
+struct KeyFilter
+{
+    unsigned depth = 0;
+    std::unordered_set<std::string> keys;
+
+    bool keep(const char *k, size_t len) const;
+
+    // For trees that are already loaded. Returns the number of dropped keys.
+    size_t apply(VarRef v) const;
+};
@@ -2,169 +2,868 @@
 #include "luaalloc.h"
 #include <limits>
 #include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <cstddef>
+
+MemStats::MemStats()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+void MemStats::add(const MemStats& o)
+{
+    used += o.used;
+    reserved += o.reserved;
+    for(unsigned i = 0; i < NUM_CLASSES; ++i)
+    {
+        classBytes[i] += o.classBytes[i];
+        classCount[i] += o.classCount[i];
+    }
+    strBytes += o.strBytes;
+    strCount += o.strCount;
+    strTables += o.strTables;
+    extra += o.extra;
+}
+
+double MemStats::fragmentation() const
+{
+    return reserved > used ? double(reserved - used) / double(reserved) : 0.0;
+}
+
+static inline unsigned sizeClass(size_t sz)
+{
+    unsigned c = 0;
+    for(size_t x = (sz - 1) >> 3; x && c < MemStats::NUM_CLASSES - 1; x >>= 1)
+        ++c;
+    return c;
+}
+
+// Everything the block allocator takes from the system, in a list so that it can be dropped as a whole
+struct alignas(std::max_align_t) BlockAllocator::SysBlock
+{
+    SysBlock *prev, *next;
+};
+
+struct BlockAllocator::SysState
+{
+    size_t reserved;
+    SysBlock *head;
+
+    void link(SysBlock *b)
+    {
+        b->prev = NULL;
+        b->next = head;
+        if(head)
+            head->prev = b;
+        head = b;
+    }
+
+    void unlink(SysBlock *b)
+    {
+        if(b->prev)
+            b->prev->next = b->next;
+        else
+            head = b->next;
+        if(b->next)
+            b->next->prev = b->prev;
+    }
+};
+
+// Same as LuaAlloc's default, but keeps track of how much memory it holds, and of every allocation
+void *BlockAllocator::_SysAlloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    SysState& st = *static_cast<SysState*>(ud);
+    SysBlock *b = ptr ? static_cast<SysBlock*>(ptr) - 1 : NULL;
+    if(b)
+        st.unlink(b);
+    if(!nsize)
+    {
+        free(b);
+        st.reserved -= osize;
+        return NULL;
+    }
+    SysBlock *nb = (SysBlock*)realloc(b, sizeof(SysBlock) + nsize);
+    if(!nb)
+    {
+        if(b)
+            st.link(b); // old pointer stays valid
+        return NULL;
+    }
+    st.link(nb);
+    st.reserved += nsize - (ptr ? osize : 0); // when allocating, osize is the type of allocation, not a size
+    return nb + 1;
+}
 
 BlockAllocator::BlockAllocator()
-    : _LA(luaalloc_create(NULL, NULL))
+    : _LA(NULL), _sys(new SysState), _used(0), _peak(0)
 {
+    _sys->reserved = 0;
+    _sys->head = NULL;
+    _LA = luaalloc_create(_SysAlloc, _sys);
+    memset(_classBytes, 0, sizeof(_classBytes));
+    memset(_classCount, 0, sizeof(_classCount));
 }
 
 BlockAllocator::~BlockAllocator()
 {
     luaalloc_delete(_LA);
+    delete _sys;
+}
+
+void BlockAllocator::releaseAll()
+{
+    // LuaAlloc's own state is in the list too, so this takes the whole thing down
+    for(SysBlock *b = _sys->head; b; )
+    {
+        SysBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    _sys->reserved = 0;
+    _sys->head = NULL;
+    _LA = luaalloc_create(_SysAlloc, _sys);
+    _used = 0;
+    memset(_classBytes, 0, sizeof(_classBytes));
+    memset(_classCount, 0, sizeof(_classCount));
+}
+
+inline void BlockAllocator::_count(size_t sz)
+{
+    const unsigned c = sizeClass(sz);
+    _classBytes[c] += sz;
+    ++_classCount[c];
+    _used += sz;
+    if(_peak < _used)
+        _peak = _used;
+}
+
+inline void BlockAllocator::_uncount(size_t sz)
+{
+    const unsigned c = sizeClass(sz);
+    _classBytes[c] -= sz;
+    --_classCount[c];
+    _used -= sz;
 }
 
 void* BlockAllocator::Alloc(size_t sz)
 {
-    return luaalloc(_LA, NULL, 0, sz);
+    void *p = luaalloc(_LA, NULL, 0, sz);
+    if(p)
+        _count(sz);
+    return p;
 }
 
 void* BlockAllocator::Realloc(void* p, size_t oldsize, size_t newsize)
 {
-    return luaalloc(_LA, p, oldsize, newsize);
+    void *np = luaalloc(_LA, p, oldsize, newsize);
+    if(np || !newsize)
+    {
+        if(p && oldsize)
+            _uncount(oldsize);
+        if(np)
+            _count(newsize);
+    }
+    return np;
 }
 
 void BlockAllocator::Free(void* p, size_t sz)
 {
     luaalloc(_LA, p, sz, 0);
+    if(p && sz)
+        _uncount(sz);
+}
+
+void BlockAllocator::swap(BlockAllocator& o)
+{
+    std::swap(_LA, o._LA);
+    std::swap(_sys, o._sys);
+    std::swap(_used, o._used);
+    std::swap(_peak, o._peak);
+    std::swap(_classBytes, o._classBytes);
+    std::swap(_classCount, o._classCount);
+}
+
+void BlockAllocator::addStats(MemStats& st) const
+{
+    st.used += _used;
+    st.reserved += _sys->reserved;
+    for(unsigned i = 0; i < MemStats::NUM_CLASSES; ++i)
+    {
+        st.classBytes[i] += _classBytes[i];
+        st.classCount[i] += _classCount[i];
+    }
 }
 
 
 
 // -----------------------------------------
 
+/* String pool internals:
+StrRef layout: [ generation:32 | slot index:28 | shard:4 ]
+Each shard has:
+- A table of slots, indexed by slot index. Each slot points to an Entry (or NULL if free).
+  The table is made of fixed-size chunks that never move; only the directory of chunks is ever reallocated.
+- An open-addressing hash table that maps string hashes to slot indices.
+- A block allocator for the entries. An entry holds the string's hash, length and refcount,
+  followed by the string itself.
+Readers only ever follow atomic pointers. A writer that needs to grow something builds a new copy,
+publishes it, and keeps the old one around until defrag() or destruction, as it may still be read.
+*/
+
+enum
+{
+    SHARD_BITS = 4,
+    MAX_SHARDS = 1 << SHARD_BITS,
+    INDEX_BITS = 32 - SHARD_BITS,
+    CHUNK_BITS = 8,
+    CHUNK_SIZE = 1 << CHUNK_BITS,
+    INITIAL_TABLE_SIZE = 16, // power of 2
+};
+
+static constexpr u64 TOMBSTONE = u64(-1); // can't be a valid hash table value since the index is < 2^28
+
+struct StrEntry
+{
+    u64 hash;
+    u32 len;
+    std::atomic<u32> refcount;
+    // followed by len bytes + \0
+
+    inline const char *str() const { return reinterpret_cast<const char*>(this + 1); }
+    inline char *str() { return reinterpret_cast<char*>(this + 1); }
+    inline size_t allocSize() const { return sizeof(*this) + len + 1; }
+};
+
+struct StrSlot
+{
+    std::atomic<StrEntry*> e;
+    std::atomic<u32> gen;
+    u32 nextfree; // index + 1, 0 ends the free list
+};
+
+struct StrSlotDir
+{
+    u32 cap; // number of chunk pointers
+    StrSlot *chunks[1]; // actually [cap]
+};
+
+struct StrHashTable
+{
+    u32 mask;
+    u32 used; // live entries; only touched by writers
+    u32 dead; // tombstones; only touched by writers
+    std::atomic<u64> slots[1]; // actually [mask+1]. (hash tag:32 | slot index + 1:32), 0 if empty
+};
+
+// 64 bit hash over 8 bytes at a time
+static u64 hashStr(const char *s, size_t len)
+{
+    const u64 M = 0x9e3779b97f4a7c15ull;
+    u64 h = u64(len) * M;
+    for( ; len >= 8; s += 8, len -= 8)
+    {
+        u64 w;
+        memcpy(&w, s, 8);
+        h = (h ^ (w * M)) * M;
+        h ^= h >> 29;
+    }
+    if(len)
+    {
+        u64 w = 0;
+        memcpy(&w, s, len);
+        h = (h ^ (w * M)) * M;
+    }
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ull;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline unsigned refShard(StrRef r) { return unsigned(r) & (MAX_SHARDS - 1); }
+static inline u32 refIndex(StrRef r) { return u32(r) >> SHARD_BITS; }
+static inline u32 refGen(StrRef r) { return u32(r >> 32); }
+static inline StrRef makeRef(unsigned shard, u32 idx, u32 gen)
+{
+    return (u64(gen) << 32) | (u64(idx) << SHARD_BITS) | shard;
+}
+static inline u32 hashTag(u64 h) { return u32(h >> 32); }
+static inline u32 hashProbe(u64 h) { return u32(h) >> SHARD_BITS; }
+
+struct StringPool::Shard
+{
+    mutable std::mutex mtx;
+    std::atomic<StrSlotDir*> dir;
+    std::atomic<StrHashTable*> table;
+    std::atomic<u32> nslots; // slots in use so far, including free ones
+    u32 freelist; // index + 1 of first free slot, 0 if none
+    BlockAllocator alloc; // for entries
+    std::vector<void*> retired; // old dirs and tables that readers might still be looking at
+    std::atomic<size_t> retiredBytes; // only changed with the lock held
+
+    Shard() : dir(NULL), table(NULL), nslots(0), freelist(0), retiredBytes(0) {}
+
+    ~Shard()
+    {
+        alloc.releaseAll(); // all entries at once
+        StrSlotDir *d = dir.load(std::memory_order_relaxed);
+        if(d)
+        {
+            for(u32 i = 0; i < d->cap; ++i)
+                free(d->chunks[i]);
+            free(d);
+        }
+        free(table.load(std::memory_order_relaxed));
+        freeRetired();
+    }
+
+    size_t freeRetired()
+    {
+        for(size_t i = 0; i < retired.size(); ++i)
+            free(retired[i]);
+        retired.clear();
+        return retiredBytes.exchange(0, std::memory_order_relaxed);
+    }
+
+    static size_t tableSize(const StrHashTable *t)
+    {
+        return sizeof(StrHashTable) + size_t(t->mask) * sizeof(std::atomic<u64>);
+    }
+
+    static size_t dirSize(const StrSlotDir *d)
+    {
+        return sizeof(StrSlotDir) + (d->cap - 1) * sizeof(StrSlot*);
+    }
+
+    static inline StrSlot& _slot(StrSlotDir *d, u32 idx)
+    {
+        return d->chunks[idx >> CHUNK_BITS][idx & (CHUNK_SIZE - 1)];
+    }
+
+    // --- lock-free ---
+
+    const StrSlot *getSlot(u32 idx) const
+    {
+        if(idx >= nslots.load(std::memory_order_acquire))
+            return NULL;
+        return &_slot(dir.load(std::memory_order_acquire), idx);
+    }
+
+    const StrEntry *getEntry(StrRef r) const
+    {
+        const StrSlot *slot = getSlot(refIndex(r));
+        return slot && slot->gen.load(std::memory_order_relaxed) == refGen(r)
+            ? slot->e.load(std::memory_order_acquire)
+            : NULL;
+    }
+
+    // returns slot index + 1, or 0 if not found
+    u32 find(u64 h, const char *s, size_t len) const
+    {
+        const StrHashTable *t = table.load(std::memory_order_acquire);
+        if(!t)
+            return 0;
+        const u32 tag = hashTag(h);
+        for(u32 i = hashProbe(h) & t->mask; ; i = (i + 1) & t->mask)
+        {
+            const u64 v = t->slots[i].load(std::memory_order_acquire);
+            if(!v)
+                return 0;
+            if(v != TOMBSTONE && u32(v >> 32) == tag)
+            {
+                const u32 idx = u32(v) - 1;
+                const StrEntry *e = _slot(dir.load(std::memory_order_acquire), idx).e.load(std::memory_order_acquire);
+                if(e && e->len == len && !memcmp(e->str(), s, len))
+                    return idx + 1;
+            }
+        }
+    }
+
+    StrRef makeRefFor(unsigned shard, u32 idx) const
+    {
+        return makeRef(shard, idx, _slot(dir.load(std::memory_order_relaxed), idx).gen.load(std::memory_order_relaxed));
+    }
+
+    // --- must hold the lock ---
+
+    static StrHashTable *newTable(u32 size)
+    {
+        const size_t bytes = sizeof(StrHashTable) + (size - 1) * sizeof(std::atomic<u64>);
+        StrHashTable *t = (StrHashTable*)calloc(1, bytes); // all slots empty
+        if(t)
+            t->mask = size - 1;
+        return t;
+    }
+
+    static void tableInsert(StrHashTable *t, u64 h, u32 idx)
+    {
+        u32 i = hashProbe(h) & t->mask;
+        u64 v;
+        while((v = t->slots[i].load(std::memory_order_relaxed)) && v != TOMBSTONE)
+            i = (i + 1) & t->mask;
+        if(v == TOMBSTONE)
+            --t->dead;
+        ++t->used;
+        t->slots[i].store((u64(hashTag(h)) << 32) | (idx + 1), std::memory_order_release);
+    }
+
+    // Make a new table that has room for at least n entries, without tombstones
+    bool rebuildTable(u32 n)
+    {
+        u32 size = INITIAL_TABLE_SIZE;
+        while(size / 4 * 3 <= n)
+            size *= 2;
+        StrHashTable *t = newTable(size);
+        if(!t)
+            return false;
+        const u32 N = nslots.load(std::memory_order_relaxed);
+        StrSlotDir *d = dir.load(std::memory_order_relaxed);
+        for(u32 i = 0; i < N; ++i)
+            if(const StrEntry *e = _slot(d, i).e.load(std::memory_order_relaxed))
+                tableInsert(t, e->hash, i);
+        if(StrHashTable *old = table.exchange(t, std::memory_order_acq_rel))
+        {
+            retired.push_back(old);
+            retiredBytes.fetch_add(tableSize(old), std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool ensureTableRoom()
+    {
+        const StrHashTable *t = table.load(std::memory_order_relaxed);
+        if(t && (t->used + t->dead + 1) * 4 <= (t->mask + 1) * 3)
+            return true;
+        return rebuildTable(t ? t->used + 1 : 1);
+    }
+
+    // returns index of a fresh slot, or u32(-1) on failure
+    u32 newSlot()
+    {
+        if(freelist)
+        {
+            const u32 idx = freelist - 1;
+            freelist = _slot(dir.load(std::memory_order_relaxed), idx).nextfree;
+            return idx;
+        }
+
+        const u32 idx = nslots.load(std::memory_order_relaxed);
+        if(idx >= (1u << INDEX_BITS))
+            return u32(-1);
+        StrSlotDir *d = dir.load(std::memory_order_relaxed);
+        const u32 chunk = idx >> CHUNK_BITS;
+        if(!d || chunk >= d->cap)
+        {
+            const u32 newcap = d ? d->cap * 2 : 4;
+            StrSlotDir *nd = (StrSlotDir*)calloc(1, sizeof(StrSlotDir) + (newcap - 1) * sizeof(StrSlot*));
+            if(!nd)
+                return u32(-1);
+            nd->cap = newcap;
+            if(d)
+                memcpy(nd->chunks, d->chunks, d->cap * sizeof(StrSlot*));
+            dir.store(nd, std::memory_order_release);
+            if(d)
+            {
+                retired.push_back(d);
+                retiredBytes.fetch_add(dirSize(d), std::memory_order_relaxed);
+            }
+            d = nd;
+        }
+        if(!d->chunks[chunk])
+        {
+            StrSlot *c = (StrSlot*)calloc(CHUNK_SIZE, sizeof(StrSlot));
+            if(!c)
+                return u32(-1);
+            for(u32 i = 0; i < CHUNK_SIZE; ++i)
+                c[i].gen.store(1, std::memory_order_relaxed); // a StrRef is never 0
+            d->chunks[chunk] = c;
+        }
+        nslots.store(idx + 1, std::memory_order_release);
+        return idx;
+    }
+
+    // returns slot index + 1, or 0 on failure
+    u32 insert(u64 h, const char *s, size_t len)
+    {
+        if(len >= u32(-1) - sizeof(StrEntry) || !ensureTableRoom())
+            return 0;
+        const u32 idx = newSlot();
+        if(idx == u32(-1))
+            return 0;
+        StrEntry *e = (StrEntry*)alloc.Alloc(sizeof(StrEntry) + len + 1);
+        if(!e)
+        {
+            StrSlot& slot = _slot(dir.load(std::memory_order_relaxed), idx);
+            slot.nextfree = freelist;
+            freelist = idx + 1;
+            return 0;
+        }
+        e->hash = h;
+        e->len = u32(len);
+        e->refcount.store(0, std::memory_order_relaxed);
+        memcpy(e->str(), s, len);
+        e->str()[len] = 0;
+        _slot(dir.load(std::memory_order_relaxed), idx).e.store(e, std::memory_order_release);
+        tableInsert(table.load(std::memory_order_relaxed), h, idx);
+        return idx + 1;
+    }
+
+    void discard(u32 idx)
+    {
+        StrSlot& slot = _slot(dir.load(std::memory_order_relaxed), idx);
+        StrEntry *e = slot.e.load(std::memory_order_relaxed);
+        StrHashTable *t = table.load(std::memory_order_relaxed);
+        const u64 v = (u64(hashTag(e->hash)) << 32) | (idx + 1);
+        for(u32 i = hashProbe(e->hash) & t->mask; ; i = (i + 1) & t->mask)
+        {
+            const u64 x = t->slots[i].load(std::memory_order_relaxed);
+            assert(x && "string not in hash table");
+            if(x == v)
+            {
+                t->slots[i].store(TOMBSTONE, std::memory_order_release);
+                --t->used;
+                ++t->dead;
+                break;
+            }
+        }
+
+        slot.e.store(NULL, std::memory_order_release);
+        u32 gen = slot.gen.load(std::memory_order_relaxed) + 1;
+        slot.gen.store(gen ? gen : 1, std::memory_order_relaxed);
+        slot.nextfree = freelist;
+        freelist = idx + 1;
+        alloc.Free(e, e->allocSize());
+    }
+
+    // --- for stats only; no lock needed but may be slightly off ---
+
+    u32 count() const
+    {
+        const StrHashTable *t = table.load(std::memory_order_acquire);
+        return t ? t->used : 0;
+    }
+
+    size_t tableBytes() const
+    {
+        size_t n = 0;
+        if(const StrHashTable *t = table.load(std::memory_order_acquire))
+            n += tableSize(t);
+        if(const StrSlotDir *d = dir.load(std::memory_order_acquire))
+        {
+            n += dirSize(d);
+            n += ((size_t(nslots.load(std::memory_order_relaxed)) + CHUNK_SIZE - 1) >> CHUNK_BITS) * CHUNK_SIZE * sizeof(StrSlot);
+        }
+        return n + retiredBytes.load(std::memory_order_relaxed);
+    }
+
+    // Drop every entry. Bumping the generations keeps old StrRefs from resolving to whatever
+    // ends up in the same slot later; chunks, dir and table are kept and reused as they are.
+    void clear()
+    {
+        const u32 n = nslots.load(std::memory_order_relaxed);
+        StrSlotDir *d = dir.load(std::memory_order_relaxed);
+        for(u32 i = 0; i < n; ++i)
+        {
+            StrSlot& slot = _slot(d, i);
+            if(StrEntry *e = slot.e.load(std::memory_order_relaxed))
+            {
+                slot.e.store(NULL, std::memory_order_release);
+                const u32 gen = slot.gen.load(std::memory_order_relaxed) + 1;
+                slot.gen.store(gen ? gen : 1, std::memory_order_relaxed);
+            }
+        }
+        alloc.releaseAll();
+        if(StrHashTable *t = table.load(std::memory_order_relaxed))
+        {
+            for(u32 i = 0; i <= t->mask; ++i)
+                t->slots[i].store(0, std::memory_order_relaxed);
+            t->used = 0;
+            t->dead = 0;
+        }
+        nslots.store(0, std::memory_order_release);
+        freelist = 0;
+        freeRetired();
+    }
+};
+
 StringPool::StringPool(PoolSize s)
+    : _shards(NULL), _nshards(MAX_SHARDS)
 {
-    strpool_config_t c = strpool_default_config;
-    int div = 0;
     switch(s)
     {
         case TINY:
-            div = 8;
-            c.min_length = 8;
+            _nshards = 1;
             break;
 
         case SMALL:
-            div = 4;
+            _nshards = 4;
             break;
 
         case DEFAULT:
             break;
     }
-    if(div)
-    {
-        c.entry_capacity /= div;
-        c.block_capacity /= div;
-        c.block_size /= div;
-    }
-    //c.memctx = getLuaAllocPtr();
-    strpool_init(&_sp, &c);
+    _shards = new Shard[_nshards];
 }
 
 StringPool::~StringPool()
 {
-    strpool_term(&_sp);
+    delete [] _shards;
 }
 
-
-
-// HACK // FIXME
-// Since the dumb stringpool thing uses 0 for "" and for NULL, we use u64(-1) for "".
-// Ideally we'd replace the string pool impl with something sensible,
-// but this should do for now considering that the generation count of u64(-1) is so high
-// that in practice it's never reached. So that value *should* be safe. For now.
-
-static constexpr u64 EMPTY_REF = u64(-1);
-
 const char* StringPool::getS(StrRef s) const
 {
-    return s != EMPTY_REF ? strpool_cstr(&_sp, s) : "";
+    const StrEntry *e = refShard(s) < _nshards ? _shards[refShard(s)].getEntry(s) : NULL;
+    return e ? e->str() : NULL;
 }
 
 PoolStr StringPool::getSL(StrRef s) const
 {
-    PoolStr ps;
-    if (s != EMPTY_REF)
+    PoolStr ps { NULL, 0 };
+    if(const StrEntry *e = refShard(s) < _nshards ? _shards[refShard(s)].getEntry(s) : NULL)
     {
-        ps.s = getS(s);
-        ps.len = (size_t)strpool_length(&_sp, s);
-    }
-    else
-    {
-        ps.s = "";
-        ps.len = 0;
+        ps.s = e->str();
+        ps.len = e->len;
     }
     return ps;
 }
 
 size_t StringPool::getL(StrRef s) const
 {
-    return (size_t)strpool_length(&_sp, s);
+    const StrEntry *e = refShard(s) < _nshards ? _shards[refShard(s)].getEntry(s) : NULL;
+    return e ? e->len : 0;
+}
+
+size_t StringPool::getRefcount(StrRef s) const
+{
+    const StrEntry *e = refShard(s) < _nshards ? _shards[refShard(s)].getEntry(s) : NULL;
+    return e ? e->refcount.load(std::memory_order_relaxed) : 0;
 }
 
 StrRef StringPool::lookup(const char* s, size_t len) const
 {
     assert(s);
-    return *s ? strpool_lookup(&_sp, s, len) : EMPTY_REF; // unfortunately strpool insists on using int for length...
+    const u64 h = hashStr(s, len);
+    const unsigned shard = unsigned(h) & (_nshards - 1);
+    const u32 found = _shards[shard].find(h, s, len);
+    return found ? _shards[shard].makeRefFor(shard, found - 1) : 0;
 }
 
 StrRef StringPool::putNoRefcount(const char* s, size_t len)
 {
-    if (!*s)
-        return EMPTY_REF;
-    return strpool_inject(&_sp, s, len);
+    assert(s);
+    const u64 h = hashStr(s, len);
+    const unsigned shard = unsigned(h) & (_nshards - 1);
+    Shard& sh = _shards[shard];
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    //---------------------------------------
+    u32 found = sh.find(h, s, len);
+    if(!found)
+        found = sh.insert(h, s, len);
+    return found ? sh.makeRefFor(shard, found - 1) : 0;
 }
 
 void StringPool::increfS(StrRef s)
 {
-    strpool_incref(&_sp, s);
+    StrEntry *e = const_cast<StrEntry*>(_shards[refShard(s)].getEntry(s));
+    assert(e);
+    e->refcount.fetch_add(1, std::memory_order_relaxed);
 }
 
 StrRef StringPool::put(const char* s, size_t len)
 {
-    assert(len < (std::numeric_limits<int>::max()));
-    if (!len)
-        return EMPTY_REF;
-    StrRef ref = strpool_inject(&_sp, s, len);
-    strpool_incref(&_sp, ref);
+    assert(len < (std::numeric_limits<u32>::max()));
+    const u64 h = hashStr(s, len);
+    const unsigned shard = unsigned(h) & (_nshards - 1);
+    Shard& sh = _shards[shard];
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    //---------------------------------------
+    u32 found = sh.find(h, s, len);
+    if(!found)
+        found = sh.insert(h, s, len);
+    if(!found)
+        return 0;
+    const StrRef ref = sh.makeRefFor(shard, found - 1);
+    const_cast<StrEntry*>(sh.getEntry(ref))->refcount.fetch_add(1, std::memory_order_relaxed);
     return ref;
 }
 
 const char* StringPool::putS(const char* s, size_t len)
 {
     assert(s);
-    return *s ? strpool_cstr(&_sp, this->put(s, len)) : s;
+    return getS(this->put(s, len));
 }
 
 void StringPool::freeS(StrRef s)
 {
-    if (s == EMPTY_REF)
+    Shard& sh = _shards[refShard(s)];
+    StrEntry *e = const_cast<StrEntry*>(sh.getEntry(s));
+    if(!e)
         return;
-    if (!strpool_decref(&_sp, s))
-        strpool_discard(&_sp, s);
+    const u32 prev = e->refcount.fetch_sub(1, std::memory_order_acq_rel);
+    assert(prev);
+    if(prev == 1)
+    {
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        //---------------------------------------
+        // Someone may have put() it again in the meantime
+        if(sh.getEntry(s) == e && !e->refcount.load(std::memory_order_acquire))
+            sh.discard(refIndex(s));
+    }
 }
 
-StringPool::StrColl StringPool::collate() const
+size_t StringPool::iterate(IterateCallback cb, void *ud) const
 {
-    int n = 0;
-    char * const coll = strpool_collate(&_sp, &n);
-    StrColl v(n);
-    const char *p = coll;
-    for(int i = 0; i < n; ++i)
+    size_t n = 0;
+    for(unsigned shard = 0; shard < _nshards; ++shard)
     {
-        std::string& s = v[i].s;
-        s = p;
-        p += s.length() + 1;
-        v[i].ref = strpool_lookup(&_sp, s.c_str(), (int)s.length());
-        v[i].count = strpool_getref(&_sp, v[i].ref);
+        const Shard& sh = _shards[shard];
+        const u32 N = sh.nslots.load(std::memory_order_acquire);
+        for(u32 i = 0; i < N; ++i)
+        {
+            const StrSlot *slot = sh.getSlot(i);
+            if(const StrEntry *e = slot->e.load(std::memory_order_acquire))
+            {
+                const PoolStr ps { e->str(), e->len };
+                cb(ud, makeRef(shard, i, slot->gen.load(std::memory_order_relaxed)), ps, e->refcount.load(std::memory_order_relaxed));
+                ++n;
+            }
+        }
     }
+    return n;
+}
 
-    strpool_free_collated(&_sp, coll);
+static void _collateOne(void *ud, StrRef ref, PoolStr s, size_t refcount)
+{
+    StringPool::StrColl& v = *static_cast<StringPool::StrColl*>(ud);
+    v.emplace_back();
+    StringPool::StrAndCount& sc = v.back();
+    sc.s.assign(s.s, s.len);
+    sc.count = refcount;
+    sc.ref = ref;
+}
+
+StringPool::StrColl StringPool::collate() const
+{
+    StrColl v;
+    iterate(_collateOne, &v);
     return v;
 }
 
+void StringPool::swap(StringPool& o)
+{
+    std::swap(_shards, o._shards);
+    std::swap(_nshards, o._nshards);
+}
+
 void StringPool::defrag()
 {
-    strpool_defrag(&_sp);
+    for(unsigned i = 0; i < _nshards; ++i)
+    {
+        Shard& sh = _shards[i];
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        //---------------------------------------
+        const StrHashTable *t = sh.table.load(std::memory_order_relaxed);
+        if(t && t->dead)
+            sh.rebuildTable(t->used);
+        sh.freeRetired();
+    }
+}
+
+void StringPool::clear()
+{
+    for(unsigned i = 0; i < _nshards; ++i)
+    {
+        Shard& sh = _shards[i];
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        //---------------------------------------
+        sh.clear();
+    }
+}
+
+size_t StringPool::usedBytes() const
+{
+    size_t n = 0;
+    for(unsigned i = 0; i < _nshards; ++i)
+    {
+        const Shard& sh = _shards[i];
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        //---------------------------------------
+        n += sh.alloc.usedBytes();
+    }
+    return n;
+}
+
+void StringPool::addStats(MemStats& st) const
+{
+    for(unsigned i = 0; i < _nshards; ++i)
+    {
+        const Shard& sh = _shards[i];
+        // The allocator's counters are only ever touched under the lock
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        //---------------------------------------
+        sh.alloc.addStats(st);
+        st.strBytes += sh.alloc.usedBytes();
+        st.strCount += sh.count();
+        st.strTables += sh.tableBytes();
+    }
+}
+
+bool StringPool::defragStep(float threshold, unsigned maxShards)
+{
+    bool more = false;
+    for(unsigned i = 0; i < _nshards; ++i)
+    {
+        Shard& sh = _shards[i];
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        //---------------------------------------
+        const StrHashTable *t = sh.table.load(std::memory_order_relaxed);
+        if(!t || !t->dead || t->dead < threshold * float(t->used + t->dead))
+            continue;
+        if(!maxShards)
+        {
+            more = true;
+            break;
+        }
+        // Readers may still be in the old table. It's retired and stays around until freeRetired().
+        sh.rebuildTable(t->used);
+        --maxShards;
+    }
+    return more;
+}
+
+size_t StringPool::freeRetired()
+{
+    size_t n = 0;
+    for(unsigned i = 0; i < _nshards; ++i)
+    {
+        Shard& sh = _shards[i];
+        std::lock_guard<std::mutex> lock(sh.mtx);
+        //---------------------------------------
+        n += sh.freeRetired();
+    }
+    return n;
+}
+
+size_t StringPool::retiredBytes() const
+{
+    size_t n = 0;
+    for(unsigned i = 0; i < _nshards; ++i)
+        n += _shards[i].retiredBytes.load(std::memory_order_relaxed);
+    return n;
+}
+
+float StringPool::fragmentation() const
+{
+    size_t used = 0, dead = 0;
+    for(unsigned i = 0; i < _nshards; ++i)
+        if(const StrHashTable *t = _shards[i].table.load(std::memory_order_acquire))
+        {
+            used += t->used;
+            dead += t->dead;
+        }
+    return dead ? float(dead) / float(used + dead) : 0.0f;
 }
 
 StrRef StringPool::translateS(const StringPool& other, StrRef s) const
@@ -172,7 +871,7 @@ StrRef StringPool::translateS(const StringPool& other, StrRef s) const
     if (this != &other)
     {
         PoolStr ps = other.getSL(s);
-        s = lookup(ps.s, ps.len);
+        s = ps.s ? lookup(ps.s, ps.len) : 0;
     }
     return s;
 }
@@ -3,7 +3,6 @@
 #include <stddef.h>
 #include <utility> // std::move
 #include "types.h"
-#include "strpool.h"
 #include <assert.h>
 #include <vector>
 #include <string>
@@ -55,6 +54,30 @@ T *mem_construct_move_from(T* const begin, T* const end, T *movebegin)
 
 struct LuaAlloc;
 
+// Snapshot of memory counters. Everything is in bytes unless noted otherwise.
+// The add*Stats() functions add to what's already there, so several owners can be summed up.
+struct MemStats
+{
+    // Size classes: 1..8, 9..16, 17..32, 33..64, 65..128, 129..256,
+    // and larger ones that bypass the block allocator and go straight to the system.
+    enum { NUM_CLASSES = 7 };
+
+    MemStats();
+    void add(const MemStats& o);
+
+    size_t used;     // handed out by block allocators
+    size_t reserved; // taken from the system by block allocators, incl. partially used blocks
+    size_t classBytes[NUM_CLASSES]; // used, per size class
+    size_t classCount[NUM_CLASSES]; // number of live allocations, per size class
+    size_t strBytes;    // string pool entries (part of used)
+    size_t strCount;    // number of strings in string pools
+    size_t strTables;   // string pool lookup tables (not part of reserved)
+    size_t extra;       // memory outside of any allocator that was counted by the owner
+
+    // Fraction of reserved memory that isn't in use; 0 if nothing is reserved
+    double fragmentation() const;
+};
+
 class BlockAllocator
 {
 public:
@@ -65,13 +88,47 @@ public:
     void* Realloc(void* p, size_t oldsize, size_t newsize);
     void Free(void* p, size_t sz);
 
+    void swap(BlockAllocator& o);
+
+    // Frees everything at once, including allocations that are still live.
+    // Every pointer handed out so far becomes invalid; the allocator is empty afterwards and can be used again.
+    void releaseAll();
+
+    // Bytes currently handed out, and the most that was ever handed out at once since the last resetPeak()
+    inline size_t usedBytes() const { return _used; }
+    inline size_t peakBytes() const { return _peak; }
+    inline void resetPeak() { _peak = _used; }
+
+    void addStats(MemStats& st) const;
+
     LuaAlloc *getLuaAllocPtr() { return _LA; }
     const LuaAlloc * getLuaAllocPtr() const { return _LA; }
 
 private:
+    BlockAllocator(const BlockAllocator&) = delete;
+    BlockAllocator& operator=(const BlockAllocator&) = delete;
+
+    void _count(size_t sz);
+    void _uncount(size_t sz);
+
+    struct SysBlock;
+    struct SysState;
+    static void *_SysAlloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
     LuaAlloc* _LA; // It's intended for Lua but it's ok as a stand-alone block allocator
+    SysState *_sys; // updated by the system allocator callback; lives on the heap so that it can follow _LA in swap()
+    size_t _used, _peak;
+    size_t _classBytes[MemStats::NUM_CLASSES];
+    size_t _classCount[MemStats::NUM_CLASSES];
 };
 
+/* Deduplicating string storage. Strings are refcounted and referred to by StrRef handles.
+- A StrRef is never 0, and stays valid and points to the same bytes until the string is dropped.
+- Lookups (lookup(), getS(), getSL(), getL()) take no locks and can run on any number of threads,
+  also while other threads insert strings. Inserting is split into shards that are locked separately.
+- Dropping strings (freeS() to 0, defrag()) must not run concurrently with anything that could
+  still use the dropped string, same as modifying a tree.
+*/
 class StringPool
 {
 public:
@@ -88,6 +145,7 @@ public:
     const char* getS(StrRef s) const;
     PoolStr getSL(StrRef s) const;
     size_t getL(StrRef s) const;
+    size_t getRefcount(StrRef s) const; // 0 if s is not a valid ref
 
     // lookup ref by string
     StrRef lookup(const char* s, size_t len) const;
@@ -115,12 +173,54 @@ public:
     };
     typedef std::vector<StrAndCount> StrColl;
 
-    StrColl collate() const; // quite expensive to call
+    StrColl collate() const; // copies all strings, use iterate() if that's not needed
+
+    // Calls cb for each string in the pool, in no particular order. Returns the number of strings.
+    // The PoolStr points into the pool, no copying is done.
+    typedef void (*IterateCallback)(void *ud, StrRef ref, PoolStr s, size_t refcount);
+    size_t iterate(IterateCallback cb, void *ud) const;
+
+    // Frees memory that lock-free readers may have been using, and cleans up the lookup tables.
+    // Strings don't move, so all StrRefs and pointers to strings stay valid.
     void defrag();
 
+    // Incremental defrag(), in two parts:
+    // defragStep() cleans up the lookup tables of up to maxShards shards where at least threshold (0..1)
+    // of the table entries are tombstones. Only takes the locks of those shards, one at a time,
+    // so it can run while other threads look up, insert, and drop strings.
+    // Returns true if there are more shards above the threshold.
+    bool defragStep(float threshold, unsigned maxShards = 1);
+    // Frees memory that lock-free readers may have been using; old tables from growing and from defragStep().
+    // Same rules as defrag(), but it only frees a few blocks and is done quickly.
+    // Returns the number of bytes freed.
+    size_t freeRetired();
+    size_t retiredBytes() const; // what freeRetired() would free
+    // Fraction of lookup table entries that are tombstones, over all shards
+    float fragmentation() const;
+
     // translate one foreign StrRef to own memory space. Does not add or incref in own pool.
     StrRef translateS(const StringPool& other, StrRef s) const;
 
+    void swap(StringPool& o);
+
+    // Drop all strings at once, regardless of their refcount. Keeps the lookup tables around for reuse.
+    // All StrRefs into this pool become invalid. Same rules as freeS().
+    void clear();
+
+    // Bytes used by the strings themselves, not counting lookup tables.
+    // Locks each shard's mutex briefly, one at a time.
+    size_t usedBytes() const;
+
+    // Locks each shard's mutex briefly, one at a time, so each shard's numbers are consistent.
+    // The totals may still be slightly off while other threads insert strings into other shards.
+    void addStats(MemStats& st) const;
+
+    struct Shard;
+
 private:
-    strpool_t _sp;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    Shard *_shards;
+    unsigned _nshards; // power of 2
 };
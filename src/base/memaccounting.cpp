@@ -0,0 +1,57 @@
+#include "memaccounting.h"
+#include <vector>
+#include <mutex>
+
+struct MemOwner
+{
+    const void *owner;
+    const char *tag;
+    MemAccounting::CollectFunc f;
+};
+
+// Owners come and go rarely (mostly tree snapshots), so a plain vector is fine
+static std::mutex s_mtx;
+static std::vector<MemOwner> s_owners;
+
+void MemAccounting::Add(const void* owner, const char* tag, CollectFunc f)
+{
+    std::lock_guard<std::mutex> lock(s_mtx);
+    //---------------------------------------
+    for(size_t i = 0; i < s_owners.size(); ++i)
+        if(s_owners[i].owner == owner)
+        {
+            s_owners[i].tag = tag;
+            s_owners[i].f = f;
+            return;
+        }
+    MemOwner o { owner, tag, f };
+    s_owners.push_back(o);
+}
+
+void MemAccounting::Remove(const void* owner)
+{
+    std::lock_guard<std::mutex> lock(s_mtx);
+    //---------------------------------------
+    for(size_t i = 0; i < s_owners.size(); ++i)
+        if(s_owners[i].owner == owner)
+        {
+            s_owners[i] = s_owners.back();
+            s_owners.pop_back();
+            return;
+        }
+}
+
+void MemAccounting::Collect(Totals& out)
+{
+    // Hold the lock throughout so that no owner can go away while it's being looked at
+    std::lock_guard<std::mutex> lock(s_mtx);
+    //---------------------------------------
+    for(size_t i = 0; i < s_owners.size(); ++i)
+    {
+        const MemOwner& o = s_owners[i];
+        Entry& e = out[o.tag];
+        ++e.owners;
+        if(!o.f(o.owner, e.stats))
+            ++e.busy;
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include "mem.h"
+
+// Registry of long-lived memory owners, grouped by the subsystem they belong to,
+// so that memory use can be inspected at runtime (see MemStatsHandler).
+// Collecting only reads counters; it doesn't walk any trees.
+class MemAccounting
+{
+public:
+    // Called during Collect(). Must take whatever lock owner needs for reading, and add its numbers to st.
+    // Must not call back into MemAccounting, and must not block for long; the registry stays locked meanwhile.
+    // Return false if the owner was too busy to be looked at.
+    typedef bool (*CollectFunc)(const void *owner, MemStats& st);
+
+    // Register owner under tag. tag must stay valid until Remove(); use a string literal.
+    // An owner that was already added is only re-tagged.
+    static void Add(const void *owner, const char *tag, CollectFunc f);
+    static void Remove(const void *owner);
+
+    struct Entry
+    {
+        MemStats stats;
+        size_t owners = 0;
+        size_t busy = 0; // owners that were skipped
+    };
+    typedef std::map<std::string, Entry> Totals;
+
+    // Sums up all owners per tag
+    static void Collect(Totals& out);
+};
@@ -1,6 +1,7 @@
 #include "osfunc.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include "util.h"
 
 #ifdef _WIN32
@@ -17,6 +18,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/dir.h>
+#include <sys/mman.h>
 #endif
 
 template<typename T>
@@ -128,3 +130,94 @@ bool dirlist(DirList & list, const char * path)
 
     return true;
 }
+
+bool replaceFile(const char *dst, const char *src)
+{
+#ifdef _WIN32
+    return !!MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    return !rename(src, dst);
+#endif
+}
+
+u64 getFileSize(const char *fn)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if(!GetFileAttributesExA(fn, GetFileExInfoStandard, &fad))
+        return 0;
+    return (u64(fad.nFileSizeHigh) << 32) | fad.nFileSizeLow;
+#else
+    struct stat st;
+    return stat(fn, &st) ? 0 : u64(st.st_size);
+#endif
+}
+
+MappedFile::MappedFile()
+    : _p(NULL), _sz(0)
+#ifdef _WIN32
+    , _hmap(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const char *fn)
+{
+    close();
+#ifdef _WIN32
+    HANDLE hf = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hf == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER sz;
+    if(GetFileSizeEx(hf, &sz) && sz.QuadPart > 0)
+    {
+        _hmap = CreateFileMappingA(hf, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(_hmap)
+        {
+            _p = MapViewOfFile(_hmap, FILE_MAP_READ, 0, 0, 0);
+            if(_p)
+                _sz = (size_t)sz.QuadPart;
+        }
+    }
+    CloseHandle(hf); // the mapping keeps the file open
+#else
+    int fd = ::open(fn, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(!fstat(fd, &st) && st.st_size > 0)
+    {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED)
+        {
+            _p = p;
+            _sz = (size_t)st.st_size;
+        }
+    }
+    ::close(fd); // the mapping keeps the file open
+#endif
+    if(!_p)
+        close();
+    return !!_p;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if(_p)
+        UnmapViewOfFile(_p);
+    if(_hmap)
+        CloseHandle(_hmap);
+    _hmap = NULL;
+#else
+    if(_p)
+        munmap(_p, _sz);
+#endif
+    _p = NULL;
+    _sz = 0;
+}
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <vector>
+#include "types.h"
 
 
 struct DirListEntry
@@ -29,3 +30,30 @@ typedef DirListEntry DirListEntryW;
 bool dirlist(DirList& list, const char *path);
 
 
+
+// Atomically replace dst with src. dst doesn't need to exist.
+bool replaceFile(const char *dst, const char *src);
+
+// 0 if the file doesn't exist
+u64 getFileSize(const char *fn);
+
+// Read-only memory mapping of a whole file. Pages are loaded lazily by the OS as they are accessed.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+    bool open(const char *fn); // fails for empty files
+    void close();
+    inline const char *data() const { return (const char*)_p; }
+    inline size_t size() const { return _sz; }
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    void *_p;
+    size_t _sz;
+#ifdef _WIN32
+    void *_hmap;
+#endif
+};
@@ -43,9 +43,12 @@ public:
 
     CountedPtr& operator=(const CountedPtr& ref)
     {
-        if(ref._p)
-            ref._p.incref();
+        T* const oldp = _p;
         _p = ref._p;
+        if(_p)
+            _p->incref(); // before decref, in case of self-assignment
+        if(oldp)
+            oldp->decref();
         return *this;
     }
     CountedPtr(CountedPtr&& ref) : _p(ref._p)
@@ -5,6 +5,7 @@
 #include "json_out.h"
 #include "bj.h"
 #include "zstdstream.h"
+#include "keyfilter.h"
 
 namespace serialize {
 
@@ -53,15 +54,23 @@ struct FILEAutoClose
     FILE * const fh;
 };
 
-static bool loadZstd(VarRef dst, BufferedReadStream& rs, Format fmt)
+static bool loadZstd(VarRef dst, BufferedReadStream& rs, Format fmt, const KeyFilter *filter)
 {
     char buf[1024 * 8];
     ZstdReadStream zs(rs, buf, sizeof(buf));
     zs.init();
-    return load(dst, zs, fmt);
+    return load(dst, zs, fmt, RAW, filter);
 }
 
-bool load(VarRef dst, const char* fn, Compression comp, Format fmt)
+// zstd frames start with 28 b5 2f fd
+// TODO: deflate starts with 78 followed by one of: 01/9c/da
+static Compression detectCompression(const char *p)
+{
+    static const unsigned char zstdMagic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+    return p && !memcmp(p, zstdMagic, sizeof(zstdMagic)) ? ZSTD : RAW;
+}
+
+bool load(VarRef dst, const char* fn, Compression comp, Format fmt, const KeyFilter *filter)
 {
     FILEAutoClose fh(fopen(fn, "rb"));
     if(!fh)
@@ -73,38 +82,36 @@ bool load(VarRef dst, const char* fn, Compression comp, Format fmt)
 
     deduceFromFileName(NULL, &comp, fn); // format detection is based on the actual data, not the file name
 
-    switch(comp)
-    {
-        case RAW: return load(dst, rs, fmt);
-        case ZSTD: return loadZstd(dst, rs, fmt);
-    }
-
-    return false;
+    return load(dst, rs, fmt, comp, filter);
 }
 
-// TODO: autodetect compression?
-// zstd starts with 28 b5 2f fd
-// deflate starts with 78 followed by one of: 01/9c/da
-bool load(VarRef dst, BufferedReadStream& rs, Format fmt)
+bool load(VarRef dst, BufferedReadStream& rs, Format fmt, Compression comp, const KeyFilter *filter)
 {
     rs.init(); // just in case
 
+    if(comp == AUTOC)
+        comp = detectCompression(rs.Peek4());
+    if(comp == ZSTD)
+        return loadZstd(dst, rs, fmt, filter);
+
     bool ret = false;
     Var tmp = std::move(*dst.v);
 
     if(fmt == AUTO)
-        if(const char *p = rs.Peek4())
-        {
-            if(bj::checkMagic4(p))
-                fmt = BJ;
-            else
-                fmt = JSON;
-        }
+    {
+        // Less than 4 bytes can't be BJ, but it may still be a tiny JSON value
+        const char *p = rs.Peek4();
+        fmt = p && bj::checkMagic4(p) ? BJ : JSON;
+    }
 
     if(fmt == JSON)
-        ret = loadJsonDestructive(dst, rs);
+        ret = loadJsonDestructive(dst, rs, filter);
     else if(fmt == BJ)
+    {
         ret = bj::decode_json(dst, rs);
+        if(ret && filter)
+            filter->apply(dst);
+    }
 
     if(!ret)
         std::swap(*dst.v, tmp);
@@ -5,6 +5,8 @@
 #include "jsonstreamwrapper.h"
 #include "variant.h"
 
+struct KeyFilter;
+
 namespace serialize {
 
 enum Format
@@ -21,8 +23,10 @@ enum Compression
     ZSTD
 };
 
-bool load(VarRef dst, const char *fn, Compression comp = AUTOC, Format fmt = AUTO);
-bool load(VarRef dst, BufferedReadStream& rs, Format fmt = AUTO);
+// AUTO/AUTOC: Compression is taken from the file name if possible, otherwise both are detected from the data
+// If filter is given, it's applied to the loaded data (JSON is filtered while parsing).
+bool load(VarRef dst, const char *fn, Compression comp = AUTOC, Format fmt = AUTO, const KeyFilter *filter = NULL);
+bool load(VarRef dst, BufferedReadStream& rs, Format fmt = AUTO, Compression comp = AUTOC, const KeyFilter *filter = NULL);
 
 bool save(const char *fn, VarCRef src, Compression comp = AUTOC, Format fmt = AUTO, int level = 3);
 bool save(BufferedWriteStream& ws, VarCRef src, Format fmt);
@@ -9,6 +9,38 @@
 #include "datatree.h"
 #include "serialize.h"
 #include "util.h"
+#include "tomcrypt/tomcrypt.h"
+
+// Passes through everything read from the process, and hashes it on the way.
+// Hashing happens before the parser sees the data, so in-situ parsing doesn't affect it.
+class HashingProcessReadStream : public ProcessReadStream
+{
+public:
+    HashingProcessReadStream(subprocess_s *proc, char *buf, size_t bufsz)
+        : ProcessReadStream(NULL, _Read, proc, DONTTOUCH, buf, bufsz)
+    {
+        sha256_desc.init(&_h);
+    }
+
+    // Reads and hashes whatever the parser didn't consume, then stores the hash
+    void finish(unsigned char *dst)
+    {
+        init();
+        while(!done())
+            advanceBuffered(availBuffered());
+        sha256_desc.done(&_h, dst);
+    }
+
+private:
+    static size_t _Read(void *dst, size_t bytes, BufferedReadStream *self)
+    {
+        const size_t rd = ProcessReadStream::_Read(dst, bytes, self);
+        sha256_desc.process(&static_cast<HashingProcessReadStream*>(self)->_h, (const unsigned char*)dst, (unsigned long)rd);
+        return rd;
+    }
+
+    hash_state _h;
+};
 
 static void procfail(ProcessReadStream& ps, const char *procname)
 {
@@ -21,7 +53,7 @@ static void procfail(ProcessReadStream& ps, const char *procname)
     if(!pos && !i)
         logerror("[%s] Did not produce output before it died", procname);
     else
-        logerror("[%s] JSON parse error after reading %u bytes, before:\n%s",
+        logerror("[%s] Parse error after reading %u bytes, before:\n%s",
             procname, unsigned(pos), os.str().c_str());
 }
 
@@ -76,27 +108,9 @@ bool loadJsonFromProcess(VarRef root, const char* const * args, const char * con
     return ok;
 }
 
-bool loadJsonFromProcess(VarRef root, subprocess_s* proc, const char* procname)
+// wait until the process exits. returns true if it exited successfully.
+static bool joinProcess(subprocess_s* proc, const char* procname)
 {
-    char buf[12*1024];
-    ProcessReadStream ps(proc, ProcessReadStream::DONTTOUCH, &buf[0], sizeof(buf));
-
-    bool ok = serialize::load(root, ps, serialize::AUTO);
-
-    if(ok)
-    {
-        logdebug("[%s] ingested, waiting until it exits...", procname);
-    }
-    else
-    {
-        procfail(ps, procname);
-        if(subprocess_alive(proc))
-        {
-            logerror("[%s] failed to parse and still alive, killing", procname);
-            subprocess_terminate(proc);
-        }
-    }
-
     int ret = 0;
     int err = subprocess_join(proc, &ret);
     if(err)
@@ -104,7 +118,6 @@ bool loadJsonFromProcess(VarRef root, subprocess_s* proc, const char* procname)
         logerror("[%s] subprocess_join failed", procname);
         return false;
     }
-    ok = !ret; // if the process reports failure, don't use it even if it's valid json
     logdebug("[%s] exited with code %d", procname, ret);
     if(subprocess_stderr(proc))
     {
@@ -125,7 +138,64 @@ bool loadJsonFromProcess(VarRef root, subprocess_s* proc, const char* procname)
         if(hdr)
             logerror("---- [%s] end stderr dump ----", procname);
     }
+    return !ret;
+}
+
+bool loadJsonFromProcess(VarRef root, subprocess_s* proc, const char* procname)
+{
+    char buf[12*1024];
+    ProcessReadStream ps(proc, ProcessReadStream::DONTTOUCH, &buf[0], sizeof(buf));
+
+    bool ok = serialize::load(root, ps, serialize::AUTO);
+
+    if(ok)
+    {
+        logdebug("[%s] ingested, waiting until it exits...", procname);
+    }
+    else
+    {
+        procfail(ps, procname);
+        if(subprocess_alive(proc))
+        {
+            logerror("[%s] failed to parse and still alive, killing", procname);
+            subprocess_terminate(proc);
+        }
+    }
+
+    // if the process reports failure, don't use it even if it's valid json
+    return joinProcess(proc, procname) && ok;
+}
 
+bool loadFromProcess(VarRef root, const char* const* args, const char* const* env, const KeyFilter *filter, unsigned char *sha256)
+{
+    subprocess_s proc;
+    if(!createProcess(&proc, args, env, subprocess_option_enable_async | subprocess_option_no_window))
+        return false;
+
+    char buf[12*1024];
+    HashingProcessReadStream ps(&proc, &buf[0], sizeof(buf));
+
+    bool ok = serialize::load(root, ps, serialize::AUTO, serialize::AUTOC, filter);
+
+    if(ok)
+    {
+        if(sha256)
+            ps.finish(sha256);
+        logdebug("[%s] ingested %zu bytes, waiting until it exits...", args[0], ps.Tell());
+    }
+    else
+    {
+        procfail(ps, args[0]);
+        if(subprocess_alive(&proc))
+        {
+            logerror("[%s] failed to parse and still alive, killing", args[0]);
+            subprocess_terminate(&proc);
+        }
+    }
+
+    // if the process reports failure, don't use it even if it's valid
+    ok = joinProcess(&proc, args[0]) && ok;
+    subprocess_destroy(&proc);
     return ok;
 }
 
@@ -195,5 +265,17 @@ void ProcessReadStream::terminate()
 size_t ProcessReadStream::_Read(void* dst, size_t bytes, BufferedReadStream* self)
 {
     ProcessReadStream* me = static_cast<ProcessReadStream*>(self);
-    return subprocess_read_stdout(me->_proc, (char*)dst, bytes);
+    // A pipe may return just a few bytes at a time. Make sure there's enough in the buffer
+    // to detect the format from the first bytes; a read of 0 means the process closed stdout.
+    const size_t want = bytes < 4 ? bytes : 4;
+    size_t done = 0;
+    do
+    {
+        const unsigned rd = subprocess_read_stdout(me->_proc, (char*)dst + done, unsigned(bytes - done));
+        if(!rd)
+            break;
+        done += rd;
+    }
+    while(done < want);
+    return done;
 }
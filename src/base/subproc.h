@@ -8,6 +8,7 @@
 
 struct subprocess_s;
 class DataTree;
+struct KeyFilter;
 
 // args[0] is the executable, args[1...] the params. args[] is terminated by a NULL entry.
 // output from process is parsed into json tree
@@ -15,6 +16,13 @@ bool loadJsonFromProcess(VarRef root, const char * const *args, const char *cons
 bool loadJsonFromProcess(VarRef root, const char * const *args, const char *const*env, int options);
 bool loadJsonFromProcess(VarRef root, subprocess_s *proc, const char *procname);
 
+// Run process and parse what it writes to stdout while it comes in.
+// Format and compression are detected from the data, see serialize::load(). filter is optional.
+// If sha256 is not NULL, it receives the hash of everything the process wrote to stdout,
+// including anything after the parsed value.
+// Fails if the process can't be started, the output can't be parsed, or it exits with an error.
+bool loadFromProcess(VarRef root, const char * const *args, const char *const*env, const KeyFilter *filter, unsigned char *sha256);
+
 // param can be either a string or an array
 // if it's a string, run that as process without params
 // if it's an array, index 0 is the file name and the rest are params
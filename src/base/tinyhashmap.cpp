@@ -26,6 +26,11 @@ void tinyhashmap_api_test()
 
     Var *p = m.getp(42);
 
+    Var removed;
+    m.erase(mem, 23, removed);
+    removed.clear(mem);
+    m.compact(mem);
+
     u64 x = 0;
     for(M::const_iterator it = m.begin(); it != m.end(); ++it)
         x += it.key();
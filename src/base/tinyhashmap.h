@@ -2,6 +2,7 @@
 
 #include "containers.h"
 #include <assert.h>
+#include <string.h>
 
 /* Put the HashHat on a vector to turn it into a rudimentary hashmap
 Optimized for:
@@ -10,12 +11,14 @@ Optimized for:
 - Little storage space overhead
 - Very fast lookup
 - Fast insert
-- Deleting individual keys is not possible
-- But clearing the entire thing is
+- Deleting individual keys leaves a hole in the value vector, which is compacted away
+  once enough of them have piled up (so erase is amortized O(1))
+- Clearing the entire thing is cheap
 - Assume that keys can not be constructed from the value, and non-copyable values.
-- Keys are stored in a bucket stucture
+- Keys are stored in a bucket stucture. Maps with only a few keys (the vast majority) skip the buckets
+  and keep their keys in a single flat array that is scanned linearly, until they outgrow it
 - Value backing memory is a simple linear vector and can be accessed via pointer + size
-  (without any holes in between)
+  (without any holes in between, unless keys were erased and it wasn't compacted yet)
 -> Trivial iteration over values
 - ... So all this thing does is to provide an index for the backing vector
 
@@ -36,6 +39,57 @@ die hard) I don't particularly care about that.
 // put #if 0 here to use std::unordered_map under the hood instead of the custom thing
 #if 1
 
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#  include <emmintrin.h>
+#  define HASHHAT_SSE2
+#endif
+
+// Scan keys[0..n) for k. Returns its position, or n if not found.
+// Keys are read in groups of 4, so keys must be readable up to n rounded up to a multiple of 4;
+// whatever is there past n is ignored.
+template<typename SZ>
+static inline SZ _HashHatFindKey(const StrRef *keys, SZ n, StrRef k)
+{
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi64x((long long)k);
+    for(SZ i = 0; i < n; i += 4)
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+        if(unsigned m = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, needle))))
+        {
+            SZ j = i;
+            for( ; !(m & 1); m >>= 1)
+                ++j;
+            return j < n ? j : n;
+        }
+    }
+    return n;
+#elif defined(HASHHAT_SSE2)
+    // SSE2 can only compare 32 bits at a time; a 64 bit key matches if both of its halves match
+    const __m128i needle = _mm_set1_epi64x((long long)k);
+    for(SZ i = 0; i < n; i += 2)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(keys + i));
+        __m128i c = _mm_cmpeq_epi32(v, needle);
+        c = _mm_and_si128(c, _mm_shuffle_epi32(c, _MM_SHUFFLE(2, 3, 0, 1)));
+        if(const int m = _mm_movemask_pd(_mm_castsi128_pd(c)))
+        {
+            const SZ j = i + !(m & 1);
+            return j < n ? j : n;
+        }
+    }
+    return n;
+#else
+    SZ i = 0;
+    for( ; i < n; ++i)
+        if(keys[i] == k)
+            break;
+    return i;
+#endif
+}
+
 template<typename Alloc>
 struct _HashHatPolicyBase
 {
@@ -58,37 +112,37 @@ public:
     {
         typedef _HashHatPolicyBase<Allocator> _Policy;
 
+        // Keys and indices share one allocation: StrRef[_cap] followed by SZ[_cap]
         StrRef *_keys;
-        SZ *_indices; // never contains 0
         SZ _cap;
         SZ _sz; // both arrays have the same length and capacity
 
-        Bucket() : _keys(NULL), _indices(NULL), _cap(0), _sz(0) {}
-        ~Bucket() { assert(!_keys && !_indices && "Bucket not cleared"); }
+        enum { ELEMSIZE = sizeof(StrRef) + sizeof(SZ) };
+
+        Bucket() : _keys(NULL), _cap(0), _sz(0) {}
+        ~Bucket() { assert(!_keys && "Bucket not cleared"); }
 
         Bucket(const Bucket&) = delete;
         Bucket& operator=(const Bucket&) = delete;
         Bucket& operator=(Bucket&&) = delete;
 
         Bucket(Bucket&& o) noexcept
-            : _keys(o._keys), _indices(o._indices), _cap(o._cap), _sz(o._sz)
+            : _keys(o._keys), _cap(o._cap), _sz(o._sz)
         {
             o._keys = NULL;
-            o._indices = NULL;
             o._cap = 0;
             o._sz = 0;
         }
 
         inline const StrRef *keys() const { return _keys; }
-        inline const SZ *indices() const { return _indices; }
-        inline SZ *indicesWritable() { return _indices; }
+        inline const SZ *indices() const { return (const SZ*)(_keys + _cap); } // never contains 0
+        inline SZ *indicesWritable() { return (SZ*)(_keys + _cap); }
 
         inline SZ size() const { return _sz; }
         inline void clear(Allocator& mem) { _sz = 0; }
         inline void swap(Bucket& o) noexcept
         {
             std::swap(_keys, o._keys);
-            std::swap(_indices, o._indices);
             std::swap(_cap, o._cap);
             std::swap(_sz, o._sz);
         }
@@ -96,20 +150,26 @@ public:
         SZ& _pushKey(Allocator& mem, StrRef k, SZ idx)
         {
             assert(!_cap == !_keys);
-            StrRef* akeys = _keys;
-            SZ *aidx = _indices;
             const SZ i = _sz++;
             if(i == _cap)
             {
-                SZ newcap = _cap + 4; // the hashmap is going to redistribute keys eventually, don't go too big
-                akeys = (StrRef*)mem.Realloc(akeys, _cap * sizeof(*_keys), newcap * sizeof(*_keys));
-                aidx = (SZ*)mem.Realloc(aidx, _cap * sizeof(*_indices), newcap * sizeof(*_indices));
+                // the hashmap is going to redistribute keys eventually, don't go too big.
+                // Must stay a multiple of 4 for _HashHatFindKey().
+                const SZ newcap = _cap + 4;
+                StrRef *akeys = (StrRef*)mem.Alloc(newcap * ELEMSIZE);
                 // FIXME: handle alloc failure
+                if(_keys)
+                {
+                    // the indices move up because the key array grows, so Realloc() is no use
+                    memcpy(akeys, _keys, i * sizeof(StrRef));
+                    memcpy(akeys + newcap, indices(), i * sizeof(SZ));
+                    mem.Free(_keys, _cap * ELEMSIZE);
+                }
                 _keys = akeys;
-                _indices = aidx;
                 _cap = newcap;
             }
-            akeys[i] = k;
+            SZ *aidx = indicesWritable();
+            _keys[i] = k;
             aidx[i] = idx;
             return aidx[i];
         }
@@ -119,13 +179,31 @@ public:
             return _pushKey(mem, k, 0);
         }
 
+        // remove key by moving the last key into its place. returns its index, 0 if not found.
+        SZ eraseKey(StrRef k)
+        {
+            const SZ i = find(k);
+            if(i == _sz)
+                return 0;
+            SZ *aidx = indicesWritable();
+            const SZ idx = aidx[i];
+            const SZ last = --_sz;
+            _keys[i] = _keys[last];
+            aidx[i] = aidx[last];
+            return idx;
+        }
+
+        // position of k, or size() if not there
+        inline SZ find(StrRef k) const
+        {
+            return _HashHatFindKey(_keys, _sz, k);
+        }
+
         void dealloc(Allocator& mem)
         {
             assert(!_cap == !_keys);
-            mem.Free(_keys, _cap * sizeof(*_keys));
-            mem.Free(_indices, _cap * sizeof(*_indices));
+            mem.Free(_keys, _cap * ELEMSIZE);
             _keys = NULL;
-            _indices = NULL;
             _cap = 0;
             _sz = 0;
         }
@@ -160,8 +238,8 @@ public:
             { return a._b != b._b || a._idx != b._idx; }
 
             StrRef key() const     { assert(_idx < _b->_sz); return _b->_keys[_idx]; }
-            T& value()             { assert(_idx < _b->_sz); return _b->_indices[_idx]; }
-            const T& value() const { assert(_idx < _b->_sz); return _b->_indices[_idx]; }
+            T& value()             { assert(_idx < _b->_sz); return _b->indices()[_idx]; }
+            const T& value() const { assert(_idx < _b->_sz); return _b->indices()[_idx]; }
             bool _done() const { return _idx >= _b->size(); }
 
             SZ _idx; // index in bucket
@@ -176,6 +254,11 @@ public:
 
     typedef LVector<Bucket, u32, typename Bucket::_Policy> Storage;
 
+    // Up to this many keys are kept in _small, without any hashing.
+    // Scanning that is about as fast as hashing the key and scanning a bucket,
+    // and it saves the bucket vector and all the per-bucket allocations.
+    enum { SMALL_MAX = 8 };
+
     HashHatKeyStore()
     {
     }
@@ -191,7 +274,7 @@ public:
     }
 
     HashHatKeyStore(HashHatKeyStore&& o) noexcept
-        : _buckets(std::move(o._buckets))
+        : _buckets(std::move(o._buckets)), _small(std::move(o._small))
     {
     }
 
@@ -203,70 +286,110 @@ public:
     const SZ getIndex(StrRef k) const
     {
         _Validkey(k);
-        if(_buckets.size())
-        {
-            const Bucket& b = _getbucket(k);
-            const SZ N = b.size();
-            const StrRef* const ka = b.keys();
-            for(SZ i = 0; i < N; ++i)
-                if(k == _Validkey(ka[i]))
-                    return b.indices()[i];
-        }
-        return 0;
+        const Bucket& b = _buckets.size() ? _getbucket(k) : _small;
+        const SZ i = b.find(k);
+        return i < b.size() ? b.indices()[i] : 0;
     }
 
+    // still using the flat key array instead of buckets?
+    inline bool isSmall() const { return !_buckets.size(); }
+
     inline static StrRef _Validkey(StrRef k)
     {
         assert(k);
         return k;
     }
 
+    // Pooled StrRefs already carry well-spread bits at the bottom (slot index + hash-picked shard),
+    // and consecutive handles landing in consecutive buckets is good for the cache.
+    // Fold the upper half in so that keys differing only there don't all pile into one bucket.
+    inline static SZ _Bucketidx(StrRef k, SZ mask)
+    {
+        return SZ(k ^ (k >> 32u)) & mask;
+    }
+
     // return location of new index to write. if it's 0, the index is new and must be updated.
     // Do NOT write 0 there!
     SZ& insertIndex(Allocator& mem, SZ cursize, StrRef k)
     {
         _Validkey(k);
         Bucket *b;
+        if(isSmall())
+        {
+            const SZ i = _small.find(k);
+            if(i < _small.size())
+                return _small.indicesWritable()[i];
+            if(_small.size() < SMALL_MAX)
+                return _small.pushNewKey(mem, k);
+            // Full; switch to buckets
+        }
         // Load factor: in average 8 elements ber bucket
         if((cursize >> 3u) >= _buckets.size())
         {
             SZ newsize = _buckets.size() * 2;
             SZ mask = resize(mem, newsize < 4 ? 4 : newsize);
-            b = &_buckets[k & mask]; // bucket vector was realloc'd, fix ptr
+            b = &_buckets[_Bucketidx(k, mask)]; // bucket vector was realloc'd, fix ptr
         }
         else
             b = &_getbucket(k);
 
-        const SZ N = b->size();
-        const StrRef* const ka = b->keys();
-        for (SZ i = 0; i < N; ++i)
-            if (k == _Validkey(ka[i]))
-                return b->indicesWritable()[i];
+        const SZ i = b->find(k);
+        if(i < b->size())
+            return b->indicesWritable()[i];
 
         return b->pushNewKey(mem, k);
     }
 
+    // remove key; returns the index it had, 0 if not found
+    SZ erase(StrRef k)
+    {
+        _Validkey(k);
+        return (isSmall() ? _small : _getbucket(k)).eraseKey(k);
+    }
+
+    // replace each stored index i with newidx[i - 1]
+    void remap(const SZ *newidx)
+    {
+        _Remap(_small, newidx);
+        for(SZ j = 0; j < _buckets.size(); ++j)
+            _Remap(_buckets[j], newidx);
+    }
+
+    // grow the bucket count so that n keys can be inserted without rehashing
+    void reserve(Allocator& mem, SZ n)
+    {
+        if(n <= SMALL_MAX && isSmall())
+            return;
+        SZ newsize = _buckets.size() < 4 ? 4 : _buckets.size();
+        while((n >> 3u) >= newsize)
+            newsize *= 2;
+        if(newsize > _buckets.size())
+            resize(mem, newsize);
+    }
+
     SZ resize(Allocator& mem, SZ newsize)
     {
         const SZ B = _buckets.size();
         _buckets.resize(mem, newsize);
         SZ newmask = newsize - 1;
         Bucket tmp;
-        for(SZ j = 0; j < B; ++j)
+        tmp.swap(_small); // when coming from small mode, distribute those keys first
+        for(SZ j = 0; ; ++j)
         {
-            tmp.clear(mem);
-            Bucket& src = _buckets[j];
-            tmp.swap(src);
             const SZ N = tmp.size();
             const StrRef *tkeys = tmp.keys();
             const SZ *tidx = tmp.indices();
             for(SZ i = 0; i < N; ++i)
             {
-                const SZ bidx = tkeys[i] & newmask;
+                const SZ bidx = _Bucketidx(tkeys[i], newmask);
                 assert(bidx < _buckets.size());
                 Bucket& dst = _buckets[bidx];
                 dst._pushKey(mem, tkeys[i], tidx[i]);
             }
+            if(j >= B)
+                break;
+            tmp.clear(mem);
+            tmp.swap(_buckets[j]);
         }
         tmp.dealloc(mem);
         return newmask;
@@ -274,12 +397,14 @@ public:
 
     void clear(Allocator& mem)
     {
+        _small.clear(mem);
         for(SZ i = 0; i < _buckets.size(); ++i)
             _buckets[i].clear(mem);
     }
 
     void dealloc(Allocator& mem)
     {
+        _small.dealloc(mem);
         for(SZ i = 0; i < _buckets.size(); ++i)
             _buckets[i].dealloc(mem);
         _buckets.dealloc(mem);
@@ -344,32 +469,44 @@ public:
 
     const_iterator begin() const
     {
-        return const_iterator(_buckets.data(), _buckets.size())._advanceIfEmpty();
+        return isSmall()
+            ? const_iterator(&_small, 1)._advanceIfEmpty()
+            : const_iterator(_buckets.data(), _buckets.size())._advanceIfEmpty();
     }
     const_iterator end() const
     {
-        return const_iterator(_buckets.data() + _buckets.size(), 0);
+        return isSmall()
+            ? const_iterator(&_small + 1, 0)
+            : const_iterator(_buckets.data() + _buckets.size(), 0);
     }
 
 private:
 
+    static void _Remap(Bucket& b, const SZ *newidx)
+    {
+        SZ *idx = b.indicesWritable();
+        for(SZ i = 0; i < b.size(); ++i)
+            idx[i] = newidx[idx[i] - 1];
+    }
+
     inline SZ _mask() const { return _buckets.size() - 1; }
 
     inline Bucket& _getbucket(StrRef k)
     {
-        const SZ idx = k & _mask();
+        const SZ idx = _Bucketidx(k, _mask());
         assert(idx < _buckets.size());
         return _buckets[idx];
     }
 
     inline const Bucket& _getbucket(StrRef k) const
     {
-        const SZ idx = k & _mask();
+        const SZ idx = _Bucketidx(k, _mask());
         assert(idx < _buckets.size());
         return _buckets[idx];
     }
 
-    Storage _buckets;
+    Storage _buckets; // empty while in small mode
+    Bucket _small; // only used while _buckets is empty
 };
 
 template<typename Vec>
@@ -439,6 +576,49 @@ public:
         return _insert_always(dst, vec, mem, k, std::move(value_type()));
     }
 
+    void reserve(Vec& vec, Allocator& mem, SZ n)
+    {
+        vec.reserve(mem, n);
+        ks.reserve(mem, n);
+    }
+
+    // remove key and move its value out. The value's slot stays behind as a hole until compact().
+    bool erase(Vec& vec, StrRef k, value_type& removed)
+    {
+        const SZ idx = ks.erase(k);
+        if(!idx)
+            return false;
+        removed = std::move(vec[idx - 1]);
+        return true;
+    }
+
+    // close the holes left by erase(): move all values that still have a key to the front
+    bool compact(Vec& vec, Allocator& mem)
+    {
+        const SZ N = vec.size();
+        if(!N)
+            return true;
+        SZ *newidx = (SZ*)mem.Alloc(N * sizeof(SZ));
+        if(!newidx)
+            return false;
+        for(SZ i = 0; i < N; ++i)
+            newidx[i] = 0;
+        for(typename KS::const_iterator it = ks.begin(); it != ks.end(); ++it)
+            newidx[it.value() - 1] = 1; // mark as used
+        SZ n = 0;
+        for(SZ i = 0; i < N; ++i)
+            if(newidx[i])
+            {
+                if(i != n)
+                    vec[n] = std::move(vec[i]);
+                newidx[i] = ++n;
+            }
+        ks.remap(newidx);
+        vec.resize(mem, n); // what's left at the end was moved from
+        mem.Free(newidx, N * sizeof(SZ));
+        return true;
+    }
+
     value_type *getp(Vec& vec, StrRef k)
     {
         const SZ idx = ks.getIndex(k);
@@ -520,6 +700,7 @@ private:
     typedef typename Policy::Allocator Allocator;
     HashHat<TVec> _hh;
     TVec _vec;
+    SZ _holes; // erased values that are still in _vec
 
 public:
     typedef typename HH::iterator iterator;
@@ -530,18 +711,20 @@ public:
     TinyHashMap& operator=(const TinyHashMap&) = delete;
 
     TinyHashMap()
+        : _holes(0)
     {
     }
     TinyHashMap(Allocator& mem, SZ prealloc)
-        : _vec(mem, prealloc, typename TVec::ReserveTag{} )
+        : _vec(mem, prealloc, typename TVec::ReserveTag{} ), _holes(0)
     {
     }
     ~TinyHashMap()
     {
     }
     TinyHashMap(TinyHashMap&& o) noexcept
-        : _hh(std::move(o._hh)), _vec(std::move(o._vec))
+        : _hh(std::move(o._hh)), _vec(std::move(o._vec)), _holes(o._holes)
     {
+        o._holes = 0;
     }
     TinyHashMap& operator=(TinyHashMap&& o) noexcept = delete;
     /*{
@@ -554,9 +737,10 @@ public:
         return *this;
     }*/
 
+    // make room for n values, and size the key index so that it doesn't need to grow until then
     void reserve(Allocator& mem, SZ n)
     {
-        _vec.reserve(mem, n);
+        _hh.reserve(_vec, mem, n + _holes);
     }
 
     InsertResult insert(Allocator& mem, StrRef k, T&& v, T& prev)
@@ -569,6 +753,25 @@ public:
         return _hh.insert_new(_vec, mem, k);
     }
 
+    // remove key and move its value into removed, which must be empty.
+    // Compacts the storage when at least half of it is holes.
+    // Invalidates iterators and pointers to values.
+    bool erase(Allocator& mem, StrRef k, T& removed)
+    {
+        if(!_hh.erase(_vec, k, removed))
+            return false;
+        ++_holes;
+        if(_holes * 2 >= _vec.size())
+            compact(mem);
+        return true;
+    }
+
+    void compact(Allocator& mem)
+    {
+        if(_holes && _hh.compact(_vec, mem))
+            _holes = 0;
+    }
+
     T* getp(StrRef k)
     {
         return _hh.getp(_vec, k);
@@ -584,18 +787,20 @@ public:
     const_iterator begin() const { return _hh.begin(_vec.data()); }
     const_iterator end()   const { return _hh.end(_vec.data()); }
 
-    SZ size() const { return _vec.size(); }
-    bool empty() const { return _vec.empty(); }
+    SZ size() const { return _vec.size() - _holes; }
+    bool empty() const { return !size(); }
     void clear(Allocator& mem)
     {
         _vec.clear(mem);
         _hh.clear(mem);
+        _holes = 0;
     }
 
     void dealloc(Allocator& mem)
     {
         _vec.dealloc(mem);
         _hh.dealloc(mem);
+        _holes = 0;
     }
 
     // inserts key; makes room for new value; returns ptr to value
@@ -604,15 +809,17 @@ public:
         return insert_new(mem, k).ptr;
     }
 
+    // may contain holes left by erase()
     inline const TVec& values() const
     {
         return _vec;
     }
 
-    // drop keys, return values as vec
+    // drop keys, return values as vec (erased values are left as moved-from holes)
     TVec unlink(Allocator& mem)
     {
         _hh.dealloc(mem);
+        _holes = 0;
         TVec ret = std::move(_vec);
         return ret;
     }
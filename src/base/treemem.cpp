@@ -10,3 +10,57 @@ TreeMem::TreeMem(StringPool::PoolSize size)
 TreeMem::~TreeMem()
 {
 }
+
+void TreeMem::swap(TreeMem& o)
+{
+    BlockAllocator::swap(o);
+    StringPool::swap(o);
+}
+
+void TreeMem::addStats(MemStats& st) const
+{
+    BlockAllocator::addStats(st);
+    StringPool::addStats(st);
+}
+
+StrTranslator::StrTranslator(TreeMem& dst, const StringPool& src)
+    : _dst(dst), _src(src)
+{
+}
+
+StrTranslator::~StrTranslator()
+{
+    for(TinyHashMap<StrRef>::const_iterator it = _memo.begin(); it != _memo.end(); ++it)
+        _dst.freeS(it.value());
+    _memo.dealloc(_dst);
+}
+
+StrRef StrTranslator::get(StrRef s)
+{
+    if(!s)
+        return 0;
+    if(const StrRef *p = _memo.getp(s))
+        return *p;
+
+    // Same as StringPool::translateS(), but also inserts
+    const PoolStr ps = _src.getSL(s);
+    if(!ps.s)
+        return 0;
+
+    // A string that is referenced only once can't come up again, no point in remembering it
+    if(_src.getRefcount(s) < 2)
+        return _dst.putNoRefcount(ps.s, ps.len);
+
+    const StrRef r = _dst.put(ps.s, ps.len);
+    if(!r)
+        return 0;
+
+    StrRef *dst = _memo.at(_dst, s);
+    if(!dst)
+    {
+        _dst.freeS(r);
+        return 0;
+    }
+    *dst = r;
+    return r;
+}
@@ -11,7 +11,7 @@ passed to the allocation.
 #pragma once
 
 #include "types.h"
-#include "containers.h"
+#include "tinyhashmap.h"
 
 
 struct LuaAlloc;
@@ -24,4 +24,34 @@ class TreeMem : public BlockAllocator, public StringPool
 public:
     TreeMem(StringPool::PoolSize size);
     ~TreeMem();
+
+    // Exchange all memory with another TreeMem. Everything allocated from one is owned by the other afterwards.
+    void swap(TreeMem& o);
+
+    // Tree nodes and strings together
+    void addStats(MemStats& st) const;
+};
+
+// Translates StrRefs of one pool into another, for copying many strings across at once (merge, clone).
+// Remembers each translation, so that a string that comes up again (like the same field names in every record)
+// costs one hash map probe instead of hashing and looking up the whole string again.
+// Strings that are referenced only once in src are passed through without remembering them.
+// Keeps a reference to each remembered string so that it can't be dropped from dst in the meantime.
+// Meant to live as long as one merge or clone; don't keep it around.
+class StrTranslator
+{
+    StrTranslator(const StrTranslator&) = delete;
+    StrTranslator& operator=(const StrTranslator&) = delete;
+
+public:
+    StrTranslator(TreeMem& dst, const StringPool& src);
+    ~StrTranslator();
+
+    // Like dst.putNoRefcount() with the string behind s. Returns 0 on failure.
+    StrRef get(StrRef s);
+
+private:
+    TreeMem& _dst;
+    const StringPool& _src;
+    TinyHashMap<StrRef> _memo; // src ref => dst ref
 };
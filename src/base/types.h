@@ -22,7 +22,7 @@ typedef uint32_t u32;
 typedef int64_t s64;
 typedef uint64_t u64;
 
-// This is important! strpool.h uses STRPOOL_U64 by default, which is why this needs to be 64 bits
+// Handle to a string in a StringPool. Needs to be 64 bits: the upper half is a generation counter.
 typedef u64 StrRef;
 
 struct PoolStr
@@ -16,6 +16,10 @@
 
 const Var Var::Null;
 
+// Merging a map with at least this many keys into one with fewer than 1/MERGE_RESERVE_RATIO as many
+// reserves room for all of them up front
+enum { MERGE_RESERVE_MIN_SIZE = 4096, MERGE_RESERVE_RATIO = 8 };
+
 // specialize for Var
 // the default ctor inits meta to 0 and leaves the rest uninited
 // so we can just plow over the entire thing and it'll be fine
@@ -34,9 +38,41 @@ static _VarMap*_NewMap(TreeMem& mem, size_t prealloc)
 }
 // ... use m->destroy(mem) to delete it
 
+// Arrays are allocated with one extra Var-sized header in front that stores the capacity,
+// so that growing an array one by one doesn't need to realloc every time.
+// Var::u.a points to the first element, after the header. Empty arrays have no memory at all.
+struct _VarArrayHdr
+{
+    size_t cap;
+    size_t unused;
+};
+
+inline static size_t _ArrayCap(const Var *a)
+{
+    return a ? ((const _VarArrayHdr*)a)[-1].cap : 0;
+}
+
+inline static size_t _ArrayMemSize(size_t cap)
+{
+    return sizeof(Var) * (cap + 1);
+}
+
+static void _FreeArrayMem(TreeMem& mem, Var *a)
+{
+    if(a)
+        mem.Free((_VarArrayHdr*)a - 1, _ArrayMemSize(_ArrayCap(a)));
+}
+
 static Var *_NewArrayNoInit(TreeMem& mem, size_t n)
 {
-    return (Var*)mem.Alloc(sizeof(Var) * n);
+    static_assert(sizeof(_VarArrayHdr) == sizeof(Var), "array header must be one Var");
+    if(!n)
+        return NULL;
+    _VarArrayHdr *h = (_VarArrayHdr*)mem.Alloc(_ArrayMemSize(n));
+    if(!h)
+        return NULL;
+    h->cap = n;
+    return (Var*)(h + 1);
 }
 
 static Var* _NewArray(TreeMem& mem, size_t n)
@@ -47,12 +83,35 @@ static Var* _NewArray(TreeMem& mem, size_t n)
     return p;
 }
 
+// Growing allocates 50% extra, so that appending is amortized O(1).
+// Shrinking only gives memory back once less than half of it is used.
 static Var* _ResizeArrayNoInitNoDestruct(TreeMem& mem, size_t newsize, Var* arr, size_t oldsize)
 {
-    if (newsize == oldsize) // sanity check
+    const size_t cap = _ArrayCap(arr);
+    if(newsize && newsize <= cap && newsize >= cap / 2u) // cap / 2u is 0 for cap == 1, but empty arrays must be freed
         return arr;
+    if(!newsize)
+    {
+        _FreeArrayMem(mem, arr);
+        return NULL;
+    }
+    if(!arr)
+        return _NewArrayNoInit(mem, newsize);
 
-    return (Var*)mem.Realloc(arr, sizeof(Var) * oldsize, sizeof(Var) * newsize);
+    size_t newcap = newsize;
+    if(newsize > cap && oldsize) // exact size if this is the first time the array gets elements
+    {
+        newcap = cap + cap / 2u;
+        if(newcap < newsize)
+            newcap = newsize;
+        if(newcap < 4)
+            newcap = 4;
+    }
+    _VarArrayHdr *h = (_VarArrayHdr*)mem.Realloc((_VarArrayHdr*)arr - 1, _ArrayMemSize(cap), _ArrayMemSize(newcap));
+    if(!h)
+        return NULL;
+    h->cap = newcap;
+    return (Var*)(h + 1);
 }
 
 static Var* _ResizeArrayNoInit(TreeMem& mem, size_t newsize, Var *arr, size_t oldsize)
@@ -82,17 +141,6 @@ void _ClearArray(TreeMem& mem, Var* p, size_t n)
         p[i].clear(mem);
 }
 
-static void _DeleteArray(TreeMem& mem, Var *p, size_t n)
-{
-    assert(!p == !n);
-    if(p)
-    {
-        _ClearArray(mem, p, n);
-        mem_destruct(p, p + n);
-        mem.Free(p, sizeof(*p) * n);
-    }
-}
-
 static _VarExtra*_NewExtra(TreeMem& mem, _VarMap& m, acme::upgrade_mutex& mutex)
 {
     void *p = (_VarExtra*)mem.Alloc(sizeof(_VarExtra));
@@ -142,7 +190,10 @@ struct ClearHelper
             {
                 for(size_t i = 0; i < e.n; ++i)
                     clear(e.p[i]);
-                _mem.Free(e.p, sizeof(*e.p) * e.cap);
+                if(e.cap)
+                    _mem.Free(e.p, sizeof(*e.p) * e.cap);
+                else
+                    _FreeArrayMem(_mem, e.p);
             }
         }
     }
@@ -155,7 +206,8 @@ struct ClearHelper
         switch(v._topbits())
         {
             case Var::BITS_STRING:
-                _mem.freeS(v.u.s);
+                if(!v._isShortStr())
+                    _mem.freeS(v.u.s);
                 break;
             case Var::BITS_ARRAY:
                 add(v.array_unsafe(), v._size());
@@ -178,7 +230,7 @@ private:
     {
         Var *p;
         size_t n;
-        size_t cap;
+        size_t cap; // 0 for Var arrays, which know their capacity
     };
 
     std::vector<Entry> todo;
@@ -186,7 +238,7 @@ private:
 
     void add(Var *p, size_t n)
     {
-        Entry e { p, n, n };
+        Entry e { p, n, 0 };
         todo.push_back(e);
     }
     void add(typename _VarMap::Vec&& vec)
@@ -214,8 +266,9 @@ Var::Var()
     // .u does not need to be inited here
 {
     //u.p = NULL; // not necessary
-    static_assert((size_t(1) << (SHIFT_TOPBIT - 1u)) - 1u == SIZE_MASK,
+    static_assert((size_t(1) << (SHIFT_TOPBIT - 2u)) - 1u == SIZE_MASK,
         "SIZE_MASK might be weird, check this");
+    static_assert(sizeof(u.c) == sizeof(u) && SHORTSTR_MAX < sizeof(u.c), "short strings don't fit");
 }
 
 Var::~Var()
@@ -320,18 +373,33 @@ void Var::clear(TreeMem& mem)
     _transmute(mem, TYPE_NULL);
 }
 
-Var Var::clone(TreeMem &dstmem, const TreeMem& srcmem) const
+Var Var::clone(TreeMem &dstmem, const TreeMem& srcmem, StrTranslator *tr) const
 {
+    // Containers tend to have the same keys over and over
+    if(!tr && &srcmem != &dstmem && isContainer())
+    {
+        StrTranslator tmp(dstmem, srcmem);
+        return clone(dstmem, srcmem, &tmp);
+    }
+
     Var dst;
     switch(_topbits())
     {
     case BITS_STRING:
     {
-        if(&srcmem == &dstmem)
+        if(_isShortStr())
+            dst.u = this->u;
+        else if(&srcmem == &dstmem)
         {
             dst.u.s = this->u.s;
             dstmem.increfS(this->u.s);
         }
+        else if(tr)
+        {
+            dst.u.s = tr->get(u.s);
+            if(dst.u.s)
+                dstmem.increfS(dst.u.s);
+        }
         else
         {
             PoolStr ps = srcmem.getSL(u.s);
@@ -344,12 +412,12 @@ Var Var::clone(TreeMem &dstmem, const TreeMem& srcmem) const
         const size_t N = _size();
         Var * const a = _NewArray(dstmem, N);
         for(size_t i = 0; i < N; ++i)
-            a[i] = std::move(u.a[i].clone(dstmem, srcmem));
+            a[i] = std::move(u.a[i].clone(dstmem, srcmem, tr));
         dst.u.a = a;
         break;
     }
     case BITS_MAP:
-        dst.u.m = u.m->clone(dstmem, srcmem);
+        dst.u.m = u.m->clone(dstmem, srcmem, tr);
         break;
     case BITS_OTHER:
         switch(meta)
@@ -389,6 +457,16 @@ Var * Var::makeArray(TreeMem& mem, size_t n)
     return (( u.a = a )); // u.a must be assigned AFTER _settop()!
 }
 
+Var *Var::push_back(TreeMem& mem, Var&& x)
+{
+    const size_t n = _topbits() == BITS_ARRAY ? _size() : 0;
+    Var *a = makeArray(mem, n + 1);
+    if(!a)
+        return NULL;
+    a[n] = std::move(x);
+    return &a[n];
+}
+
 Var* Var::makeArrayUninitialized_Dangerous(TreeMem& mem, size_t n)
 {
     if (n > MAXSIZE)
@@ -465,7 +543,17 @@ const u64 *Var::asUint() const
 
 StrRef Var::asStrRef() const
 {
-    return _topbits() == BITS_STRING ? u.s : 0;
+    return _topbits() == BITS_STRING && !_isShortStr() ? u.s : 0;
+}
+
+StrRef Var::asKeyRef(TreeMem& mem) const
+{
+    if(_topbits() != BITS_STRING)
+        return 0;
+    if(_isShortStr())
+        return mem.put(u.c, _size());
+    mem.increfS(u.s);
+    return u.s;
 }
 
 const double *Var::asFloat() const
@@ -500,16 +588,23 @@ PoolStr Var::asString(const TreeMem& mem) const
     PoolStr ps { NULL, 0 };
     if(_topbits() == BITS_STRING)
     {
-        ps.s = mem.getS(u.s);
         ps.len = _size();
-        assert(ps.len == mem.getL(u.s));
+        if(_isShortStr())
+            ps.s = u.c;
+        else
+        {
+            ps.s = mem.getS(u.s);
+            assert(ps.len == mem.getL(u.s));
+        }
     }
     return ps;
 }
 
 const char* Var::asCString(const TreeMem& mem) const
 {
-    return _topbits() == BITS_STRING ? mem.getS(u.s) : NULL;
+    if(_topbits() != BITS_STRING)
+        return NULL;
+    return _isShortStr() ? u.c : mem.getS(u.s);
 }
 
 const Var *Var::at(size_t idx) const
@@ -805,8 +900,8 @@ bool Var::equals(const TreeMem& mymem, const Var& o, const TreeMem& othermem) co
             return abs(u.f - o.u.f) < 0.001; // some leeway with precision but this should be close enough, arbitrarily
         case TYPE_STRING:
         {
-            if(&mymem == &othermem)
-                return u.s == o.u.s;
+            if(&mymem == &othermem) // same ref if pooled, same bytes if short
+                return meta == o.meta && u.ui == o.u.ui;
              PoolStr s = asString(mymem);
              PoolStr os = o.asString(othermem);
              return s.len == os.len && !memcmp(s.s, os.s, s.len);
@@ -892,9 +987,9 @@ bool Var::compareExactSameMem(const Var& o) const
     if(meta != o.meta)
         return false;
 
-    // value comparison (includes strings, which must have the same ref)
+    // value comparison (includes strings, which must have the same ref or the same inline bytes)
     if(!isContainer())
-        return o.u.ui == o.u.ui;
+        return u.ui == o.u.ui;
 
     // now we know it's a container of the same type and the same length
     // (unless it's a map, that we we don't know yet)
@@ -954,7 +1049,7 @@ bool Var::_compareExactDifferentMem(const TreeMem& mymem, const Var& o, const Tr
             const char *b = o.asCString(othermem);
             return !strcmp(a, b);
         }
-        return o.u.ui == o.u.ui;
+        return u.ui == o.u.ui;
     }
 
     // now we know it's a container of the same type and the same length
@@ -987,8 +1082,10 @@ bool Var::_compareExactDifferentMem(const TreeMem& mymem, const Var& o, const Tr
                     return false;
                 for (Var::Map::Iterator it = a->begin(); it != a->end(); ++it)
                 {
-                    StrRef k = it.key();
-                    const Var* bo = b->getNoFetch(k);
+                    // keys are from different pools, so they must be translated
+                    const PoolStr ps = mymem.getSL(it.key());
+                    const StrRef k = othermem.lookup(ps.s, ps.len);
+                    const Var* bo = k ? b->getNoFetch(k) : NULL;
                     if (!bo || !it.value()._compareExactDifferentMem(mymem, *bo, othermem))
                         return false;
                 }
@@ -1051,6 +1148,15 @@ StrRef Var::setStr(TreeMem& mem, const char* x)
 
 StrRef Var::setStr(TreeMem& mem, const char* x, size_t len)
 {
+    if(len <= SHORTSTR_MAX)
+    {
+        char buf[sizeof(u.c)] = {0}; // x may point into our own u.c; also keeps the unused bytes zeroed for comparisons
+        if(len)
+            memcpy(buf, x, len);
+        _transmute(mem, (size_t(BITS_STRING) << SHIFT_TOP2BITS) | SHORTSTR_BIT | len);
+        memcpy(u.c, buf, sizeof(buf));
+        return 0;
+    }
     StrRef s = mem.put(x, len);
     assert(s);
     _settop(mem, BITS_STRING, len);
@@ -1060,8 +1166,11 @@ StrRef Var::setStr(TreeMem& mem, const char* x, size_t len)
 StrRef Var::setStrRef(TreeMem& mem, StrRef s)
 {
     assert(s);
+    const PoolStr ps = mem.getSL(s);
+    if(ps.len <= SHORTSTR_MAX)
+        return setStr(mem, ps.s, ps.len);
     mem.increfS(s);
-    _settop(mem, BITS_STRING, mem.getL(s));
+    _settop(mem, BITS_STRING, ps.len);
     return ((u.s = s));
 }
 
@@ -1261,47 +1370,73 @@ bool _VarMap::isExpired(u64 now) const
 }
 
 
+void _VarMap::_MergeValue(TreeMem& dstmem, Var *dst, const Var& src, const TreeMem& srcmem, MergeFlags mergeflags, StrTranslator *tr)
+{
+    const Var::Type dsttype = dst->type(); // if newly created, this will be null
+    const Var::Type othertype = src.type();
+
+    if((mergeflags & MERGE_RECURSIVE) && othertype == Var::TYPE_MAP && dsttype == Var::TYPE_MAP)
+    {
+        // Both are maps, merge recursively
+        dst->makeMap(dstmem)->merge(dstmem, *src.u.m, srcmem, mergeflags, tr);
+    }
+    else if((mergeflags & MERGE_APPEND_ARRAYS) && othertype == Var::TYPE_ARRAY && dsttype == Var::TYPE_ARRAY)
+    {
+        // Both are arrays, append
+        const size_t oldsize = dst->_size();
+        const size_t addsize = src._size();
+        const Var *oa = src.array_unsafe();
+        // resize destination and skip forward
+        Var *a = dst->makeArray(dstmem, oldsize + addsize) + oldsize;
+        for(size_t i = 0; i < addsize; ++i)
+            a[i] = std::move(oa[i].clone(dstmem, srcmem, tr));
+    }
+    else // One entry replaces the other entirely
+    {
+        if(dsttype != Var::TYPE_NULL)
+        {
+            if(mergeflags & MERGE_NO_OVERWRITE)
+                return;
+
+            dst->clear(dstmem);
+        }
+        *dst = std::move(src.clone(dstmem, srcmem, tr)); // TODO: optimize if srcmem==dstmem?
+    }
+}
+
 // TODO: if we don't need a copying merge, make this a consuming merge that moves stuff
-bool _VarMap::merge(TreeMem& dstmem, const _VarMap& o, const TreeMem& srcmem, MergeFlags mergeflags)
+bool _VarMap::merge(TreeMem& dstmem, const _VarMap& o, const TreeMem& srcmem, MergeFlags mergeflags, StrTranslator *tr)
 {
     _checkmem(dstmem);
-    for(Iterator it = o.begin(); it != o.end(); ++it)
+    if(!tr && &dstmem != &srcmem)
     {
-        PoolStr ps = srcmem.getSL(it.key());
-        Var *dst = this->putKey(dstmem, ps.s, ps.len);
-        if(!dst)
-            return false;
+        StrTranslator tmp(dstmem, srcmem);
+        return merge(dstmem, o, srcmem, mergeflags, &tmp);
+    }
 
-        const Var::Type dsttype = dst->type(); // if newly created, this will be null
-        const Var::Type othertype = it.value().type();
+    // Hardly any keys can be in a map that's empty or much smaller than the source,
+    // so make room for all of them instead of growing the map over and over
+    if(o.size() >= MERGE_RESERVE_MIN_SIZE && size() < o.size() / MERGE_RESERVE_RATIO)
+        _storage.reserve(dstmem, _Map::TVec::size_type(size() + o.size()));
 
-        if((mergeflags & MERGE_RECURSIVE) && othertype == Var::TYPE_MAP && dsttype == Var::TYPE_MAP)
+    for(Iterator it = o.begin(); it != o.end(); ++it)
+    {
+        Var *dst;
+        if(tr)
         {
-            // Both are maps, merge recursively
-            dst->makeMap(dstmem)->merge(dstmem, *it.value().u.m, srcmem, mergeflags);
+            StrRef k = tr->get(it.key());
+            if(!k)
+                return false;
+            dst = this->getOrCreate(dstmem, k);
         }
-        else if((mergeflags & MERGE_APPEND_ARRAYS) && othertype == Var::TYPE_ARRAY && dsttype == Var::TYPE_ARRAY)
+        else
         {
-            // Both are arrays, append
-            const size_t oldsize = dst->_size();
-            const size_t addsize = it.value()._size();
-            const Var *oa = it.value().array_unsafe();
-            // resize destination and skip forward
-            Var *a = dst->makeArray(dstmem, oldsize + addsize) + oldsize;
-            for(size_t i = 0; i < addsize; ++i)
-                a[i] = std::move(oa[i].clone(dstmem, srcmem));
-        }
-        else // One entry replaces the other entirely
-        {
-            if(dsttype != Var::TYPE_NULL)
-            {
-                if(mergeflags & MERGE_NO_OVERWRITE)
-                    continue;
-
-                dst->clear(dstmem);
-            }
-            *dst = std::move(it.value().clone(dstmem, srcmem)); // TODO: optimize if srcmem==dstmem?
+            PoolStr ps = srcmem.getSL(it.key());
+            dst = this->putKey(dstmem, ps.s, ps.len);
         }
+        if(!dst)
+            return false;
+        _MergeValue(dstmem, dst, it.value(), srcmem, mergeflags, tr);
     }
     return true;
 }
@@ -1318,7 +1453,7 @@ void _VarMap::clear(TreeMem& mem)
     _storage.dealloc(mem);
 }
 
-_VarMap* _VarMap::clone(TreeMem& dstmem, const TreeMem& srcmem) const
+_VarMap* _VarMap::clone(TreeMem& dstmem, const TreeMem& srcmem, StrTranslator *tr) const
 {
     _checkmem(srcmem);
     _VarMap *cp = _NewMap(dstmem, size());
@@ -1333,11 +1468,22 @@ _VarMap* _VarMap::clone(TreeMem& dstmem, const TreeMem& srcmem) const
     }
     for(Iterator it = begin(); it != end(); ++it)
     {
-        PoolStr k = srcmem.getSL(it.key());
-        Var *dst = cp->_storage.at(dstmem, dstmem.put(k.s, k.len));
+        StrRef k;
+        if(tr)
+        {
+            k = tr->get(it.key());
+            if(k)
+                dstmem.increfS(k);
+        }
+        else
+        {
+            PoolStr ps = srcmem.getSL(it.key());
+            k = dstmem.put(ps.s, ps.len);
+        }
+        Var *dst = k ? cp->_storage.at(dstmem, k) : NULL;
         if(!dst)
             goto fail;
-        *dst = std::move(it.value().clone(dstmem, srcmem));
+        *dst = std::move(it.value().clone(dstmem, srcmem, tr));
     }
     cp->_extra = xcp;
     return cp;
@@ -1517,6 +1663,23 @@ Var *_VarMap::put(TreeMem& mem, StrRef k, Var&& x)
     return ins.ptr;
 }
 
+bool _VarMap::erase(TreeMem& mem, StrRef k)
+{
+    _checkmem(mem);
+    Var removed;
+    if(!_storage.erase(mem, k, removed))
+        return false;
+    removed.clear(mem);
+    mem.freeS(k); // the key was refcounted when it was inserted
+    return true;
+}
+
+bool _VarMap::erase(TreeMem& mem, const char* key, size_t len)
+{
+    const StrRef k = mem.lookup(key, len);
+    return k && erase(mem, k);
+}
+
 _VarMap::Iterator _VarMap::begin() const
 {
     if (_extra && _extra->fetcher && !_extra->datavalid)
@@ -1559,6 +1722,11 @@ VarRef& VarRef::makeArray(size_t n)
     return *this;
 }
 
+VarRef VarRef::push_back()
+{
+    return VarRef(mem, v->push_back(*mem, Var()));
+}
+
 VarRef VarRef::operator[](const char* key)
 {
     Var *sub = v->makeMap(*mem)->putKey(*mem, key, strlen(key));
@@ -6,6 +6,7 @@
 #include "upgrade_mutex.h"
 
 class TreeMem;
+class StrTranslator;
 class Var;
 class _VarMap;
 class _VarExtra;
@@ -132,9 +133,11 @@ public:
     1?xxx... = object is compound type aka has external data (array, map)
     10xxx... = object is array        (lower bits: size)
     11xxx... = object is map          (lower bits ignored)
-    01xxx... = object is string       (lower bits: length)
+    010xx... = object is string       (lower bits: length; u.s is the pooled string)
+    011xx... = object is short string (lower bits: length; u.c holds the chars + '\0', no pool involved)
     00xxx... = meta is one of the remaining enum Types
                (can just switch() over those since the high bits are 0)
+    Strings of up to SHORTSTR_MAX chars are always stored inline, longer ones always go to the pool.
     */
     size_t meta;
 
@@ -154,19 +157,22 @@ public:
         double f;   // when float type
         void *p;    // when ptr/userdata
         Range *ra;  // when range
+        char c[sizeof(u64)]; // when short string
     } u;
 
     enum Priv : size_t
     {
         SHIFT_TOPBIT = (sizeof(meta) * CHAR_BIT) - 1u,
         SHIFT_TOP2BITS = SHIFT_TOPBIT - 1u,
-        SIZE_MASK = size_t(-1) >> 2u // upper 2 bits 0, rest 1
+        SIZE_MASK = size_t(-1) >> 3u, // upper 3 bits 0, rest 1
+        SHORTSTR_BIT = size_t(1) << (SHIFT_TOP2BITS - 1u) // only for strings
     };
 
     enum Limits : size_t
     {
         MAXSIZE  = SIZE_MASK,
-        MAX_SIZE_BITS = SHIFT_TOP2BITS
+        MAX_SIZE_BITS = SHIFT_TOP2BITS - 1u,
+        SHORTSTR_MAX = sizeof(u64) - 1u // longest string stored inline (needs room for the '\0')
     };
 
     void _settop(TreeMem& mem, Topbits top, size_t size);
@@ -177,11 +183,13 @@ public:
     inline bool isContainer() const { return meta >> SHIFT_TOPBIT; } // highest bit set?
     inline bool isAtom()     const { return !isContainer(); }
     inline size_t _size()  const { return meta & SIZE_MASK; } // valid for string and array (but not map)
+    inline bool _isShortStr() const { return (meta & ~SIZE_MASK) == ((size_t(BITS_STRING) << SHIFT_TOP2BITS) | SHORTSTR_BIT); }
     size_t size() const;
 
     void clear(TreeMem& mem); // sets to null and clears memory. call this before it goes out of scope.
 
-    Var clone(TreeMem& dstmem, const TreeMem& srcmem) const;
+    // tr is optional. If the memory differs, a temporary one is used for containers.
+    Var clone(TreeMem& dstmem, const TreeMem& srcmem, StrTranslator *tr = NULL) const;
 
     Type type() const;
     const char *typestr() const;
@@ -195,11 +203,13 @@ public:
     s64 setInt(TreeMem& mem, s64 x);
     u64 setUint(TreeMem& mem, u64 x);
     double setFloat(TreeMem& mem, double x);
+    // These return the pooled string, or 0 if it was short enough to be stored inline
     StrRef setStr(TreeMem& mem, const char *x);
     StrRef setStr(TreeMem& mem, const char* x, size_t len);
     StrRef setStrRef(TreeMem& mem, StrRef r);
     void *setPtr(TreeMem& mem, void *p);
     Var *makeArray(TreeMem& mem, size_t n); // this may return NULL for n == 0
+    Var *push_back(TreeMem& mem, Var&& x); // append to array (makes this an empty array first if it's not). NULL if failed.
     Map *makeMap(TreeMem& mem, size_t prealloc = 0);
     Range *setRange(TreeMem& mem, const Range *ra, size_t n);
 
@@ -207,8 +217,9 @@ public:
     bool isNull() const { return meta == TYPE_NULL; }
     const s64 *asInt() const;
     const u64 *asUint() const;
-    StrRef asStrRef() const;
-    PoolStr asString(const TreeMem& mem) const; // (does not convert to string)
+    StrRef asStrRef() const; // 0 if not a string or a short string (those are not pooled)
+    StrRef asKeyRef(TreeMem& mem) const; // pooled string for use as map key (puts short strings into the pool). Adds a ref; caller must freeS() it
+    PoolStr asString(const TreeMem& mem) const; // (does not convert to string). Short strings point into the Var itself!
     const char *asCString(const TreeMem& mem) const;
     const double *asFloat() const;
     bool asBool() const; // only true if really bool type and true, false otherwise
@@ -348,10 +359,10 @@ public:
     _VarMap(TreeMem& mem, size_t prealloc = 0);
     _VarMap(_VarMap&&) noexcept;
 
-    bool merge(TreeMem& dstmem, const _VarMap& o, const TreeMem& srcmem, MergeFlags mergeflags);
+    bool merge(TreeMem& dstmem, const _VarMap& o, const TreeMem& srcmem, MergeFlags mergeflags, StrTranslator *tr = NULL);
     void clear(TreeMem& mem);
     inline bool empty() const { return _storage.empty(); }
-    _VarMap* clone(TreeMem& dstmem, const TreeMem& srcmem) const;
+    _VarMap* clone(TreeMem& dstmem, const TreeMem& srcmem, StrTranslator *tr = NULL) const;
     inline size_t size() const { return _storage.size(); }
 
     Var* getOrCreate(TreeMem& mem, StrRef key); // return existing or insert new
@@ -371,6 +382,11 @@ public:
     // always returns ptr to valid object unless OOM
     Var* put(TreeMem& mem, StrRef k, Var&& x); // increases refcount if new key stored
 
+    // remove key and clear its value. returns false if it wasn't there.
+    // Invalidates iterators and pointers into this map.
+    bool erase(TreeMem& mem, StrRef k);
+    bool erase(TreeMem& mem, const char* key, size_t len);
+
     Iterator begin() const;
     inline Iterator end() const { return _storage.end(); }
     MutIterator begin();
@@ -399,6 +415,7 @@ private:
     _VarMap& operator=(const _VarMap& o) = delete;
 
     static Var* _InsertAndRefcount(TreeMem& dstmem, _Map& storage, StrRef k);
+    static void _MergeValue(TreeMem& dstmem, Var *dst, const Var& src, const TreeMem& srcmem, MergeFlags mergeflags, StrTranslator *tr);
 
     _Map _storage;
     Extra *_extra; // only allocated when necessary
@@ -456,6 +473,10 @@ public:
     VarRef& makeMap(size_t prealloc = 0);
     VarRef& makeArray(size_t n);
 
+    // converts into an array, appends a null element and returns a ref to it, so that
+    // ref.push_back() = 42; appends 42. Appending is amortized O(1).
+    VarRef push_back();
+
     VarRef at(size_t idx) const;          // does not convert to array
     VarRef lookup(const char* key) const; // does not convert to map
     VarRef lookup(const char* key, size_t len) const; // does not convert to map
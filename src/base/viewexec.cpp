@@ -449,8 +449,8 @@ const char *VM::cmd_Keysel(unsigned param)
                 Var::Map *newmap = mm.makeMap(mem);
                 for(Var::Map::Iterator it = Lm->begin(); it != Lm->end(); ++it)
                 {
-                    StrRef k = mem.translateS(*e.ref.mem, it.value().asStrRef());
-                    if(const Var *x = src->get(k))
+                    const PoolStr ks = it.value().asString(mem);
+                    if(const Var *x = ks.s ? src->get(*e.ref.mem, ks.s, ks.len) : NULL)
                         newmap->put(mem, it.key(), std::move(x->clone(mem, *e.ref.mem)));
                 }
                 newtop.addRel(mem, std::move(mm), e.key);
@@ -672,9 +672,10 @@ const char *VM::cmd_CheckKeyVsSingleLiteral(unsigned param, unsigned lit, ValueS
 const char *VM::cmd_PushVar(unsigned param)
 {
     // literals and vars use the same VM memory space (*this),
-    // so we can just pass a StrRef along
-    StrRef key = literals[param].asStrRef();
-    StackFrame* frm = _getVar(key);
+    // and var names are map keys, so they are always in the pool
+    const PoolStr ps = literals[param].asString(mem);
+    const StrRef key = mem.lookup(ps.s, ps.len);
+    StackFrame* frm = key ? _getVar(key) : NULL;
     assert(frm);
     StackFrame newtop;
     newtop.refs = frm->refs; // copy refs only; frm will stay alive
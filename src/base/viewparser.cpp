@@ -1023,8 +1023,9 @@ bool Parser::_parseKeySelEntry(Var::Map& m, bool allowRename)
     _skipSpace();
 
 
-    StrRef kr = k.asStrRef();
+    StrRef kr = k.asKeyRef(mem);
     m.put(mem, kr, std::move(*pv));
+    mem.freeS(kr);
     k.clear(mem);
     v.clear(mem);
     return top.accept();
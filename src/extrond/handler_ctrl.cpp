@@ -67,7 +67,8 @@ int CtrlHandler::onRequest(BufferedWriteStream& dst, mg_connection* conn, const
             action = "detail";
 
 
-        DataTree params(DataTree::TINY);
+        ScratchTree scratch(DataTree::TINY);
+        DataTree& params = *scratch;
         const Var *vp = NULL;
         if(Request::AutoReadVars(params.root(), conn) > 0)
             vp = params.root().v; // only try to pass vars to Lua when we actually get some vars in the query string
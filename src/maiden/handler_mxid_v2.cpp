@@ -97,9 +97,56 @@ bool MxidHandler_v2::init(VarCRef cfg)
     if(VarCRef xv1 = cfg.lookup("fake_v1"))
         fake_v1 = xv1 && xv1.asBool();
 
+    _prepareStaticReplies();
     return true;
 }
 
+void MxidHandler_v2::_prepareStaticReplies()
+{
+    // TODO: terms should be handled in Lua?
+    static const char terms[] = "{\"policies\":{}}";
+    prepareStaticReply(_rTerms, terms, sizeof(terms) - 1);
+
+    static const char status[] = "{}";
+    prepareStaticReply(_rStatus, status, sizeof(status) - 1);
+
+    // we only support v2 so this can be hardcoded for now
+    static const char versions[] = "{\"versions\":[\"v1.2\"]}";
+    prepareStaticReply(_rVersions, versions, sizeof(versions) - 1);
+
+    _prepareHashDetails();
+}
+
+void MxidHandler_v2::_prepareHashDetails() const
+{
+    std::string pepper;
+    const u64 gen = _store.getHashPepperGen(&pepper, false);
+
+    ScratchTree scratch(DataTree::TINY);
+    DataTree& tmp = *scratch;
+    const MxStore::Config::Hashes& hs = _store.getConfig().hashes;
+    VarRef algos = tmp.root()["algorithms"].makeArray(hs.size());
+    size_t i = 0;
+    for(MxStore::Config::Hashes::const_iterator it = hs.begin(); it != hs.end(); ++it, ++i)
+        algos.at(i) = it->first.c_str();
+    tmp.root()["lookup_pepper"].setStr(pepper.c_str(), pepper.length());
+
+    const std::string json = dumpjson(tmp.root());
+    prepareStaticReply(_rHashDetails, json.c_str(), json.length(), gen);
+    logdebug("Prepared hash_details for pepper generation %" PRIu64, gen);
+}
+
+int MxidHandler_v2::VersionsHandler(mg_connection* conn, void* self)
+{
+    Request rq;
+    if(!rq.parse(mg_get_request_info(conn), 0))
+    {
+        mg_send_http_error(conn, 400, ""); // Bad Request
+        return 400;
+    }
+    return sendStaticReply(conn, static_cast<const MxidHandler_v2*>(self)->_rVersions, rq);
+}
+
 MxidHandler_v2::~MxidHandler_v2()
 {
 }
@@ -201,7 +248,8 @@ static bool extractToken(char *dst, size_t avail,  mg_connection* conn, const Re
     if(!token && info->query_string && *info->query_string)
     {
         // TODO: this is really not efficient
-        DataTree params(DataTree::TINY);
+        ScratchTree scratch(DataTree::TINY);
+        DataTree& params = *scratch;
         int n = Request::ReadQueryVars(params.root(), info);
         if(n > 0)
         {
@@ -256,7 +304,8 @@ int MxidHandler_v2::post_account_logout(BufferedWriteStream& dst, mg_connection*
 
 int MxidHandler_v2::post_account_register(BufferedWriteStream& dst, mg_connection* conn, const Request& rq, const UserInfo& u) const
 {
-    DataTree params(DataTree::TINY);
+    ScratchTree scratch(DataTree::TINY);
+    DataTree& params = *scratch;
     if(Request::AutoReadVars(params.root(), conn) <= 0)
         return sendError(conn, 401, M_MISSING_PARAMS);
 
@@ -286,20 +335,21 @@ int MxidHandler_v2::post_account_register(BufferedWriteStream& dst, mg_connectio
     MxResolvResult resolv;
     std::string account;
     MxStore::LookupResult res = _store.getCachedHomeserverForHost(sn, resolv.target.host, resolv.target.port);
-    if(res == MxStore::FAILED)
+    if(res == MxResolvCache::FAILED)
         return sendError(conn, 502, M_NOT_FOUND, "No homeserver exists for this host (cached)");
 
     std::ostringstream errors;
     bool storeHS = false;
     MxResolvList list;
-    if(res == MxStore::VALID) // already have a good homeserver cached?
+    if(res == MxResolvCache::VALID || res == MxResolvCache::EXPIRED) // already have a good homeserver cached?
     {
         list.push_back(resolv); // just use it
+        if(res == MxResolvCache::EXPIRED) // ... but don't wait for the refresh
+            _store.refreshHomeserverForHostAsync(sn);
     }
     else // don't have homeserver cached, get a list of candidates
     {
-        const MxStore::Config& cfg = _store.getConfig();
-        list = lookupHomeserverForHost(sn, cfg.wellknown.requestTimeout, cfg.wellknown.requestMaxSize);
+        list = _store.lookupHomeserverForHost(sn);
         if(list.empty())
             return sendError(conn, 502, M_NOT_FOUND, "Couldn't resolve homeserver");
         storeHS = true; // did a lookup, store it later
@@ -311,7 +361,8 @@ int MxidHandler_v2::post_account_register(BufferedWriteStream& dst, mg_connectio
         resolv = list[i];
         logdebug("Contacting homeserver %s for host %s [%u/%u] ...\n",
             resolv.target.host.c_str(), sn, unsigned(i+1), unsigned(list.size()));
-        DataTree tmp(DataTree::TINY);
+        ScratchTree scratch(DataTree::TINY);
+        DataTree& tmp = *scratch;
         std::ostringstream uri;
         uri << "/_matrix/federation/v1/openid/userinfo?access_token=" << tok; // FIXME: quote
         URLTarget target;
@@ -324,7 +375,7 @@ int MxidHandler_v2::post_account_register(BufferedWriteStream& dst, mg_connectio
         switch(jr.code)
         {
             case MXGJ_OK:
-                res = MxStore::VALID; // the host is good
+                res = MxResolvCache::VALID; // the host is good
                 if(VarCRef sub = tmp.root().lookup("sub"))
                     if(const char *user = sub.asCString())
                         account = user;
@@ -351,7 +402,7 @@ int MxidHandler_v2::post_account_register(BufferedWriteStream& dst, mg_connectio
 out:
 
     // store valid homeserver only if it managed to deliver a good reply
-    if(res == MxStore::VALID)
+    if(res == MxResolvCache::VALID)
     {
         if(storeHS)
             _store.storeHomeserverForHost(sn, resolv.target.host.c_str(), resolv.target.port);
@@ -384,9 +435,7 @@ out:
 
 int MxidHandler_v2::get_terms(BufferedWriteStream& dst, mg_connection* conn, const Request& rq, const UserInfo& u) const
 {
-    // TODO: this should be handled in Lua?
-    dst.WriteStr("{\"policies\":{}}");
-    return 0;
+    return sendStaticReply(conn, _rTerms, rq);
 }
 
 int MxidHandler_v2::post_terms(BufferedWriteStream& dst, mg_connection* conn, const Request& rq, const UserInfo& u) const
@@ -396,7 +445,7 @@ int MxidHandler_v2::post_terms(BufferedWriteStream& dst, mg_connection* conn, co
 
 int MxidHandler_v2::get_status(BufferedWriteStream& dst, mg_connection* conn, const Request& rq, const UserInfo& u) const
 {
-    return _ok(conn);
+    return sendStaticReply(conn, _rStatus, rq);
 }
 
 int MxidHandler_v2::get_pubkey_eph_isvalid(BufferedWriteStream& dst, mg_connection* conn, const Request& rq, const UserInfo& u) const
@@ -416,23 +465,10 @@ int MxidHandler_v2::get_pubkey(BufferedWriteStream& dst, mg_connection* conn, co
 
 int MxidHandler_v2::get_hashdetails(BufferedWriteStream& dst, mg_connection* conn, const Request& rq, const UserInfo& u) const
 {
-    dst.WriteStr("{\"algorithms\":[\"none\"");
-    const MxStore::Config::Hashes& hs = _store.getConfig().hashes;
-    size_t n = 0;
-    for(MxStore::Config::Hashes::const_iterator it = hs.begin(); it != hs.end(); ++it, ++n)
-    {
-        if(n)
-            dst.Put(',');
-        dst.Put('\"');
-        dst.WriteStr(it->first.c_str());
-        dst.Put('\"');
-    }
-
-    dst.WriteStr("], \"lookup_pepper\":\"");
-    std::string pepper = _store.getHashPepper(true);
-    dst.Write(pepper.c_str(), pepper.length());
-    dst.WriteStr("\"}");
-    return 0;
+    // This may rotate the pepper if it's due. If the pepper changed, so does the reply.
+    if(_store.getHashPepperGen(NULL, true) != _rHashDetails.version())
+        _prepareHashDetails();
+    return sendStaticReply(conn, _rHashDetails, rq);
 }
 
 int MxidHandler_v2::get_lookup(BufferedWriteStream& dst, mg_connection* conn, const Request& rq, const UserInfo& u) const
@@ -453,26 +489,27 @@ int MxidHandler_v2::get_lookup(BufferedWriteStream& dst, mg_connection* conn, co
     if(!algo || !pepper)
         return sendError(conn, 400, M_INVALID_PARAM, "Type mismatch");
 
-    // Re-use our own private pool that we already have
-    VarRef out = data.root()["_"];
-    out.clear(); // for smug clients
-    VarRef xdst = out["mappings"].makeMap();
-
-    MxError err = _store.hashedBulkLookup(xdst, xaddr, algo, pepper);
+    MxLookupResult res;
+    MxError err = _store.hashedBulkLookup(res, xaddr, algo, pepper);
     if(err != M_OK)
     {
         if(err != M_INVALID_PEPPER)
             return sendError(conn, 400, err);
         else // as per MSC2134, the returned error contains also the new pepper
         {
-            out.clear();
+            // Re-use our own private pool that we already have
+            VarRef out = data.root()["_"];
+            out.clear(); // for smug clients
             out["algorithm"] = algo;
             out["lookup_pepper"] = _store.getHashPepper(false).c_str();
             return sendErrorEx(conn, out, 400, err, "received invalid pepper - was it rotated?");
         }
     }
 
-    writeJson(dst, out, false);
+    // The results are already JSON, just glue them together
+    dst.WriteStr("{\"mappings\":");
+    res.writeJson(dst);
+    dst.Put('}');
     return 0;
 }
 
@@ -13,12 +13,22 @@ public:
     bool init(VarCRef cfg);
     virtual ~MxidHandler_v2();
     virtual int onRequest(BufferedWriteStream& dst, struct mg_connection* conn, const Request& rq) const override;
+
+    // mg_request_handler for /_matrix/identity/versions, which is outside of our prefix. Pass this as user data.
+    static int VersionsHandler(struct mg_connection* conn, void* self);
+
 private:
     MxStore& _store;
     DataTree _handlers; // ptr entries are actually Endpoint*
     unsigned _port;
     void _setupHandlers();
 
+    // These only change on config load or pepper rotation, so they're rendered ahead of time
+    StaticReply _rTerms, _rStatus, _rVersions;
+    mutable StaticReply _rHashDetails; // version is the pepper generation
+    void _prepareStaticReplies();
+    void _prepareHashDetails() const;
+
     enum AuthStatus
     {
         NOAUTH,
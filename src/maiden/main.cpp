@@ -97,16 +97,8 @@ static size_t argsCallback(char **argv, size_t idx, void* ud)
         puts("--- END 3PID DUMP ---");
 }*/
 
-// mg_request_handler, part of identity server
+// part of identity server, served by MxidHandler_v2::VersionsHandler
 static const char * const URL_versions = "/_matrix/identity/versions";
-static int handler_versions(struct mg_connection* conn, void*)
-{
-    // we only support v2 so this can be hardcoded for now
-    static const char ver[] = "{\"versions\":[\"v1.2\"]}";
-    mg_send_http_ok(conn, "application/json", sizeof(ver) - 1);
-    mg_write(conn, ver, sizeof(ver) - 1); // don't include trailing \0
-    return 200;
-}
 
 // mg_request_handler, enabled if fake_v1 is enabled
 static const char * const URL_identity_v1_min = "/_matrix/identity/api/v1";
@@ -187,7 +179,7 @@ static bool initServices(std::vector<ServerAndConfig*>& servers, MxSources& sour
             return false;
         if(WebServer *ws = prepareServer(servers, identity, x))
         {
-            ws->registerHandler(URL_versions, handler_versions, NULL);
+            ws->registerHandler(URL_versions, MxidHandler_v2::VersionsHandler, identity);
             if(identity->fake_v1)
                 ws->registerHandler(URL_identity_v1_min, handler_identity_v1_min, NULL);
         }
@@ -284,7 +276,11 @@ static int main2(MxSources& sources, int argc, char** argv)
             sources.initPopulate(true);
 
         while (!s_quit)
+        {
             sleepMS(200);
+            if(mxs)
+                mxs->defrag();
+        }
 
         log("Main loop exited, shutting down...");
         stopServers(std::move(servers));
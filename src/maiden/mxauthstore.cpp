@@ -0,0 +1,176 @@
+#include "mxauthstore.h"
+#include "util.h"
+#include <string.h>
+#include <mutex>
+
+MxAuthStore::Shard::Shard()
+    : wheelpos(timeNowMS() / WHEEL_TICK_MS)
+{
+}
+
+MxAuthStore::Shard::~Shard()
+{
+    for(Map::iterator it = tokens.begin(); it != tokens.end(); ++it)
+        delete it->second;
+}
+
+void MxAuthStore::Shard::schedule_nolock(std::string token, u64 expiryTime)
+{
+    u64 tick = (expiryTime + EXPIRED_KEEP_MS) / WHEEL_TICK_MS;
+    if(tick < wheelpos)
+        tick = wheelpos;
+    else if(tick >= wheelpos + WHEEL_SLOTS)
+        tick = wheelpos + WHEEL_SLOTS - 1; // too far in the future; will be re-scheduled once we get there
+    WheelEntry w { std::move(token), expiryTime };
+    wheel[tick % WHEEL_SLOTS].push_back(std::move(w));
+}
+
+size_t MxAuthStore::Shard::expire_nolock(u64 now)
+{
+    const u64 nowtick = now / WHEEL_TICK_MS;
+    if(wheelpos > nowtick)
+        return 0;
+
+    std::vector<WheelEntry> later;
+    size_t n = 0;
+    // If we haven't been here for a while, every slot needs to be looked at once, but not more
+    for(size_t steps = 0; wheelpos <= nowtick && steps < WHEEL_SLOTS; ++wheelpos, ++steps)
+    {
+        std::vector<WheelEntry>& slot = wheel[wheelpos % WHEEL_SLOTS];
+        for(size_t i = 0; i < slot.size(); ++i)
+        {
+            Map::iterator it = tokens.find(slot[i].token);
+            if(it == tokens.end() || it->second->expiryTime != slot[i].expiryTime)
+                continue; // already logged out; if it was added again, it has its own wheel entry
+            Entry *e = it->second;
+            if(e->expiryTime + EXPIRED_KEEP_MS <= now)
+            {
+                tokens.erase(it);
+                delete e;
+                ++n;
+            }
+            else
+                later.push_back(std::move(slot[i]));
+        }
+        slot.clear();
+    }
+    if(wheelpos <= nowtick)
+        wheelpos = nowtick + 1;
+
+    for(size_t i = 0; i < later.size(); ++i)
+        schedule_nolock(std::move(later[i].token), later[i].expiryTime);
+
+    return n;
+}
+
+MxAuthStore::MxAuthStore()
+{
+}
+
+MxAuthStore::~MxAuthStore()
+{
+}
+
+MxAuthStore::Shard& MxAuthStore::_shard(std::string_view tok)
+{
+    return _shards[std::hash<std::string_view>()(tok) & (NUM_SHARDS - 1)];
+}
+
+const MxAuthStore::Shard& MxAuthStore::_shard(std::string_view tok) const
+{
+    return _shards[std::hash<std::string_view>()(tok) & (NUM_SHARDS - 1)];
+}
+
+bool MxAuthStore::add(const char* token, size_t tokenLen, const char* account, u64 expiryTime)
+{
+    const std::string_view tok(token, tokenLen);
+    Shard& sh = _shard(tok);
+    const u64 now = timeNowMS();
+
+    std::unique_lock lock(sh.mutex);
+    //---------------------------------------
+    sh.expire_nolock(now); // we're holding the write lock anyway, so tidy up a bit
+
+    if(sh.tokens.find(tok) != sh.tokens.end())
+        return false;
+
+    Entry *e = new Entry;
+    e->token.assign(token, tokenLen);
+    e->account = account;
+    e->expiryTime = expiryTime;
+    sh.tokens[e->token] = e;
+    sh.schedule_nolock(e->token, expiryTime);
+    return true;
+}
+
+MxError MxAuthStore::authorize(const char* token, u64 now) const
+{
+    const std::string_view tok(token);
+    const Shard& sh = _shard(tok);
+
+    std::shared_lock lock(sh.mutex);
+    //---------------------------------------
+    Map::const_iterator it = sh.tokens.find(tok);
+    if(it == sh.tokens.end())
+        return M_NOT_FOUND;
+    if(it->second->expiryTime < now)
+        return M_SESSION_EXPIRED; // swept only EXPIRED_KEEP_MS later
+    return M_OK;
+}
+
+bool MxAuthStore::getAccount(std::string& dst, const char* token) const
+{
+    const std::string_view tok(token);
+    const Shard& sh = _shard(tok);
+
+    std::shared_lock lock(sh.mutex);
+    //---------------------------------------
+    Map::const_iterator it = sh.tokens.find(tok);
+    if(it == sh.tokens.end())
+        return false;
+    dst = it->second->account;
+    return true;
+}
+
+bool MxAuthStore::remove(const char* token)
+{
+    const std::string_view tok(token);
+    Shard& sh = _shard(tok);
+
+    std::unique_lock lock(sh.mutex);
+    //---------------------------------------
+    Map::iterator it = sh.tokens.find(tok);
+    if(it == sh.tokens.end())
+        return false;
+    Entry *e = it->second;
+    sh.tokens.erase(it);
+    delete e;
+    // The token stays in the wheel until its slot comes up; it's skipped there
+    return true;
+}
+
+size_t MxAuthStore::expire(u64 now)
+{
+    size_t n = 0;
+    for(size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+        Shard& sh = _shards[i];
+        std::unique_lock lock(sh.mutex);
+        //---------------------------------------
+        n += sh.expire_nolock(now);
+    }
+    return n;
+}
+
+size_t MxAuthStore::size() const
+{
+    size_t n = 0;
+    for(size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+        const Shard& sh = _shards[i];
+        std::shared_lock lock(sh.mutex);
+        //---------------------------------------
+        n += sh.tokens.size();
+    }
+    return n;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <shared_mutex>
+#include "types.h"
+#include "mxdefines.h"
+
+// Stores auth tokens as { token => (account, expiry time) }.
+// Tokens are spread over a number of shards, each with its own lock,
+// so that concurrent authorize() calls don't all hammer the same mutex
+// and a register/logout only blocks readers of a single shard.
+// Expired tokens are removed for real (not just marked) via a timing wheel per shard,
+// which is advanced whenever a shard is written to, or by calling expire().
+// They are kept for EXPIRED_KEEP_MS past their expiry time first, so that clients
+// get M_SESSION_EXPIRED rather than M_NOT_FOUND, no matter when the last sweep was.
+class MxAuthStore
+{
+public:
+    MxAuthStore();
+    ~MxAuthStore();
+
+    // returns false if the token already exists
+    bool add(const char *token, size_t tokenLen, const char *account, u64 expiryTime);
+    MxError authorize(const char *token, u64 now) const;
+    bool getAccount(std::string& dst, const char *token) const;
+    bool remove(const char *token);
+
+    // drop all tokens that have expired more than EXPIRED_KEEP_MS ago. returns number of tokens removed.
+    size_t expire(u64 now);
+
+    size_t size() const;
+
+private:
+    enum
+    {
+        NUM_SHARDS = 16, // must be power of 2
+        WHEEL_SLOTS = 64,
+        WHEEL_TICK_MS = 60 * 1000, // each slot covers this time span
+        EXPIRED_KEEP_MS = 60 * 60 * 1000 // expired tokens are reported as such for this long before they're dropped
+    };
+
+    struct Entry
+    {
+        std::string token; // the map key points into this
+        std::string account;
+        u64 expiryTime;
+    };
+
+    typedef std::unordered_map<std::string_view, Entry*> Map;
+
+    struct WheelEntry
+    {
+        std::string token;
+        u64 expiryTime; // if the token's entry has a different one, it was removed and added again
+    };
+
+    struct Shard
+    {
+        Shard();
+        ~Shard();
+        size_t expire_nolock(u64 now);
+        void schedule_nolock(std::string token, u64 expiryTime);
+
+        mutable std::shared_mutex mutex;
+        Map tokens;
+        // Each slot has the tokens that expire in that slot's time span.
+        // Tokens that expire further in the future than the wheel can cover are put
+        // into the last slot and re-scheduled when that slot comes up.
+        // Tokens that were removed (or removed and added again) in the meantime are simply skipped.
+        std::vector<WheelEntry> wheel[WHEEL_SLOTS];
+        u64 wheelpos; // tick number of the next slot to process
+    };
+
+    Shard& _shard(std::string_view tok);
+    const Shard& _shard(std::string_view tok) const;
+
+    Shard _shards[NUM_SHARDS];
+};
@@ -0,0 +1,368 @@
+#include "mxjournal.h"
+#include "bj.h"
+#include "jsonstreamwrapper.h"
+#include "datatree.h"
+#include "osfunc.h"
+#include "log.h"
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+
+// Collects everything written into a vector
+class VectorWriteStream : public BufferedWriteStream
+{
+public:
+    VectorWriteStream(std::vector<char>& v) : BufferedWriteStream(NULL, _Write, _tmp, sizeof(_tmp)), _v(v) {}
+private:
+    static size_t _Write(const void* src, size_t bytes, BufferedWriteStream* self)
+    {
+        std::vector<char>& v = static_cast<VectorWriteStream*>(self)->_v;
+        v.insert(v.end(), (const char*)src, (const char*)src + bytes);
+        return bytes;
+    }
+    std::vector<char>& _v;
+    char _tmp[4 * 1024];
+};
+
+enum { HEADER_SIZE = 4 };
+
+static u32 readHeader(const unsigned char *p)
+{
+    return u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16) | (u32(p[3]) << 24);
+}
+
+static void writeHeader(char *p, u32 len)
+{
+    p[0] = char(len);
+    p[1] = char(len >> 8);
+    p[2] = char(len >> 16);
+    p[3] = char(len >> 24);
+}
+
+static u64 fileSize(FILE *f)
+{
+    if(fseek(f, 0, SEEK_END))
+        return 0;
+    const long sz = ftell(f);
+    return sz > 0 ? u64(sz) : 0;
+}
+
+// Returns the offset after the last complete record
+static u64 scanRecords(FILE *f, u64 total)
+{
+    u64 pos = 0;
+    unsigned char hdr[HEADER_SIZE];
+    while(pos + HEADER_SIZE <= total)
+    {
+        if(fseek(f, long(pos), SEEK_SET) || fread(hdr, 1, HEADER_SIZE, f) != HEADER_SIZE)
+            break;
+        const u32 len = readHeader(hdr);
+        if(!len || pos + HEADER_SIZE + len > total)
+            break;
+        pos += HEADER_SIZE + len;
+    }
+    return pos;
+}
+
+// Copy bytes [begin, end) of src to a new file dstfn
+static bool copyRange(const char *dstfn, FILE *src, u64 begin, u64 end)
+{
+    FILE *dst = fopen(dstfn, "wb");
+    if(!dst)
+        return false;
+    bool ok = !fseek(src, long(begin), SEEK_SET);
+    char buf[64 * 1024];
+    for(u64 remain = end - begin; ok && remain; )
+    {
+        const size_t n = (size_t)std::min<u64>(remain, sizeof(buf));
+        ok = fread(buf, 1, n, src) == n && fwrite(buf, 1, n, dst) == n;
+        remain -= n;
+    }
+    ok = !fclose(dst) && ok;
+    if(!ok)
+        remove(dstfn);
+    return ok;
+}
+
+// Make fn contain only bytes [begin, end) of what it contains now
+static bool cutFile(const char *fn, FILE *f, u64 begin, u64 end)
+{
+    const std::string tmpfn = std::string(fn) + ".tmp";
+    return copyRange(tmpfn.c_str(), f, begin, end) && replaceFile(fn, tmpfn.c_str());
+}
+
+MxJournal::MxJournal()
+    : _fh(NULL), _size(0), _broken(false)
+{
+}
+
+MxJournal::~MxJournal()
+{
+    close();
+}
+
+bool MxJournal::open(const char* fn)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    if(_fh)
+    {
+        fclose(_fh);
+        _fh = NULL;
+    }
+    _fn = fn;
+    _size = 0;
+    _broken = false;
+
+    if(FILE *f = fopen(fn, "rb"))
+    {
+        const u64 total = fileSize(f);
+        _size = scanRecords(f, total);
+        bool ok = true;
+        if(_size < total)
+        {
+            logerror("MxJournal: '%s': Cutting off %ju bytes of incomplete record", fn, total - _size);
+            ok = cutFile(fn, f, 0, _size);
+        }
+        fclose(f);
+        if(!ok)
+        {
+            logerror("MxJournal: '%s': Failed to repair", fn);
+            _broken = true;
+            return false;
+        }
+    }
+
+    return _reopen_nolock();
+}
+
+bool MxJournal::_reopen_nolock()
+{
+    if(_fh)
+        fclose(_fh);
+    _fh = fopen(_fn.c_str(), "ab");
+    if(!_fh)
+    {
+        logerror("MxJournal: Failed to open '%s' for writing", _fn.c_str());
+        _broken = true;
+    }
+    return !!_fh;
+}
+
+void MxJournal::close()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    if(_fh)
+    {
+        fclose(_fh);
+        _fh = NULL;
+    }
+}
+
+bool MxJournal::isOpen() const
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    return !!_fh;
+}
+
+u64 MxJournal::size() const
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    return _size;
+}
+
+bool MxJournal::isBroken() const
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    return _broken;
+}
+
+bool MxJournal::append(VarCRef rec)
+{
+    // Encode before locking; the header is filled in once the size is known
+    std::vector<char> buf(HEADER_SIZE);
+    {
+        VectorWriteStream ws(buf);
+        ws.init();
+        BlockAllocator alloc;
+        if(!bj::encode(ws, rec, &alloc))
+            return false;
+        ws.Flush();
+    }
+    const size_t len = buf.size() - HEADER_SIZE;
+    writeHeader(buf.data(), u32(len));
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    if(!_fh || _broken)
+        return false;
+
+    // If this fails halfway, the torn record is cut off when the journal is opened again,
+    // but anything appended after it would be lost, so stop appending.
+    if(fwrite(buf.data(), 1, buf.size(), _fh) != buf.size() || fflush(_fh))
+    {
+        logerror("MxJournal: Failed to append to '%s'", _fn.c_str());
+        _broken = true;
+        return false;
+    }
+    _size += buf.size();
+    return true;
+}
+
+bool MxJournal::dropFront(u64 n)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    if(_fh)
+    {
+        fclose(_fh);
+        _fh = NULL;
+    }
+
+    bool ok;
+    if(_broken || n >= _size)
+    {
+        // Start over with an empty journal
+        FILE *f = fopen(_fn.c_str(), "wb");
+        ok = f && !fclose(f);
+        _size = 0;
+    }
+    else
+    {
+        FILE *f = fopen(_fn.c_str(), "rb");
+        ok = f && cutFile(_fn.c_str(), f, n, _size);
+        if(f)
+            fclose(f);
+        if(ok)
+            _size -= n;
+    }
+
+    if(ok)
+        _broken = false;
+    else
+    {
+        logerror("MxJournal: Failed to compact '%s'", _fn.c_str());
+        _broken = true;
+    }
+
+    return _reopen_nolock() && ok;
+}
+
+static void removeKeys(VarRef dst, const std::unordered_set<std::string>& deleted)
+{
+    if(Var::Map *m = dst.v->map())
+        for(std::unordered_set<std::string>::const_iterator it = deleted.begin(); it != deleted.end(); ++it)
+            m->erase(*dst.mem, it->c_str(), it->length());
+}
+
+bool MxJournal::replay(VarRef dst, const char* fn, size_t *nrecords)
+{
+    if(nrecords)
+        *nrecords = 0;
+    FILE *f = fopen(fn, "rb");
+    if(!f)
+        return true;
+
+    const u64 total = fileSize(f);
+    fseek(f, 0, SEEK_SET);
+
+    std::unordered_set<std::string> deleted; // applied at the end, all at once
+    std::vector<char> buf;
+    unsigned char hdr[HEADER_SIZE];
+    u64 pos = 0;
+    size_t nrec = 0, nset = 0;
+    bool ok = true;
+    while(pos + HEADER_SIZE <= total && fread(hdr, 1, HEADER_SIZE, f) == HEADER_SIZE)
+    {
+        const u32 len = readHeader(hdr);
+        if(!len || pos + HEADER_SIZE + len > total)
+            break; // incomplete
+        buf.resize(len);
+        if(fread(buf.data(), 1, len, f) != len)
+            break;
+        pos += HEADER_SIZE + len;
+
+        DataTree rec;
+        InplaceStringStream rs(buf.data(), len);
+        rs.init();
+        if(!bj::decode_json(rec.root(), rs))
+        {
+            logerror("MxJournal: '%s': Record #%zu is damaged, stopping here", fn, nrec);
+            ok = false;
+            break;
+        }
+        ++nrec;
+
+        const VarCRef set = rec.root().lookup("set");
+        if(const Var::Map *m = set ? set.v->map() : NULL)
+            for(Var::Map::Iterator it = m->begin(); it != m->end(); ++it)
+            {
+                const PoolStr k = rec.getSL(it.key());
+                if(!deleted.empty())
+                    deleted.erase(std::string(k.s, k.len));
+                dst[k].replace(VarCRef(rec, &it.value()));
+                ++nset;
+            }
+
+        if(VarCRef del = rec.root().lookup("del"))
+            for(size_t i = 0; i < del.size(); ++i)
+                if(const char *s = del.at(i).asCString())
+                    deleted.insert(s);
+    }
+    fclose(f);
+
+    if(!deleted.empty())
+        removeKeys(dst, deleted);
+
+    if(nrecords)
+        *nrecords = nrec;
+    log("MxJournal: Replayed %zu records from '%s' (%zu updates, %zu deletions)", nrec, fn, nset, deleted.size());
+    return ok;
+}
+
+size_t MxJournal::diff(VarRef rec, VarCRef oldmap, VarCRef newmap, VarCRef keys, bool deletes)
+{
+    size_t n = 0;
+
+    if(const Var::Map *km = keys.v->map())
+    {
+        for(Var::Map::Iterator it = km->begin(); it != km->end(); ++it)
+        {
+            const PoolStr k = keys.mem->getSL(it.key());
+            const VarCRef nv = newmap.lookup(k.s, k.len);
+            if(!nv)
+                continue;
+            const VarCRef ov = oldmap.lookup(k.s, k.len);
+            if(ov && ov.v->compareExact(*ov.mem, *nv.v, *nv.mem))
+                continue;
+            rec["set"][k].replace(nv);
+            ++n;
+        }
+    }
+
+    const Var::Map *om = oldmap.v->map();
+    if(deletes && om)
+    {
+        std::vector<PoolStr> gone;
+        for(Var::Map::Iterator it = om->begin(); it != om->end(); ++it)
+        {
+            const PoolStr k = oldmap.mem->getSL(it.key());
+            if(!newmap.lookup(k.s, k.len))
+                gone.push_back(k);
+        }
+        if(!gone.empty())
+        {
+            VarRef del = rec["del"].makeArray(gone.size());
+            for(size_t i = 0; i < gone.size(); ++i)
+                del.at(i).setStr(gone[i].s, gone[i].len);
+            n += gone.size();
+        }
+    }
+
+    return n;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <stdio.h>
+#include "types.h"
+#include "variant.h"
+
+// Append-only log of changes to a map of users, to be replayed on top of a saved base tree.
+// Each record is a map: { "set": { key: value, ... }, "del": [ key, ... ] }
+// "set" replaces whole entries, so replaying a record that is already part of the base is harmless.
+// On disk, each record is [u32 size, little endian][BJ-encoded record].
+// A torn record at the end (eg. after a crash) is ignored and cut off when the journal is opened again.
+class MxJournal
+{
+public:
+    MxJournal();
+    ~MxJournal();
+
+    // Open fn for appending, creating it if it doesn't exist
+    bool open(const char *fn);
+    void close();
+    bool isOpen() const;
+
+    // Returns false if the record couldn't be written. The journal is broken afterwards;
+    // the next compaction must write a full base tree.
+    bool append(VarCRef rec);
+
+    u64 size() const; // in bytes, complete records only
+    bool isBroken() const;
+
+    // Cut off the first n bytes (which must be a record boundary), keep everything appended after that.
+    // Also clears the broken state.
+    bool dropFront(u64 n);
+
+    // Apply all records in fn to dst, which must be a map. A missing file is not an error.
+    // Optionally returns the number of records that were applied.
+    static bool replay(VarRef dst, const char *fn, size_t *nrecords = NULL);
+
+    // Write into rec what changed from oldmap to newmap.
+    // Only the keys in keys are checked. If deletes is set, keys present in oldmap but missing in newmap
+    // are recorded as deleted. Returns the number of changed keys.
+    static size_t diff(VarRef rec, VarCRef oldmap, VarCRef newmap, VarCRef keys, bool deletes);
+
+private:
+    bool _reopen_nolock();
+
+    mutable std::mutex _mtx;
+    std::string _fn;
+    FILE *_fh;
+    u64 _size;
+    bool _broken;
+};
@@ -149,7 +149,8 @@ MxResolvList lookupHomeserverForHost(const char* host, u64 timeoutMS, size_t max
 
     logdebug("MxResolv/GET: Looking up %s%s ...", host, what);
 
-    DataTree tmp(DataTree::TINY);
+    ScratchTree scratch(DataTree::TINY);
+    DataTree& tmp = *scratch;
     URLTarget target;
     target.host = host;
     target.port = 443;
@@ -0,0 +1,218 @@
+#include "mxresolvcache.h"
+#include "util.h"
+#include "log.h"
+#include <assert.h>
+
+static const u64 second = 1000;
+static const u64 minute = second * 60;
+static const u64 hour = minute * 60;
+
+MxResolvCache::Config::Config()
+    : cacheTime(1 * hour), staleTime(24 * hour), failTime(10 * minute)
+    , requestTimeout(5 * second), requestMaxSize(50000), maxEntries(10000)
+{
+}
+
+MxResolvCache::MxResolvCache()
+{
+}
+
+MxResolvCache::~MxResolvCache()
+{
+    std::vector<std::future<void> > jobs;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        //---------------------------------------
+        jobs.swap(_jobs);
+    }
+    for(size_t i = 0; i < jobs.size(); ++i)
+        jobs[i].wait();
+}
+
+void MxResolvCache::setConfig(const Config& cfg)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    _cfg = cfg;
+    while(_entries.size() > _cfg.maxEntries)
+        _erase_nolock(_entries.find(_lru.back()));
+}
+
+void MxResolvCache::storeValid(const char* host, const char* hs, unsigned port)
+{
+    assert(hs && *hs && port);
+    logdebug("Cache HS: [%s] -> [%s:%u]", host, hs, port);
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    _put_nolock(host, hs, port);
+}
+
+void MxResolvCache::storeFail(const char* host)
+{
+    logdebug("Cache fail for host: [%s]", host);
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    _put_nolock(host, "", 0);
+}
+
+MxResolvCache::Status MxResolvCache::get(const char* host, std::string& hsOut, unsigned& portOut)
+{
+    const u64 now = timeNowMS();
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    Map::iterator it = _entries.find(host);
+    if(it == _entries.end())
+        return UNKNOWN;
+
+    Entry& e = it->second;
+    const u64 age = now - e.ts;
+    if(e.homeserver.empty())
+    {
+        if(age > _cfg.failTime)
+        {
+            _erase_nolock(it); // fail expired, time to try again
+            return UNKNOWN;
+        }
+        return FAILED;
+    }
+    if(age > _cfg.cacheTime + _cfg.staleTime)
+    {
+        _erase_nolock(it); // too old to be served even while refreshing
+        return UNKNOWN;
+    }
+
+    _lru.splice(_lru.begin(), _lru, e.lru);
+    hsOut = e.homeserver;
+    portOut = e.port;
+    return age > _cfg.cacheTime ? EXPIRED : VALID;
+}
+
+MxResolvList MxResolvCache::resolve(const char* host)
+{
+    std::shared_future<MxResolvList> fut;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        //---------------------------------------
+        fut = _startLookup_nolock(host, false);
+    }
+    return fut.get();
+}
+
+void MxResolvCache::refreshAsync(const char* host)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    if(_inflight.find(host) == _inflight.end())
+    {
+        logdebug("MxResolvCache: Refreshing [%s] in the background", host);
+        _startLookup_nolock(host, true);
+    }
+}
+
+size_t MxResolvCache::size() const
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    return _entries.size();
+}
+
+std::shared_future<MxResolvList> MxResolvCache::_startLookup_nolock(const std::string& host, bool store)
+{
+    std::unordered_map<std::string, std::shared_future<MxResolvList> >::iterator it = _inflight.find(host);
+    if(it != _inflight.end())
+        return it->second;
+
+    // get rid of finished jobs
+    for(size_t i = 0; i < _jobs.size(); )
+    {
+        if(_jobs[i].wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            std::swap(_jobs[i], _jobs.back());
+            _jobs.pop_back();
+        }
+        else
+            ++i;
+    }
+
+    std::promise<MxResolvList> pr;
+    std::shared_future<MxResolvList> fut = pr.get_future().share();
+    _inflight[host] = fut;
+
+    const u64 timeout = _cfg.requestTimeout;
+    const size_t maxsize = _cfg.requestMaxSize;
+    _jobs.push_back(std::async(std::launch::async,
+        [this, host, store, timeout, maxsize, pr = std::move(pr)]() mutable
+        {
+            MxResolvList list = lookupHomeserverForHost(host.c_str(), timeout, maxsize);
+            _finishLookup(host, list, store);
+            pr.set_value(std::move(list));
+        }
+    ));
+
+    return fut;
+}
+
+void MxResolvCache::_finishLookup(const std::string& host, const MxResolvList& list, bool store)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    _inflight.erase(host);
+
+    Map::iterator it = _entries.find(host);
+    if(list.empty())
+    {
+        // A failed refresh keeps serving the old entry until it's too old.
+        // Otherwise remember that this host is bad.
+        if(store && it != _entries.end() && !it->second.homeserver.empty())
+            logdebug("MxResolvCache: Refresh of [%s] failed, keeping old entry", host.c_str());
+        else
+        {
+            logdebug("Cache fail for host: [%s]", host.c_str());
+            _put_nolock(host, "", 0);
+        }
+        return;
+    }
+
+    if(!store)
+        return;
+
+    // Keep using the known-good homeserver if it's still a candidate
+    if(it != _entries.end())
+        for(size_t i = 0; i < list.size(); ++i)
+            if(list[i].target.host == it->second.homeserver && list[i].target.port == it->second.port)
+            {
+                _put_nolock(host, it->second.homeserver.c_str(), it->second.port);
+                return;
+            }
+
+    logdebug("Cache HS: [%s] -> [%s:%u] (refreshed)", host.c_str(), list[0].target.host.c_str(), list[0].target.port);
+    _put_nolock(host, list[0].target.host.c_str(), list[0].target.port);
+}
+
+void MxResolvCache::_put_nolock(const std::string& host, const char* hs, unsigned port)
+{
+    Map::iterator it = _entries.find(host);
+    if(it == _entries.end())
+    {
+        _lru.push_front(host);
+        it = _entries.insert(std::make_pair(host, Entry())).first;
+        it->second.lru = _lru.begin();
+    }
+    else
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+
+    Entry& e = it->second;
+    if(e.homeserver != hs) // this may be an alias of e.homeserver
+        e.homeserver = hs;
+    e.port = port;
+    e.ts = timeNowMS();
+
+    while(_entries.size() > _cfg.maxEntries)
+        _erase_nolock(_entries.find(_lru.back()));
+}
+
+void MxResolvCache::_erase_nolock(Map::iterator it)
+{
+    _lru.erase(it->second.lru);
+    _entries.erase(it);
+}
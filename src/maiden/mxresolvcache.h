@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <future>
+#include "types.h"
+#include "mxresolv.h"
+
+// Caches which homeserver to use for a given host, as determined via .well-known or SRV records.
+// - Entries are valid for cacheTime. After that they are still served (as EXPIRED)
+//   for up to staleTime while a refresh runs in the background. Older entries are dropped.
+// - Failed lookups are cached for failTime.
+// - At most maxEntries hosts are kept; the least recently used entry is evicted first.
+// - Concurrent lookups for the same host share a single request.
+class MxResolvCache
+{
+public:
+    enum Status
+    {
+        UNKNOWN, // not cached
+        VALID,   // valid, cached
+        EXPIRED, // valid, old values still in cache
+        FAILED,  // cached, known invalid
+    };
+
+    struct Config
+    {
+        Config();
+        u64 cacheTime;
+        u64 staleTime;
+        u64 failTime;
+        u64 requestTimeout;
+        u64 requestMaxSize;
+        size_t maxEntries;
+    };
+
+    MxResolvCache();
+    ~MxResolvCache(); // waits for pending lookups
+
+    void setConfig(const Config& cfg);
+
+    void storeValid(const char *host, const char *hs, unsigned port);
+    void storeFail(const char *host);
+    Status get(const char *host, std::string& hsOut, unsigned& portOut);
+
+    // Blocking lookup of all homeserver candidates for a host. Does not store anything
+    // unless the lookup failed, in which case the failure is cached.
+    // If a lookup for the same host is already in progress, wait for that instead.
+    MxResolvList resolve(const char *host);
+
+    // Same as resolve() but in the background, and the best candidate is stored when done.
+    // Does nothing if a lookup for that host is already in progress.
+    void refreshAsync(const char *host);
+
+    size_t size() const;
+
+private:
+    struct Entry
+    {
+        std::string homeserver; // empty if failed
+        unsigned port;
+        u64 ts;
+        std::list<std::string>::iterator lru;
+    };
+    typedef std::unordered_map<std::string, Entry> Map;
+
+    std::shared_future<MxResolvList> _startLookup_nolock(const std::string& host, bool store);
+    void _finishLookup(const std::string& host, const MxResolvList& list, bool store);
+    void _put_nolock(const std::string& host, const char *hs, unsigned port);
+    void _erase_nolock(Map::iterator it);
+
+    mutable std::mutex _mtx;
+    Config _cfg;
+    Map _entries;
+    std::list<std::string> _lru; // most recently used at the front
+    std::unordered_map<std::string, std::shared_future<MxResolvList> > _inflight;
+    std::vector<std::future<void> > _jobs;
+};
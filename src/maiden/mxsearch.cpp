@@ -2,25 +2,42 @@
 #include "mxstore.h"
 #include "scopetimer.h"
 #include "strmatch.h"
+#include "memaccounting.h"
 #include <string.h>
+#include <stdio.h>
 
 MxSearch::MxSearch(const MxSearchConfig& scfg)
     : scfg(scfg)
 {
+    MemAccounting::Add(this, "search", _CollectStats);
 }
 
 MxSearch::~MxSearch()
 {
+    MemAccounting::Remove(this);
     clear();
 }
 
+bool MxSearch::_CollectStats(const void* self, MemStats& st)
+{
+    const MxSearch *ms = static_cast<const MxSearch*>(self);
+    // Don't wait; a rebuild may be dropping a tree snapshot, which needs the accounting lock
+    std::shared_lock<std::shared_mutex> lock(ms->mutex, std::try_to_lock);
+    if(!lock.owns_lock())
+        return false;
+    ms->_stralloc.addStats(st);
+    st.extra += ms->_strings.capacity() * sizeof(MutStr) + ms->_keys.capacity() * sizeof(StrRef);
+    return true;
+}
+
 bool MxSearch::init(VarCRef cfg)
 {
     return true;
 }
 
-void MxSearch::rebuildCache(VarCRef src)
+void MxSearch::rebuildCache(const MxTreeSnapshotRef& snap)
 {
+    const VarCRef src = snap->tree.root();
     std::unique_lock lock(mutex);       // R+W
     //-----------------------------------------------------------
 
@@ -52,6 +69,7 @@ void MxSearch::rebuildCache(VarCRef src)
     assert(m);
 
     clear();
+    _snap = snap;
     _strings.reserve(m->size());
     _keys.reserve(m->size());
 
@@ -89,10 +107,11 @@ void MxSearch::rebuildCache(VarCRef src)
         _strings.size(), m->size(), m->size() - _strings.size());
 }
 
-MxSearch::Matches MxSearch::search(const MxMatcherList& matchers) const
+MxSearch::Matches MxSearch::search(const MxMatcherList& matchers, MxTreeSnapshotRef& snap) const
 {
     std::shared_lock lock(mutex);
     //-----------------------------------------------------------
+    snap = _snap;
 
     Matches hits;
     ScopeTimer timer;
@@ -117,14 +136,115 @@ MxSearch::Matches MxSearch::search(const MxMatcherList& matchers) const
 
 void MxSearch::clear()
 {
-    for(size_t i = 0; i < _strings.size(); ++i)
-        _stralloc.Free(_strings[i].s, _strings[i].len);
+    if(!_mapped)
+        for(size_t i = 0; i < _strings.size(); ++i)
+            _stralloc.Free(_strings[i].s, _strings[i].len);
+    _mapped.reset();
     _strings.clear();
     _keys.clear();
+    _snap = NULL;
 }
 
-void MxSearch::onTreeRebuilt(VarCRef src)
+bool MxSearch::saveCache(const char *fn, const MxTreeSnapshotRef& snap) const
+{
+    ScopeTimer timer;
+    std::vector<char> buf;
+    {
+        std::shared_lock lock(mutex);
+        //-----------------------------------------------------------
+        if(!_snap || _snap != snap)
+            return false;
+
+        DataTree tmp;
+        VarRef root = tmp.root().makeMap(_keys.size());
+        const DataTree& tree = _snap->tree;
+        for(size_t i = 0; i < _keys.size(); ++i)
+            root[tree.getSL(_keys[i])].setStr(_strings[i].s, _strings[i].len);
+        if(!flatmap::encode(buf, root))
+            return false;
+    }
+    const bool ok = flatmap::write(fn, buf);
+    logdebug("MxSearch::saveCache(): Wrote %zu KB in %u ms, success = %d", buf.size() / 1024, (unsigned)timer.ms(), ok);
+    return ok;
+}
+
+bool MxSearch::loadCache(const char *fn, const MxTreeSnapshotRef& snap)
+{
+    ScopeTimer timer;
+    std::unique_ptr<flatmap::File> f(new flatmap::File);
+    if(!f->open(fn))
+        return false;
+
+    const flatmap::Node root = f->root();
+    const DataTree& tree = snap->tree;
+    const Var::Map *m = tree.root().v->map();
+    if(!root || !m)
+        return false;
+
+    std::unique_lock lock(mutex);       // R+W
+    //-----------------------------------------------------------
+    clear();
+    _strings.reserve(root.size());
+    _keys.reserve(root.size());
+    for(size_t i = 0; i < root.size(); ++i)
+    {
+        const PoolStr mxid = root.key(i);
+        const PoolStr str = root.value(i).str();
+        const StrRef k = mxid.s ? tree.lookup(mxid.s, mxid.len) : 0;
+        if(!k || !str.s || !m->getNoFetch(k))
+            continue; // not in this tree; better safe than sorry
+        MutStr ms;
+        ms.s = const_cast<char*>(str.s); // never written to
+        ms.len = str.len;
+        _strings.push_back(ms);
+        _keys.push_back(k);
+    }
+    _mapped = std::move(f);
+    _snap = snap;
+
+    log("Loaded search cache; %zu out of %zu users searchable, took %u ms",
+        _strings.size(), m->size(), (unsigned)timer.ms());
+    return true;
+}
+
+void MxSearch::onTreeRebuilt(const MxTreeSnapshotRef& snap)
 {
     logdev("MxSearch::onTreeRebuilt()...");
-    this->rebuildCache(src);
+    {
+        std::shared_lock lock(mutex);
+        //-----------------------------------------------------------
+        if(_snap == snap)
+            return; // loaded along with the tree, already up to date
+    }
+    this->rebuildCache(snap);
+}
+
+static std::string cacheFileName(const char *dir)
+{
+    return std::string(dir) + "mxsearch.cache";
+}
+
+void MxSearch::onTreeSaving(const char *dir)
+{
+    remove(cacheFileName(dir).c_str());
+}
+
+void MxSearch::onTreeSaved(const MxTreeSnapshotRef& snap, const char *dir)
+{
+    saveCache(cacheFileName(dir).c_str(), snap);
+}
+
+void MxSearch::onTreeLoaded(const MxTreeSnapshotRef& snap, const char *dir, bool exact)
+{
+    if(exact)
+        loadCache(cacheFileName(dir).c_str(), snap);
+}
+
+bool MxSearch::getUsedFields(std::vector<std::string>& fields) const
+{
+    for(MxSearchConfig::Fields::const_iterator it = scfg.fields.begin(); it != scfg.fields.end(); ++it)
+        fields.push_back(it->first);
+    if(!scfg.displaynameField.empty())
+        fields.push_back(scfg.displaynameField); // for MxSources::formatMatches()
+    return true;
 }
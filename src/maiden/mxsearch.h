@@ -9,6 +9,8 @@
 #include <mutex>
 #include "mem.h"
 #include "mxvirtual.h"
+#include "flatmap.h"
+#include <memory>
 
 class TwoWayMatcher;
 
@@ -44,7 +46,7 @@ public:
     ~MxSearch();
     bool init(VarCRef cfg);
 
-    void rebuildCache(VarCRef src);
+    void rebuildCache(const MxTreeSnapshotRef& snap);
 
 
     // First step is to search in the prepared cache.
@@ -65,14 +67,25 @@ public:
 
     typedef std::vector<Match> Matches;
 
-    Matches search(const MxMatcherList& matchers) const;
+    // snap receives the tree the search cache was built from. Keep it to resolve the matches.
+    Matches search(const MxMatcherList& matchers, MxTreeSnapshotRef& snap) const;
+
+    // The cache can be stored as { mxid => search string } (see flatmap.h).
+    // A loaded cache is searched directly in the mapped file; nothing is copied.
+    bool saveCache(const char *fn, const MxTreeSnapshotRef& snap) const; // fails if the cache wasn't built for snap
+    bool loadCache(const char *fn, const MxTreeSnapshotRef& snap);
 
     // Inherited via EvTreeRebuilt
-    virtual void onTreeRebuilt(VarCRef src) override;
+    virtual void onTreeRebuilt(const MxTreeSnapshotRef& snap) override;
+    virtual void onTreeSaving(const char *dir) override;
+    virtual void onTreeSaved(const MxTreeSnapshotRef& snap, const char *dir) override;
+    virtual void onTreeLoaded(const MxTreeSnapshotRef& snap, const char *dir, bool exact) override;
+    virtual bool getUsedFields(std::vector<std::string>& fields) const override;
 
 private:
 
     void clear();
+    static bool _CollectStats(const void *self, MemStats& st);
 
     mutable std::shared_mutex mutex;
     // These strings are unique; makes no sense to throw them into a string pool
@@ -80,7 +93,9 @@ private:
     // so the exact length is recorded for a reason
     std::vector<MutStr> _strings;
     std::vector<StrRef> _keys;
+    MxTreeSnapshotRef _snap; // StrRefs in _keys belong to this tree
     BlockAllocator _stralloc;
+    std::unique_ptr<flatmap::File> _mapped; // if set, _strings point into this
     const MxSearchConfig& scfg;
 };
 
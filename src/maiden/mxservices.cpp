@@ -398,7 +398,8 @@ MxSearchHandler::MxSearchResultsEx MxSearchHandler::doSearch(const char* term, s
         logdebug("%s", os.str().c_str());
     }
 
-    MxSearch::Matches hits = search.search(matchers);
+    MxTreeSnapshotRef snap;
+    MxSearch::Matches hits = search.search(matchers, snap);
     const size_t totalhits = hits.size();
 
     // keep best matches, drop the rest if above the limit
@@ -408,7 +409,9 @@ MxSearchHandler::MxSearchResultsEx MxSearchHandler::doSearch(const char* term, s
         limited = true;
 
     // resolve matches to something readable
-    MxSearchResults myresults = _sources.formatMatches(searchcfg, hits.data(), hits.size(), hsresults, limit);
+    MxSearchResults myresults;
+    if(snap)
+        myresults = _sources.formatMatches(searchcfg, *snap, hits.data(), hits.size(), hsresults, limit);
 
     // Now we have up to limit many entries on both sides (HS and ours). Merge both.
     MxSearchResultsEx rx = { mergeResults(myresults, hsresults), false };
@@ -524,7 +527,8 @@ void MxSearchHandler::translateResults(VarRef dst, const MxSearchResultsEx& rx)
 MxSearchHandler::MxSearchResultsEx MxSearchHandler::QueryOneServer(const ServerConfig& sv, const std::string& query, VarCRef requestVars)
 {
     MxSearchResultsEx ret;
-    DataTree hsdata(DataTree::TINY); // stores json reply from server and serves as allocator for some temp things
+    ScratchTree scratch(DataTree::TINY);
+    DataTree& hsdata = *scratch; // stores json reply from server and serves as allocator for some temp things
 
     {
         Var hvar;
@@ -576,7 +580,8 @@ int MxSearchHandler::onRequest(BufferedWriteStream& dst, mg_connection* conn, co
         const char *tail = strchr(q, '/'); // skip 1 path component
         if(tail && !strcmp(tail, ClientSearchPostfix))
         {
-            DataTree vars(DataTree::TINY);
+            ScratchTree varscratch(DataTree::TINY);
+            DataTree& vars = *varscratch;
             //int rd = rq.AutoReadVars(vars.root(), conn);
             int rd = rq.ReadJsonBodyVars(vars.root(), conn, true, false, searchcfg.maxsize);
             if(rd > 0)
@@ -598,7 +603,8 @@ int MxSearchHandler::onRequest(BufferedWriteStream& dst, mg_connection* conn, co
                     return 400;
                 }
 
-                DataTree hsdata(DataTree::TINY);
+                ScratchTree hsscratch(DataTree::TINY);
+                DataTree& hsdata = *hsscratch;
                 VarCRef xhsResultsArray;
                 bool raw = false;
                 bool forwardRequestToHS = askHS;
@@ -9,11 +9,21 @@
 #include <algorithm>
 #include <unordered_set>
 #include "subprocess.h"
+#include "jsonstreamwrapper.h"
+#include "tomcrypt/tomcrypt.h"
+#include <string.h>
+#include <stdio.h>
+#include "osfunc.h"
+#include "rng.h"
+#include <queue>
 
 MxSources::MxSources()
-    : _quit(false)
+    : _mergedSinceRebuild(false), _skippedRebuilds(0), _version(0), _savedVersion(0), _baseSize(0), _project(false), _nextCheckpoint(0), _quit(false), _jobsDone(0)
 {
-    _merged.root().makeMap();
+    MxTreeSnapshot *snap = new MxTreeSnapshot;
+    snap->tree.root().makeMap();
+    snap->tree.setMemTag("sources");
+    _merged = snap;
 }
 
 MxSources::~MxSources()
@@ -23,6 +33,12 @@ MxSources::~MxSources()
 
     if(_th.joinable())
         _th.join();
+
+    if(_checkpoint.valid())
+        _checkpoint.wait();
+
+    for(size_t i = 0; i < _pending.size(); ++i)
+        delete _pending[i];
 }
 
 static const char *addString(VarCRef x, std::vector<const char *>& ptrs, std::vector<std::string>& strtab)
@@ -127,6 +143,8 @@ bool MxSources::initConfig(VarCRef src, VarCRef env)
         return true;
     }
 
+    _state.resize(_cfg.list.size());
+
     // fixup all pointers
     for(size_t i = 0; i < _cfg.list.size(); ++i)
     {
@@ -145,6 +163,54 @@ bool MxSources::initConfig(VarCRef src, VarCRef env)
                 return false;
             }
 
+    _cfg.checkpointEvery = 0;
+    if(VarCRef xcp = src.lookup("checkpointEvery"))
+        if(const char *p = xcp.asCString())
+            if(!strToDurationMS_Safe(&_cfg.checkpointEvery, p))
+            {
+                logerror("MxSources: Failed to parse 'checkpointEvery' field");
+                return false;
+            }
+
+    _cfg.mergeEvery = 1000;
+    if(VarCRef xmerge = src.lookup("mergeEvery"))
+        if(const char *p = xmerge.asCString())
+            if(!strToDurationMS_Safe(&_cfg.mergeEvery, p))
+            {
+                logerror("MxSources: Failed to parse 'mergeEvery' field");
+                return false;
+            }
+
+    _cfg.maxConcurrent = 4;
+    if(VarCRef xmax = src.lookup("maxConcurrent"))
+    {
+        if(const u64 *pmax = xmax.asUint())
+            _cfg.maxConcurrent = size_t(*pmax);
+        else
+        {
+            logerror("MxSources: 'maxConcurrent' must be a number >= 0");
+            return false;
+        }
+    }
+
+    _cfg.jitter = 0;
+    if(VarCRef xjitter = src.lookup("jitter"))
+        if(const char *p = xjitter.asCString())
+            if(!strToDurationMS_Safe(&_cfg.jitter, p))
+            {
+                logerror("MxSources: Failed to parse 'jitter' field");
+                return false;
+            }
+
+    _cfg.backoffMax = 60 * 60 * 1000;
+    if(VarCRef xbackoff = src.lookup("backoffMax"))
+        if(const char *p = xbackoff.asCString())
+            if(!strToDurationMS_Safe(&_cfg.backoffMax, p))
+            {
+                logerror("MxSources: Failed to parse 'backoffMax' field");
+                return false;
+            }
+
     VarCRef xdirectory = src.lookup("directory");
     if (xdirectory && xdirectory.type() == Var::TYPE_STRING)
     {
@@ -160,6 +226,17 @@ bool MxSources::initConfig(VarCRef src, VarCRef env)
 
     logdebug("MxSources: %u sources configured", (unsigned)_cfg.list.size());
     logdebug("MxSources: Purge tree every %ju seconds", _cfg.purgeEvery / 1000);
+    logdebug("MxSources: Fetch up to %zu sources at once (0 = no limit)", _cfg.maxConcurrent);
+    logdebug("MxSources: Publish merged sources at most every %ju ms", _cfg.mergeEvery);
+    logdebug("MxSources: Schedule jitter up to %ju ms, backoff up to %ju seconds", _cfg.jitter, _cfg.backoffMax / 1000);
+
+    if(_cfg.checkpointEvery && _cfg.directory.empty())
+    {
+        logerror("MxSources: 'checkpointEvery' is set but there is no directory to save to, ignoring");
+        _cfg.checkpointEvery = 0;
+    }
+    if(_cfg.checkpointEvery)
+        logdebug("MxSources: Checkpoint tree to disk every %ju seconds", _cfg.checkpointEvery / 1000);
 
     return _checkAll();
 }
@@ -237,6 +314,8 @@ void MxSources::initPopulate(bool buildAsync)
         return;
     }
 
+    _updateProjection();
+
     if(!buildAsync)
     {
         logdebug("MxSources: Populating initial tree...");
@@ -244,236 +323,578 @@ void MxSources::initPopulate(bool buildAsync)
         logdebug("MxSources: ... done\n");
     }
 
+    _nextCheckpoint = timeNowMS() + _cfg.checkpointEvery;
     _th = std::thread(_Loop_th, this, buildAsync);
     logdebug("MxSources: Spawned background thread");
 }
 
+template<typename F>
+void MxSources::_forEachSourceLimited(const F& f)
+{
+    const size_t N = _cfg.list.size();
+    const size_t nth = _cfg.maxConcurrent ? std::min(N, _cfg.maxConcurrent) : N;
+    std::atomic<size_t> next(0);
+    auto work = [&]()
+    {
+        for(size_t i; (i = next++) < N; )
+            f(i);
+    };
+    std::vector<std::future<void> > futs;
+    futs.reserve(nth);
+    for(size_t k = 0; k < nth; ++k)
+        futs.push_back(std::async(std::launch::async, work));
+    for(size_t k = 0; k < nth; ++k)
+        futs[k].get();
+}
+
+void MxSources::_recordRun(size_t idx, bool ok, u64 ms)
+{
+    SourceState& st = _state[idx];
+    ++st.runs;
+    st.lastMS = ms;
+    st.maxMS = std::max(st.maxMS, ms);
+    st.totalMS += ms;
+    if(ok)
+        st.failStreak = 0;
+    else
+    {
+        ++st.failures;
+        ++st.failStreak;
+    }
+    logdebug("MxSources: * '%s' took %ju ms (avg %ju, max %ju), %ju runs, %ju failed",
+        _cfg.list[idx].args[0], ms, st.totalMS / st.runs, st.maxMS, st.runs, st.failures);
+}
+
+u64 MxSources::_nextDelay(size_t idx) const
+{
+    const u64 every = _cfg.list[idx].every;
+    u64 delay = every;
+    if(const unsigned streak = _state[idx].failStreak)
+    {
+        const u64 cap = std::max(every, _cfg.backoffMax);
+        delay = streak < 32 && every <= (cap >> streak) ? every << streak : cap;
+        log("MxSources: '%s' failed %u times in a row, next try in %ju ms", _cfg.list[idx].args[0], streak, delay);
+    }
+    if(_cfg.jitter)
+        delay += GetRandom64() % (_cfg.jitter + 1);
+    return delay;
+}
+
+void MxSources::_logStats() const
+{
+    for(size_t i = 0; i < _cfg.list.size(); ++i)
+    {
+        const SourceState& st = _state[i];
+        if(st.runs)
+            log("MxSources: Stats for '%s': %ju runs, %ju failed, %ju unchanged, avg %ju ms, max %ju ms, last %ju ms",
+                _cfg.list[i].args[0], st.runs, st.failures, st.skipped, st.totalMS / st.runs, st.maxMS, st.lastMS);
+    }
+}
+
 void MxSources::_loop_th_untilPurge()
 {
     const size_t N = _cfg.list.size();
     u64 now = timeNowMS();
+    const u64 purgeWhen = _cfg.purgeEvery ? now + _cfg.purgeEvery : 0;
+    const size_t maxRunning = _cfg.maxConcurrent ? _cfg.maxConcurrent : N;
 
-    std::vector<u64> whens(N);
+    // Min-heap of (when, source index). Sources that are running aren't in here;
+    // they're added back once done, so a slow source never overlaps with itself.
+    typedef std::pair<u64, size_t> Deadline;
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> > due;
     for(size_t i = 0; i < N; ++i)
-        whens[i] = now + _cfg.list[i].every;
+        if(_cfg.list[i].every) // don't repeat once-only loads
+            due.push(Deadline(now + _nextDelay(i), i));
 
-    const u64 purgeWhen = _cfg.purgeEvery ? now + _cfg.purgeEvery : 0;
-
-    std::vector<std::future<IngestResult> > futs; // always NULL values
-    futs.reserve(N);
+    struct Job
+    {
+        size_t idx;
+        std::future<IngestResult> fut; // always NULL tree
+    };
+    std::vector<Job> running;
+    running.reserve(std::min(N, maxRunning));
+    u64 lastMerge = 0;
 
-    while(!_quit && (!purgeWhen || now < purgeWhen))
+    while(!_quit)
     {
-        // finish up any remaining background jobs
-        for(size_t i = 0; i < futs.size(); ++i)
-            futs[i].wait();
-        futs.clear();
+        u64 seen;
+        {
+            std::lock_guard<std::mutex> lock(_waitlock);
+            //---------------------------------------
+            seen = _jobsDone;
+        }
 
-        // sync time; exit when it's time to purge
+        // finish up background jobs
+        for(size_t i = 0; i < running.size(); )
+        {
+            if(running[i].fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            {
+                const size_t idx = running[i].idx;
+                running[i].fut.get();
+                due.push(Deadline(timeNowMS() + _nextDelay(idx), idx));
+                running[i] = std::move(running.back());
+                running.pop_back();
+            }
+            else
+                ++i;
+        }
+
+        // sync time; exit when it's time to purge and everything in flight is done
         now = timeNowMS();
-        u64 mintime = u64(-1);
+        const bool purge = purgeWhen && now >= purgeWhen;
+        if(purge && running.empty())
+            break; // anything still pending is merged after the rebuild, or dropped if that succeeds
 
-        u64 timeUntilPurge = 0;
-        if(now < purgeWhen)
+        // Publish what finished jobs left behind. Each publish copies the whole tree,
+        // so sources that finish in quick succession are batched up and share one copy.
+        bool pending;
         {
-            timeUntilPurge = purgeWhen - now;
-            mintime = std::min(mintime, timeUntilPurge);
+            std::lock_guard<std::mutex> lock(_pendinglock);
+            //---------------------------------------
+            pending = !_pending.empty();
+        }
+        if(pending && now >= lastMerge + _cfg.mergeEvery)
+        {
+            if(_mergePending())
+                _sendTreeRebuiltEvent(); // listeners must know if anything was merged
+            lastMerge = now;
+            pending = false;
         }
-        else if(purgeWhen)
-            break;
 
-        std::unique_lock lock(_waitlock); // this is just to make _waiter below work
+        // spawn async jobs that will auto-merge themselves when done, as many as allowed
+        while(!purge && running.size() < maxRunning && !due.empty() && due.top().first <= now)
+        {
+            Job job;
+            job.idx = due.top().second;
+            job.fut = _ingestDataAndMergeAsync(job.idx);
+            running.push_back(std::move(job));
+            due.pop();
+        }
 
-        // spawn async jobs that will auto-merge themselves when done
-        for(size_t i = 0; i < N; ++i)
+        u64 mintime = u64(-1);
+        if(purgeWhen && !purge)
+            mintime = purgeWhen - now;
+        if(!purge && running.size() < maxRunning && !due.empty())
+            mintime = std::min(mintime, due.top().first > now ? due.top().first - now : 0);
+        if(pending)
+            mintime = std::min(mintime, lastMerge + _cfg.mergeEvery - now);
+
+        if(_cfg.checkpointEvery)
         {
-            const u64 every = _cfg.list[i].every;
-            if(!every) // don't repeat once-only loads
-                continue;
+            if(now >= _nextCheckpoint)
+            {
+                _checkpointAsync();
+                _nextCheckpoint = now + _cfg.checkpointEvery;
+            }
+            mintime = std::min(mintime, _nextCheckpoint - now);
+        }
 
-            const u64 when = whens[i];
-            if(now < when)
+        std::unique_lock lock(_waitlock); // this is just to make _waiter below work
+        if(mintime && !_quit && _jobsDone == seen)
+        {
+            // this wait can get interrupted to exit early, and finished jobs wake it up too
+            auto wake = [&]() { return _quit || _jobsDone != seen; };
+            if(mintime == u64(-1))
             {
-                // not yet time... wait some more
-                mintime = std::min(mintime, when - now);
+                logdebug("MxSources: Sleeping until a job finishes (%zu running, %zu queued)", running.size(), due.size());
+                _waiter.wait(lock, wake);
             }
             else
             {
-                // merge directly into existing tree
-                futs.push_back(std::move(_ingestDataAndMergeAsync(&_merged, _cfg.list[i])));
-                whens[i] = now + every;
-                mintime = std::min(mintime, every);
+                logdebug("MxSources: Sleeping for up to %ju ms until next job (%zu running, %zu queued)",
+                    mintime, running.size(), due.size());
+                _waiter.wait_for(lock, std::chrono::milliseconds(mintime), wake);
             }
         }
-
-        if(mintime)
-        {
-            logdebug("MxSources: Sleeping for up to %ju ms until next job (%ju ms until purge)",
-                mintime, timeUntilPurge);
-            // this wait can get interrupted to exit early
-            _waiter.wait_for(lock, std::chrono::milliseconds(mintime));
-        }
     }
+
+    _logStats();
+}
+
+static bool hashFile(unsigned char *dst, const char *fn)
+{
+    FILE *f = fopen(fn, "rb");
+    if(!f)
+        return false;
+    const ltc_hash_descriptor *hd = &sha256_desc;
+    hash_state h;
+    hd->init(&h);
+    char buf[64 * 1024];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)))
+        hd->process(&h, (const unsigned char*)buf, (unsigned long)n);
+    const bool ok = !ferror(f);
+    fclose(f);
+    hd->done(&h, dst);
+    return ok;
 }
 
-DataTree *MxSources::_ingestData(const Config::InputEntry& entry) const
+MxSources::IngestResult MxSources::_ingest(size_t idx, bool dropUnchanged) const
 {
+    const Config::InputEntry& entry = _cfg.list[idx];
     assert(entry.args.size());
 
     // for error reporting
     const char *str = entry.args[0];
+    const KeyFilter *filter = _project ? &_projection : NULL;
 
     log("MxSources: * Starting ingest '%s' ...", str);
-    DataTree *ret = new DataTree;
+    IngestResult res;
+    DataTree *tre = new DataTree;
     ScopeTimer timer;
     bool ok = false;
 
     switch(entry.how)
     {
         case Config::IN_LOAD:
-            ok = serialize::load(ret->root(), entry.args[0]);
+            // Hashing a file is much cheaper than parsing it, so check that first
+            ok = hashFile(res.fingerprint, str);
+            if(ok && dropUnchanged && _isUnchanged(idx, res.fingerprint))
+                break;
+            ok = ok && serialize::load(tre->root(), str, serialize::AUTOC, serialize::AUTO, filter);
         break;
 
         case Config::IN_EXEC:
-            ok = loadJsonFromProcess(ret->root(), &entry.args[0], _envPtrs.data()); // TODO: env
+            // The output is only known once it was read entirely, so it's compared after parsing
+            ok = loadFromProcess(tre->root(), &entry.args[0], _envPtrs.data(), filter, res.fingerprint);
         break;
     }
 
     const u64 loadedMS = timer.ms();
 
     if(!ok)
+    {
         logerror("MxSources: * ERROR: Failed to ingest '%s'", str);
-    else if(ret->root().type() == Var::TYPE_MAP)
+        delete tre;
+        return res;
+    }
+
+    if(dropUnchanged && _isUnchanged(idx, res.fingerprint))
+    {
+        res.loaded = true;
+        res.unchanged = true;
+        delete tre;
+        return res;
+    }
+
+    if(tre->root().type() == Var::TYPE_MAP)
         log("MxSources: * ... Ingested '%s' in %ju ms", str, loadedMS);
     else
         logerror("MxSources: * WARNING: Ingest '%s': Result type is not map", str);
 
-    if(!ok)
+    res.loaded = true;
+    if(VarCRef data = tre->root().lookup("data"))
     {
-        delete ret;
-        ret = NULL;
+        if(data.type() == Var::TYPE_MAP)
+        {
+            // Hoist data to the root. This moves the data, nothing is copied.
+            Var tmp(std::move(*const_cast<Var*>(data.v)));
+            tre->root().clear();
+            tre->_root = std::move(tmp);
+            res.tree = tre;
+            return res; // caller takes ownership
+        }
+        else
+        {
+            logerror("MxSources: ERROR: Ingest '%s': value under key 'data' is not map, ignoring", str);
+            res.ignored = true;
+        }
     }
+    else
+    {
+        logerror("MxSources: WARNING: Ingest '%s' has no 'data' key, skipping", str);
+        res.ignored = true;
+    }
+    delete tre;
+    return res;
+}
 
-    return ret;
+bool MxSources::_isUnchanged(size_t idx, const unsigned char *fingerprint) const
+{
+    const SourceState& st = _state[idx];
+    return st.hasFingerprint && !memcmp(st.fingerprint, fingerprint, FINGERPRINT_SIZE);
 }
 
-MxSources::IngestResult MxSources::_ingestDataAndMerge(DataTree *dst, const Config::InputEntry& entry)
+void MxSources::_setFingerprint(size_t idx, const unsigned char *fingerprint)
 {
-    IngestResult res;
-    if(DataTree *tre = _ingestData(entry))
+    SourceState& st = _state[idx];
+    memcpy(st.fingerprint, fingerprint, FINGERPRINT_SIZE);
+    st.hasFingerprint = true;
+}
+
+MxSources::IngestResult MxSources::_ingestDataAndMerge(size_t idx)
+{
+    const Config::InputEntry& entry = _cfg.list[idx];
+    ScopeTimer runtimer;
+    IngestResult res = _ingest(idx, true);
+    if(res.unchanged)
     {
-        res.loaded = true;
-        if(VarCRef data = tre->root().lookup("data"))
+        const u64 skipped = ++_state[idx].skipped;
+        log("MxSources: * ... '%s' is unchanged, skipping merge (%ju times so far)", entry.args[0], skipped);
+    }
+    else if(DataTree *tre = res.tree)
+    {
+        res.tree = NULL;
         {
-            if(data.type() == Var::TYPE_MAP)
-            {
-                if(dst)
-                {
-                    u64 ms;
-                    {
-                        DataTree::LockedRef locked = dst->lockedRef();
-                        //----------------------------------
-                        ScopeTimer timer;
-                        locked.ref.merge(data, MERGE_RECURSIVE);
-                        ms = timer.ms();
-                    }
-                    logdebug("MxSources: * ... and merged '%s' in %ju ms", entry.args[0], ms);
-                    res.merged = true;
-                    // proceed to delete it
-                }
-                else
-                    res.tree = tre;
-            }
-            else
-            {
-                logerror("MxSources: ERROR: Ingest '%s': value under key 'data' is not map, ignoring", entry.args[0]);
-                res.ignored = true;
-            }
+            std::lock_guard<std::mutex> lock(_pendinglock);
+            //----------------------------------
+            _pending.push_back(tre);
         }
-        else
+        // The scheduler merges and publishes it along with whatever else finished in the meantime
+        logdebug("MxSources: * ... and queued '%s' for merging", entry.args[0]);
+        _setFingerprint(idx, res.fingerprint);
+        res.merged = true;
+    }
+
+    _recordRun(idx, res.loaded && !res.ignored, runtimer.ms());
+    return res;
+}
+
+size_t MxSources::_mergePending()
+{
+    std::vector<DataTree*> batch;
+    size_t merged = 0;
+    {
+        std::lock_guard<std::mutex> lock(_writelock);
+        //----------------------------------
         {
-            logerror("MxSources: WARNING: Ingest '%s' has no 'data' key, skipping", entry.args[0]);
-            res.ignored = true;
+            std::lock_guard<std::mutex> plock(_pendinglock);
+            //----------------------------------
+            batch.swap(_pending);
         }
-        delete tre;
+        if(batch.empty())
+            return 0;
+
+        // Var trees can't share subtrees, so the next version starts as a copy.
+        // That is O(size of tree) in time and keeps two full trees around until the old one is released,
+        // which is why merges are batched (see Config::mergeEvery).
+        // Readers continue to use the current version in the meantime.
+        ScopeTimer timer;
+        const MxTreeSnapshotRef cur = snapshot();
+        DataTree next;
+        next._root = cur->tree.root().v->clone(next, cur->tree);
+        bool ok = !cur->tree.root().v->map() || next._root.map(); // a failed map clone leaves no map behind
+        const u64 copyMS = timer.ms();
+        for(size_t i = 0; ok && i < batch.size(); ++i)
+            ok = next.root().merge(batch[i]->root(), MERGE_RECURSIVE);
+        if(ok)
+        {
+            for(size_t i = 0; i < batch.size(); ++i)
+                _journalChanges(cur->tree.root(), next.root(), batch[i]->root(), false);
+            _publish(next);
+            merged = batch.size();
+            logdebug("MxSources: Published %zu merged sources after %ju ms (copy took %ju ms)",
+                batch.size(), timer.ms(), copyMS);
+        }
+        else
+            logerror("MxSources: Failed to merge %zu sources, keeping the current version until the next rebuild",
+                batch.size());
+        // Either way the tree is no longer exactly what the sources' fingerprints say,
+        // so the next rebuild must not be skipped
+        _mergedSinceRebuild = true;
     }
+    for(size_t i = 0; i < batch.size(); ++i)
+        delete batch[i];
+    return merged;
+}
 
-    return res;
+std::future<MxSources::IngestResult> MxSources::_ingestDataAndMergeAsync(size_t idx)
+{
+    return std::async(std::launch::async, [this, idx]()
+    {
+        IngestResult res = _ingestDataAndMerge(idx);
+        {
+            std::lock_guard<std::mutex> lock(_waitlock);
+            //---------------------------------------
+            ++_jobsDone;
+        }
+        _waiter.notify_all(); // wake up the scheduler
+        return res;
+    });
+}
+
+MxTreeSnapshotRef MxSources::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(_mergedlock);
+    //----------------------------------
+    return _merged;
 }
 
-std::future<MxSources::IngestResult> MxSources::_ingestDataAndMergeAsync(DataTree *dst, const Config::InputEntry& entry)
+void MxSources::_publish(DataTree& tree)
 {
-    return std::async(std::launch::async, &MxSources::_ingestDataAndMerge, this, dst, entry);
+    MxTreeSnapshot *snap = new MxTreeSnapshot;
+    snap->tree.swap(tree);
+    snap->tree.setMemTag("sources");
+    snap->version = ++_version;
+
+    MxTreeSnapshotRef old;
+    {
+        std::lock_guard<std::mutex> lock(_mergedlock);
+        //----------------------------------
+        old = std::move(_merged);
+        _merged = snap;
+    }
+    // The old version is deleted when the last reader lets go of it (possibly right here)
 }
 
 void MxSources::_rebuildTree()
 {
     ScopeTimer timer;
+    const size_t N = _cfg.list.size();
 
-    DataTree newtree;
-
-    // get subtrees in parallel
+    // Fetch and parse everything in parallel (but not too much at once).
     // DO NOT lock anything just yet -- the ingest might take quite some time!
     // While we're still here and ingesting, continue serving the old tree
-    const size_t N = _cfg.list.size();
+    std::vector<IngestResult> results(N);
+    {
+        std::vector<u64> runMS(N);
+        _forEachSourceLimited([&](size_t i)
+        {
+            ScopeTimer t;
+            results[i] = _ingest(i, false);
+            runMS[i] = t.ms();
+        });
+        for(size_t i = 0; i < N; ++i)
+            _recordRun(i, results[i].loaded && !results[i].ignored, runMS[i]);
+    }
+    // --- Futures are done now ---
+
+    unsigned fail = 0;
+    for(size_t i = 0; i < N; ++i)
+        fail += !results[i].loaded;
+
+    // If every source produced the same output as last time and nothing was merged on top since,
+    // the rebuilt tree would be the same as the current one. No need to bother anyone then.
+    bool unchanged = false;
+    if(!fail && !_mergedSinceRebuild)
+    {
+        size_t same = 0;
+        for(size_t i = 0; i < N; ++i)
+            same += _isUnchanged(i, results[i].fingerprint);
+        unchanged = same == N;
+    }
+
+    if(fail || unchanged)
     {
-        std::vector<std::future<IngestResult> > futs;
-        futs.reserve(N);
         for(size_t i = 0; i < N; ++i)
-            futs.push_back(std::move(_ingestDataAndMergeAsync(&newtree, _cfg.list[i])));
-        unsigned fail = 0;
-        for (size_t i = 0; i < N; ++i)
+            delete results[i].tree;
+        if(fail)
+            logerror("%u/%u ingests failed, aborting. Tree will remain unchanged.", fail, (unsigned)N);
+        else
         {
-            IngestResult res = futs[i].get();
-            assert(!res.tree);
-            fail += !res.loaded;
+            ++_skippedRebuilds;
+            log("MxSources: All %u sources unchanged after %ju ms, skipping rebuild (%ju times so far)",
+                (unsigned)N, timer.ms(), _skippedRebuilds);
         }
-        if(fail)
+        return;
+    }
+
+    // The first source's tree is used as a staging area, the others are merged into it.
+    // Once complete, it's published as is. This avoids copying everything into an intermediate tree
+    // and then again into _merged.
+    DataTree *staging = NULL;
+    for(size_t i = 0; i < N; ++i) // in config order, so that later sources override earlier ones
+    {
+        DataTree *tre = results[i].tree;
+        results[i].tree = NULL;
+        if(!tre)
+            continue;
+        if(!staging)
         {
-            logerror("%u/%u ingests failed, aborting. Tree will remain unchanged.", fail, (unsigned)N);
-            return;
+            staging = tre;
+            continue;
         }
+
+        ScopeTimer mtimer;
+        staging->root().merge(tre->root(), MERGE_RECURSIVE);
+        delete tre;
+        logdebug("MxSources: * ... and merged '%s' in %ju ms", _cfg.list[i].args[0], mtimer.ms());
+    }
+
+    if(!staging)
+    {
+        staging = new DataTree;
+        staging->root().makeMap();
     }
-    // --- Futures are done now ---
 
     const u64 loadedMS = timer.ms();
     logdebug("MxSources: Done loading %u subtrees after %ju ms", (unsigned)N, loadedMS);
 
-    // swap in as atomically as possible
     {
-        DataTree::LockedRef locked = this->lockedRef();
+        std::lock_guard<std::mutex> lock(_writelock);
         // -------------------------------------
-        Var del(std::move(*locked.ref.v)); // keep this until we're done merging -- it's likely we can re-use a lot of strings in the pool
-        locked.ref.merge(newtree.root(), MERGE_FLAT); // the old tree is gone, so just copy things over
-        del.clear(*locked.ref.mem); // old things can go now
-        locked.ref.mem->defrag();
+        _journalChanges(snapshot()->tree.root(), staging->root(), staging->root(), true);
+        _publish(*staging);
+        _mergedSinceRebuild = false;
+        // Anything still waiting to be merged is older than what was just ingested
+        std::lock_guard<std::mutex> plock(_pendinglock);
+        //----------------------------------
+        for(size_t i = 0; i < _pending.size(); ++i)
+            delete _pending[i];
+        _pending.clear();
     }
-    logdebug("MxSources: Tree rebuilt, merged in %ju ms", timer.ms() - loadedMS);
+    delete staging; // empty now
+    for(size_t i = 0; i < N; ++i)
+        _setFingerprint(i, results[i].fingerprint);
+    logdebug("MxSources: Tree rebuilt, published after %ju ms", timer.ms() - loadedMS);
 
     _sendTreeRebuiltEvent();
 }
 
-static void _OnTreeRebuilt(EvTreeRebuilt *ev, VarCRef src)
+void MxSources::_checkpointAsync()
 {
-    ev->onTreeRebuilt(src);
+    // If the previous checkpoint is still being written, skip this one. The next one will catch up.
+    if(_checkpoint.valid() && _checkpoint.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+        logdebug("MxSources: Previous checkpoint still in progress, skipping");
+        return;
+    }
+    _checkpoint = std::async(std::launch::async, &MxSources::save, this);
+}
+
+static void _OnTreeRebuilt(EvTreeRebuilt *ev, MxTreeSnapshotRef snap)
+{
+    ev->onTreeRebuilt(snap);
 }
 
 void MxSources::_sendTreeRebuiltEvent() const
 {
-    DataTree::LockedCRef locked = this->lockedCRef();
-    //----------------------------------
+    const MxTreeSnapshotRef snap = snapshot();
+    std::vector<std::future<void> > futs;
     {
-        std::vector<std::future<void> > futs;
-        {
-            std::unique_lock elock(_eventlock);
-            //----------------------------------
-            futs.resize(_evRebuilt.size());
-            for(size_t i = 0; i < _evRebuilt.size(); ++i)
-                futs[i] = std::move(std::async(std::launch::async, _OnTreeRebuilt, _evRebuilt[i], locked.ref));
-        }
-        // don't keep events locked while the futures finish
+        std::unique_lock elock(_eventlock);
+        //----------------------------------
+        futs.resize(_evRebuilt.size());
+        for(size_t i = 0; i < _evRebuilt.size(); ++i)
+            futs[i] = std::move(std::async(std::launch::async, _OnTreeRebuilt, _evRebuilt[i], snap));
     }
-    // ... but keep the tree read-locked until all futures are done
+    // don't keep events locked while the futures finish,
+    // but don't return before all listeners are done
+}
+
+// These are sent in the caller's thread; they're all about files in our directory, which is ours to write only while saving
+void MxSources::_sendTreeSavingEvent() const
+{
+    std::unique_lock elock(_eventlock);
+    //----------------------------------
+    for(size_t i = 0; i < _evRebuilt.size(); ++i)
+        _evRebuilt[i]->onTreeSaving(_cfg.directory.c_str());
+}
+
+void MxSources::_sendTreeSavedEvent(const MxTreeSnapshotRef& snap) const
+{
+    std::unique_lock elock(_eventlock);
+    //----------------------------------
+    for(size_t i = 0; i < _evRebuilt.size(); ++i)
+        _evRebuilt[i]->onTreeSaved(snap, _cfg.directory.c_str());
+}
+
+void MxSources::_sendTreeLoadedEvent(const MxTreeSnapshotRef& snap, bool exact) const
+{
+    std::unique_lock elock(_eventlock);
+    //----------------------------------
+    for(size_t i = 0; i < _evRebuilt.size(); ++i)
+        _evRebuilt[i]->onTreeLoaded(snap, _cfg.directory.c_str(), exact);
 }
 
 void MxSources::_updateEnv(VarCRef xenv)
@@ -511,6 +932,40 @@ void MxSources::_updateEnv(VarCRef xenv)
     _envPtrs.push_back(NULL); // terminator
 }
 
+void MxSources::_updateProjection()
+{
+    std::vector<std::string> fields;
+    bool all;
+    {
+        std::unique_lock elock(_eventlock);
+        //----------------------------------
+        all = _evRebuilt.empty();
+        for(size_t i = 0; i < _evRebuilt.size() && !all; ++i)
+            all = !_evRebuilt[i]->getUsedFields(fields);
+    }
+
+    std::unordered_set<std::string> keys(fields.begin(), fields.end());
+    if(_project == !all && _projection.keys == keys)
+        return; // no change
+
+    _project = !all;
+    _projection.depth = 2; // { "data": { mxid: { field: ... } } }
+    _projection.keys.swap(keys);
+    if(all)
+    {
+        logdebug("MxSources: Keeping all fields of ingested users");
+        return;
+    }
+
+    std::string list;
+    for(std::unordered_set<std::string>::const_iterator it = _projection.keys.begin(); it != _projection.keys.end(); ++it)
+    {
+        if(!list.empty())
+            list += ", ";
+        list += *it;
+    }
+    logdebug("MxSources: Keeping only these fields of ingested users: %s", list.c_str());
+}
 
 void MxSources::addListener(EvTreeRebuilt* ev)
 {
@@ -570,8 +1025,8 @@ static void formatOneMatch(MxSearchResults& res, const TreeMem& mem, const StrRe
         }
 }
 
-MxSearchResults MxSources::formatMatches(const MxSearchConfig& scfg, const MxSearch::Match* matches, size_t n,
-    const MxSearchResults& hsresults, size_t limit) const
+MxSearchResults MxSources::formatMatches(const MxSearchConfig& scfg, const MxTreeSnapshot& snap, const MxSearch::Match* matches, size_t n,
+    const MxSearchResults& hsresults, size_t limit)
 {
     ScopeTimer timer;
     MxSearchResults res;
@@ -582,15 +1037,15 @@ MxSearchResults MxSources::formatMatches(const MxSearchConfig& scfg, const MxSea
     hsrefVec.reserve(hsresults.size());
 
     {
-        DataTree::LockedCRef locked = this->lockedCRef();
-        //---------------------------------------
+        // No lock necessary; the snapshot is immutable
+        const VarCRef root = snap.tree.root();
 
         // First, take the existing entries in hsresults and translate them to
         // a stringpool ID. if that succeeds, there's likely a duplicate.
         for(size_t i = 0; i < hsresults.size(); ++i)
         {
             const MxSearchResult& sr = hsresults[i];
-            const StrRef ref = locked.ref.mem->lookup(sr.mxid.c_str(), sr.mxid.length());
+            const StrRef ref = root.mem->lookup(sr.mxid.c_str(), sr.mxid.length());
             if(ref)
             {
                 hsrefLUT.insert(ref);
@@ -600,22 +1055,22 @@ MxSearchResults MxSources::formatMatches(const MxSearchConfig& scfg, const MxSea
         DEBUG_LOG("MxSources::formatMatches() hsrefLUT size = %zu", hsrefLUT.size());
 
         // The field name is always the same ID so we can get that early to speed things up
-        const StrRef displaynameRef = locked.ref.mem->lookup(scfg.displaynameField.c_str(), scfg.displaynameField.length());
+        const StrRef displaynameRef = root.mem->lookup(scfg.displaynameField.c_str(), scfg.displaynameField.length());
         
         // This is the global search map: { mxid => { "displayname" = "...", ... } }
-        const Var::Map* const m = locked.ref.v->map();
+        const Var::Map* const m = root.v->map();
 
         // Do the users from hsresults first, so they end up first in the list.
         // This ensures that later when HS's and our results are merged, duplicates
         // appear at the start, so that merging them works
         for(size_t i = 0; i < hsrefVec.size(); ++i) // intentionally not limiting here!
-            formatOneMatch(res, *locked.ref.mem, displaynameRef, m, hsrefVec[i]);
+            formatOneMatch(res, *root.mem, displaynameRef, m, hsrefVec[i]);
 
         for (size_t i = 0; i < n && res.size() < limit; ++i)
         {
             const StrRef key = matches[i].key;
             if(hsrefLUT.find(key) == hsrefLUT.end())
-                formatOneMatch(res, *locked.ref.mem, displaynameRef, m, key);
+                formatOneMatch(res, *root.mem, displaynameRef, m, key);
         }
     }
 
@@ -626,25 +1081,59 @@ MxSearchResults MxSources::formatMatches(const MxSearchConfig& scfg, const MxSea
 }
 
 
-static bool _lockAndSave(const DataTree::LockedCRef& locked, std::string fn)
-{
-    return serialize::save(fn.c_str(), locked.ref, serialize::ZSTD, serialize::BJ);
-}
-
-static bool _lockAndLoad(const DataTree::LockedRef& locked, std::string fn)
-{
-    return serialize::load(locked.ref, fn.c_str(), serialize::ZSTD, serialize::BJ);
-}
-
-bool MxSources::save() const
+bool MxSources::save()
 {
     if (_cfg.directory.empty())
         return false;
 
+    std::lock_guard<std::mutex> lock(_savelock);
+    //---------------------------------------
+    // Published snapshots are never modified, so no need to lock the tree while compressing and writing.
+    // Journal records are appended together with publishing, so this gets the matching journal size.
+    MxTreeSnapshotRef snap;
+    u64 journalSize;
+    {
+        std::lock_guard<std::mutex> wlock(_writelock);
+        //---------------------------------------
+        snap = snapshot();
+        journalSize = _journal.size();
+    }
+    if(snap->version == _savedVersion)
+    {
+        logdebug("MxSources::save(): Tree unchanged since last save, skipping");
+        return true;
+    }
+
+    // Everything since the base was written is in the journal already.
+    // Only write a new base once the journal gets too large compared to it.
+    if(_savedVersion && _journal.isOpen() && !_journal.isBroken() && journalSize < _baseSize / 2)
+    {
+        logdebug("MxSources::save(): Journal is at %ju bytes, not compacting yet", journalSize);
+        _savedVersion = snap->version;
+        return true;
+    }
+
     logdebug("MxSources::save() starting...");
     ScopeTimer timer;
-    bool ok = _lockAndSave(_merged.lockedCRef(), _cfg.directory + "mxsources.mxs");
+    const std::string fn = _cfg.directory + "mxsources.mxs";
+    // Write to a temp file first, so that the existing file stays intact if we crash while saving
+    const std::string tmpfn = fn + ".tmp";
+    _sendTreeSavingEvent();
+    bool ok = serialize::save(tmpfn.c_str(), snap->tree.root(), serialize::ZSTD, serialize::BJ)
+        && replaceFile(fn.c_str(), tmpfn.c_str());
     logdebug("MxSources::save() done in %u ms, success = %d", (unsigned)timer.ms(), ok);
+    if(ok)
+    {
+        _sendTreeSavedEvent(snap);
+        _savedVersion = snap->version;
+        _baseSize = getFileSize(fn.c_str());
+        // Records up to here are part of the new base now. If we crash before this is done,
+        // replaying them again on the next start is harmless.
+        if(_journal.isOpen())
+            _journal.dropFront(journalSize);
+    }
+    else
+        remove(tmpfn.c_str());
     return ok;
 }
 
@@ -653,13 +1142,58 @@ bool MxSources::load()
     if (_cfg.directory.empty())
         return false;
 
+    std::lock_guard<std::mutex> lock(_savelock);
+    //---------------------------------------
     logdebug("MxSources::load() starting...");
     ScopeTimer timer;
-    bool ok = _lockAndLoad(_merged.lockedRef(), _cfg.directory + "mxsources.mxs");
+    const std::string fn = _cfg.directory + "mxsources.mxs";
+    const std::string jfn = _cfg.directory + "mxsources.journal";
+    DataTree tmp;
+    bool ok = serialize::load(tmp.root(), fn.c_str(), serialize::ZSTD, serialize::BJ);
+    size_t replayed = 0;
+    if(ok && !MxJournal::replay(tmp.root(), jfn.c_str(), &replayed))
+        logerror("MxSources::load(): Journal is damaged, some recent changes may be missing");
+    if(ok)
+        _updateProjection();
+    if(ok && _project)
+    {
+        // In case the fields in use changed since this was saved
+        KeyFilter users = _projection;
+        users.depth = 1;
+        if(const size_t dropped = users.apply(tmp.root()))
+            log("MxSources::load(): Dropped %zu fields that are no longer used", dropped);
+    }
     logdebug("MxSources::load() done in %u ms, success = %d", (unsigned)timer.ms(), ok);
 
-    if(ok)
-        _sendTreeRebuiltEvent();
+    _journal.open(jfn.c_str());
+    if(!ok)
+    {
+        _journal.dropFront(_journal.size()); // useless without a base
+        return false;
+    }
 
-    return ok;
+    _baseSize = getFileSize(fn.c_str());
+    {
+        std::lock_guard<std::mutex> wlock(_writelock);
+        //---------------------------------------
+        _publish(tmp);
+        _savedVersion = _version; // base + journal is what is on disk already
+    }
+    // Let listeners pick up what they stored along with the base before they'd rebuild it all
+    _sendTreeLoadedEvent(snapshot(), !replayed);
+    _sendTreeRebuiltEvent();
+
+    return true;
+}
+
+void MxSources::_journalChanges(VarCRef oldroot, VarCRef newroot, VarCRef keys, bool deletes)
+{
+    if(!_journal.isOpen())
+        return;
+
+    ScopeTimer timer;
+    DataTree rec;
+    if(const size_t n = MxJournal::diff(rec.root(), oldroot, newroot, keys, deletes))
+        if(_journal.append(rec.root()))
+            logdebug("MxSources: Journaled %zu changes in %ju ms", n, timer.ms());
 }
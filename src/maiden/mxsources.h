@@ -10,6 +10,8 @@
 #include "mxvirtual.h"
 #include "datatree.h"
 #include "mxsearch.h"
+#include "mxjournal.h"
+#include "keyfilter.h"
 
 // Periodic loader for external 3pid sources
 class MxSources
@@ -35,6 +37,11 @@ public:
             bool check;
         };
         u64 purgeEvery;
+        u64 checkpointEvery; // 0 = only save on exit
+        size_t maxConcurrent; // max. number of sources fetched at the same time. 0 = no limit
+        u64 mergeEvery; // sources that finished are merged and published at most this often, since each publish copies the tree
+        u64 jitter; // up to this many ms are randomly added to each scheduled run
+        u64 backoffMax; // a failing source is retried after every * 2^failures ms, but not later than this
         std::string directory;
         std::vector<InputEntry> list;
     };
@@ -42,17 +49,23 @@ public:
     void addListener(EvTreeRebuilt *ev);
     void removeListener(EvTreeRebuilt *ev);
 
-    DataTree::LockedCRef lockedCRef() const { return _merged.lockedCRef(); }
-    DataTree::LockedRef  lockedRef()        { return _merged.lockedRef(); }
+    // Pin the current version of the merged tree. Never blocks on merges.
+    MxTreeSnapshotRef snapshot() const;
 
     // resolve search matches to actual, ready-to-display search results.
     // The homeserver's search results are prioritized and will appear first in the returned list.
     // Returns up to limit results.
-    MxSearchResults formatMatches(const MxSearchConfig& scfg, const MxSearch::Match* matches, size_t n,
-        const MxSearchResults& hsresults, size_t limit) const;
+    // snap must be the tree the matches were made for (see MxSearch::search()).
+    static MxSearchResults formatMatches(const MxSearchConfig& scfg, const MxTreeSnapshot& snap, const MxSearch::Match* matches, size_t n,
+        const MxSearchResults& hsresults, size_t limit);
     
+    // Loads the base tree and replays the journal on top, then keeps the journal open.
+    // While the journal is open, every published change is appended to it.
+    // save() then only writes a new base tree when the journal gets too large compared to the base,
+    // otherwise it does nothing, as everything is on disk already.
+    // Writing the base doesn't block readers or writers of the tree in the meantime.
     bool load();
-    bool save() const;
+    bool save();
 
 private:
     bool _checkAll() const;
@@ -60,31 +73,93 @@ private:
     std::vector<std::string> _argstrs;
     void _loop_th(bool buildAsync);
     void _loop_th_untilPurge();
-    DataTree *_ingestData(const Config::InputEntry& entry) const; // must delete returned ptr
+
+    enum { FINGERPRINT_SIZE = 32 }; // sha256
 
     struct IngestResult
     {
         DataTree *tree = NULL;
         bool loaded = false; // could load data (aka didn't fail)
-        bool merged = false; // everything was as expected, merged too
+        bool merged = false; // everything was as expected, queued for merging too
         bool ignored = false;
+        bool unchanged = false; // same output as the last time it was merged, so no tree was kept
+        unsigned char fingerprint[FINGERPRINT_SIZE]; // of the raw output, valid if loaded
+    };
+    // Fetch and parse source #idx. Exec'd sources are parsed while the process is writing,
+    // and the fingerprint is computed along the way.
+    // Returns new tree that has the 'data' subtree as its root. Caller must delete it. On fail, returns no tree.
+    // If dropUnchanged is set and the output is the same as the last time it was merged, returns no tree either.
+    IngestResult _ingest(size_t idx, bool dropUnchanged) const;
+
+    // Fetch source #idx, queue the results for merging (see _mergePending()), and return no tree.
+    // Parsing and merging are skipped if the output is the same as the last time it was merged.
+    IngestResult _ingestDataAndMerge(size_t idx);
+    std::future<IngestResult> _ingestDataAndMergeAsync(size_t idx);
+
+    // Only touched by whichever thread is currently ingesting that source
+    struct SourceState
+    {
+        unsigned char fingerprint[FINGERPRINT_SIZE]; // of the output that was last merged
+        bool hasFingerprint = false;
+        u64 skipped = 0; // number of times the output was unchanged
+        // stats
+        u64 runs = 0;
+        u64 failures = 0;
+        unsigned failStreak = 0; // consecutive failures, for backoff
+        u64 lastMS = 0, maxMS = 0, totalMS = 0; // time spent per run
     };
-    // dst is optional. Protocol:
-    // - if dst is valid, merge results into dst and return NULL.
-    // - if it's NULL, return new tree. Caller must delete it. On fail, return NULL.
-    IngestResult _ingestDataAndMerge(DataTree *dst, const Config::InputEntry& entry);
-    std::future<IngestResult> _ingestDataAndMergeAsync(DataTree *dst, const Config::InputEntry& entry);
+    std::vector<SourceState> _state; // one per entry in _cfg.list
+    bool _isUnchanged(size_t idx, const unsigned char *fingerprint) const;
+    void _setFingerprint(size_t idx, const unsigned char *fingerprint);
+    void _recordRun(size_t idx, bool ok, u64 ms);
+    u64 _nextDelay(size_t idx) const; // until the next scheduled run, after the previous one finished
+    void _logStats() const;
+    // Calls f(i) for each source, with at most _cfg.maxConcurrent at the same time
+    template<typename F> void _forEachSourceLimited(const F& f);
+    std::atomic<bool> _mergedSinceRebuild; // if not, and no source changed, a rebuild would change nothing
+    u64 _skippedRebuilds;
 
     void _rebuildTree();
+    void _checkpointAsync();
+    void _publish(DataTree& tree); // swaps out tree's contents. _writelock must be held.
     void _sendTreeRebuiltEvent() const;
+    void _sendTreeSavingEvent() const;
+    void _sendTreeSavedEvent(const MxTreeSnapshotRef& snap) const;
+    void _sendTreeLoadedEvent(const MxTreeSnapshotRef& snap, bool exact) const;
     void _updateEnv(VarCRef env);
+    // Fields of user entries that no listener uses are dropped while parsing.
+    // Set up before anything is ingested, read-only afterwards.
+    void _updateProjection();
+    KeyFilter _projection; // applies to the { "data": { mxid: { field: ... } } } of a raw source
+    bool _project;
     static void _Loop_th(MxSources *self, bool buildAsync);
-    DataTree _merged; // all configured sources merged together. purged every now and then.
+    // All configured sources merged together. purged every now and then.
+    // Replaced as a whole for each update; readers keep using their version until they're done.
+    MxTreeSnapshotRef _merged;
+    mutable std::mutex _mergedlock; // only protects the pointer
+    std::mutex _writelock; // held while building the next version, so that concurrent merges don't lose updates
+    // Parsed sources waiting to be merged. Everything that finishes within Config::mergeEvery
+    // is collected here and merged together with a single copy of the tree instead of one copy each.
+    std::vector<DataTree*> _pending;
+    std::mutex _pendinglock; // only protects _pending
+    // Merges everything in _pending into a copy of the current version and publishes it.
+    // If any merge fails, the current version is kept and the batch is dropped; the next rebuild picks it up again.
+    // Returns how many trees were merged. Takes _writelock.
+    size_t _mergePending();
+    u64 _version; // of the last published snapshot. _writelock must be held.
+    std::mutex _savelock; // only one writer for the files on disk
+    u64 _savedVersion; // snapshot version that is on disk, 0 if none. _savelock must be held.
+    u64 _baseSize; // size of the base tree on disk. _savelock must be held.
+    MxJournal _journal; // appended to with _writelock held
+    void _journalChanges(VarCRef oldroot, VarCRef newroot, VarCRef keys, bool deletes); // _writelock must be held
+    std::future<bool> _checkpoint;
+    u64 _nextCheckpoint;
     Config _cfg;
     std::thread _th;
     std::atomic<bool> _quit;
     std::condition_variable _waiter;
     std::mutex _waitlock;
+    u64 _jobsDone; // incremented whenever a scheduled ingest finished. _waitlock must be held.
     mutable std::mutex _eventlock;
     std::vector<std::string> _envStrings;
     std::vector<const char*> _envPtrs;
@@ -9,6 +9,9 @@
 #include <future>
 #include "strmatch.h"
 #include "mxsources.h"
+#include <unordered_set>
+#include <string_view>
+#include "flatmap.h"
 
 static const u64 second = 1000;
 static const u64 minute = second * 60;
@@ -21,25 +24,33 @@ MxStore::Config::Hash::Hash()
 
 
 MxStore::Config::Config()
-    : minSearchLen(2)
+    : minSearchLen(2), defragPercent(25)
 {
     // default config
     hashcache.pepperTime = 1 * hour;
     hashcache.pepperLenMin = 24;
     hashcache.pepperLenMax = 40;
     wellknown.cacheTime = 1 * hour;
+    wellknown.staleTime = 24 * hour;
     wellknown.failTime = 10 * minute;
+    wellknown.requestTimeout = 5 * second;
+    wellknown.requestMaxSize = 50000;
+    wellknown.maxEntries = 10000;
     register_.maxTime = 24 * hour;
 }
 
 
 MxStore::MxStore(MxSources& sources)
-    : authdata(DataTree::SMALL), wellknown(DataTree::SMALL), hashcache(DataTree::DEFAULT)
+    : hashcache(DataTree::DEFAULT)
     , hashPepperTS(0)
+    , hashPepperGen(0)
     , _sources(sources)
 {
-    authdata.root().makeMap();
-    threepid.root().makeMap()["_data"].clear(); // { _data = None }
+    VarRef tp = threepid.root().makeMap();
+    tp["3pid"].makeMap();
+    tp["user"].makeMap();
+    hashcache.setMemTag("hashcache");
+    threepid.setMemTag("threepid");
 
     // TODO: enable hashcache entries from config
 }
@@ -110,11 +121,14 @@ bool MxStore::init(VarCRef config)
     bool ok =
            readTimeKey(cfg.hashcache.pepperTime, xhashcache, "pepperTime")
         && readTimeKey(cfg.wellknown.cacheTime, xwellknown, "cacheTime")
+        && readTimeKey(cfg.wellknown.staleTime, xwellknown, "staleTime")
         && readTimeKey(cfg.wellknown.failTime, xwellknown, "failTime")
         && readTimeKey(cfg.wellknown.requestTimeout, xwellknown, "requestTimeout")
         && readUintKey(cfg.wellknown.requestMaxSize, xwellknown, "requestMaxSize")
+        && readUintKey(cfg.wellknown.maxEntries, xwellknown, "maxEntries")
         && readTimeKey(cfg.register_.maxTime, xregister, "maxTime")
-        && readUintKey(cfg.minSearchLen, config, "minSearchLen");
+        && readUintKey(cfg.minSearchLen, config, "minSearchLen")
+        && readUintKey(cfg.defragPercent, config, "defragPercent");
 
     if(ok && xhashcache)
         if(VarCRef xpepperlen = xhashcache.lookup("pepperLen"))
@@ -173,7 +187,8 @@ bool MxStore::init(VarCRef config)
                 if(const char *v = it.value().asCString(*xmedia.mem))
                     cfg.media[xmedia.mem->getS(it.key())] = v;
 
-    ok = ok && cfg.hashcache.pepperLenMin <= cfg.hashcache.pepperLenMax;
+    ok = ok && cfg.hashcache.pepperLenMin <= cfg.hashcache.pepperLenMax
+        && cfg.wellknown.maxEntries;
     if(!ok)
     {
         logerror("MxStore::apply(): Failed to apply config\n");
@@ -182,12 +197,15 @@ bool MxStore::init(VarCRef config)
 
     // config looks good, apply
     logdebug("MxStore: minSearchLen = %zu", cfg.minSearchLen);
+    logdebug("MxStore: defrag at %ju%% tombstones", cfg.defragPercent);
     logdebug("MxStore: pepper len = %ju .. %ju", cfg.hashcache.pepperLenMin, cfg.hashcache.pepperLenMax);
     logdebug("MxStore: pepper time = %ju seconds", cfg.hashcache.pepperTime / 1000);
     logdebug("MxStore: wellknown cache time = %ju seconds", cfg.wellknown.cacheTime / 1000);
+    logdebug("MxStore: wellknown stale time = %ju seconds", cfg.wellknown.staleTime / 1000);
     logdebug("MxStore: wellknown fail time = %ju seconds", cfg.wellknown.failTime / 1000);
     logdebug("MxStore: wellknown request timeout = %ju ms", cfg.wellknown.requestTimeout);
     logdebug("MxStore: wellknown request maxsize = %ju bytes", cfg.wellknown.requestMaxSize);
+    logdebug("MxStore: wellknown max. entries = %ju", cfg.wellknown.maxEntries);
     logdebug("MxStore: register max time = %ju seconds", cfg.register_.maxTime / 1000);
 
     for(Config::Media::iterator it = cfg.media.begin(); it != cfg.media.end(); ++it)
@@ -206,126 +224,89 @@ bool MxStore::init(VarCRef config)
 
     this->config = cfg;
 
+    MxResolvCache::Config wcfg;
+    wcfg.cacheTime = cfg.wellknown.cacheTime;
+    wcfg.staleTime = cfg.wellknown.staleTime;
+    wcfg.failTime = cfg.wellknown.failTime;
+    wcfg.requestTimeout = cfg.wellknown.requestTimeout;
+    wcfg.requestMaxSize = cfg.wellknown.requestMaxSize;
+    wcfg.maxEntries = cfg.wellknown.maxEntries;
+    wellknown.setConfig(wcfg);
+
     _sources.addListener(this);
 
     return true;
 }
 
+static void defragStep(DataTree& tree, float threshold)
+{
+    // Readers and writers can keep going while the lookup tables are rebuilt...
+    tree.defragStep(threshold);
+
+    // ... but the old tables may still be in use until readers let go of the tree
+    if(tree.retiredBytes())
+    {
+        std::unique_lock lock(tree.mutex);
+        // --------------------------------------------------
+        tree.freeRetired();
+    }
+}
+
 void MxStore::defrag()
 {
-    // TODO
+    const float threshold = float(config.defragPercent) / 100.0f;
+    defragStep(threepid, threshold);
+    defragStep(hashcache, threshold);
+
+    // Shards that see no new registrations would otherwise keep their dead tokens forever
+    authdata.expire(timeNowMS());
 }
 
 bool MxStore::register_(const char* token, size_t tokenLen, u64 expireInMS, const char *account)
 {
-    std::unique_lock lock(authdata.mutex);
-    //---------------------------------------
-    u64 expiryTime = timeNowMS() + expireInMS;
-    PoolStr tok = { token, tokenLen };
-    VarRef u = authdata.root()[tok];
-    if(!u.isNull())
-        return false;
-    u["expiry"] = expiryTime;
-    u["account"] = account;
-
-    return true;
+    return authdata.add(token, tokenLen, account, timeNowMS() + expireInMS);
 }
 
 MxError MxStore::authorize(const char* token) const
 {
-    std::shared_lock lock(authdata.mutex);
-    //---------------------------------------
-    VarCRef ref = authdata.root().lookup(token);
-    if(!ref || ref.isNull())
-        return M_NOT_FOUND;
-    VarCRef exp = ref.lookup("expiry");
-    if(!exp)
-        return M_SESSION_EXPIRED;
-    const u64 *pexpiryTime = exp.asUint();
-    if(!pexpiryTime || *pexpiryTime < timeNowMS())
-        return M_SESSION_EXPIRED;
-
-    return M_OK;
+    return authdata.authorize(token, timeNowMS());
 }
 
 std::string MxStore::getAccount(const char* token) const
 {
     std::string ret;
-    std::shared_lock lock(authdata.mutex);
-    //---------------------------------------
-    VarCRef ref = authdata.root().lookup(token);
-    if (ref)
-        if(VarCRef acc = ref.lookup("account"))
-            if(const char *pacc = acc.asCString())
-                ret = pacc;
+    authdata.getAccount(ret, token);
     return ret;
 }
 
 void MxStore::logout(const char* token)
 {
-    std::unique_lock lock(authdata.mutex);
-    //---------------------------------------
-    VarRef ref = authdata.root().lookup(token);
-    ref.clear(); // map doesn't support deleting individual keys, so just set to TYPE_NULL for now
+    authdata.remove(token);
 }
 
 void MxStore::storeHomeserverForHost(const char* host, const char* hs, unsigned port)
 {
-    assert(hs && *hs && port);
-    logdebug("Cache HS: [%s] -> [%s:%u]", host, hs, port);
-    std::unique_lock lock(wellknown.mutex);
-    //---------------------------------------
-    VarRef u = wellknown.root()[host];
-    u["homeserver"] = hs;
-    u["port"] = u64(port);
-    u["ts"] = timeNowMS();
+    wellknown.storeValid(host, hs, port);
 }
 
 void MxStore::storeFailForHost(const char* host)
 {
-    logdebug("Cache fail for host: [%s]", host);
-    // FIXME: might want to use a CacheTable<> instead
-    std::unique_lock lock(wellknown.mutex);
-    //---------------------------------------
-    wellknown.root()[host] = timeNowMS();
+    wellknown.storeFail(host);
 }
 
-MxStore::LookupResult MxStore::getCachedHomeserverForHost(const char* host, std::string& hsOut, unsigned& portOut) const
+MxStore::LookupResult MxStore::getCachedHomeserverForHost(const char* host, std::string& hsOut, unsigned& portOut)
 {
-    u64 ts;
-    {
-        std::shared_lock lock(wellknown.mutex);
-        //---------------------------------------
-        VarCRef u = wellknown.root().lookup(host);
-        if(!u)
-            return UNKNOWN;
+    return wellknown.get(host, hsOut, portOut);
+}
 
-        if(const u64 *pFailTs = u.asUint())
-        {
-            return *pFailTs + config.wellknown.failTime < timeNowMS()
-                ? UNKNOWN // fail expired, time to try again
-                : FAILED;
-        }
-        VarCRef hsRef = u.lookup("homeserver");
-        VarCRef portRef = u.lookup("port");
-        VarCRef tsRef = u.lookup("ts");
-        if(!(hsRef && portRef && tsRef))
-            return UNKNOWN;
-        const char *hs = hsRef.asCString();
-        const u64 *pport = portRef.asUint();
-        const u64 *pts = tsRef.asUint();
-        if(!(hs && pport && pts))
-            return UNKNOWN;
-
-        hsOut = hs;
-        portOut = *pport;
-        ts = *pts;
-    }
+MxResolvList MxStore::lookupHomeserverForHost(const char* host)
+{
+    return wellknown.resolve(host);
+}
 
-    u64 now = timeNowMS();
-    return ts + config.wellknown.cacheTime < timeNowMS()
-        ? EXPIRED
-        : VALID;
+void MxStore::refreshHomeserverForHostAsync(const char* host)
+{
+    wellknown.refreshAsync(host);
 }
 
 std::string MxStore::getHashPepper(bool allowUpdate)
@@ -355,7 +336,101 @@ void MxStore::rotateHashPepper()
     rotateHashPepper_nolock(now);
 }
 
-MxError MxStore::hashedBulkLookup(VarRef dst, VarCRef in, const char *algo, const char *pepper)
+u64 MxStore::getHashPepperGen(std::string* pepper, bool allowUpdate)
+{
+    {
+        std::shared_lock lock(hashcache.mutex);
+        //---------------------------------------
+        if(!allowUpdate || hashPepperTS + config.hashcache.pepperTime >= timeNowMS())
+        {
+            if(pepper)
+                *pepper = hashPepper;
+            return hashPepperGen;
+        }
+    }
+
+    std::unique_lock lock(hashcache.mutex);
+    //---------------------------------------
+    std::string pep = getHashPepper_nolock(true); // rotates if nobody else did in the meantime
+    if(pepper)
+        pepper->swap(pep);
+    return hashPepperGen;
+}
+
+static void appendJsonStr(std::string& s, const char *p, size_t len)
+{
+    s += '"';
+    for(size_t i = 0; i < len; ++i)
+    {
+        const unsigned char c = p[i];
+        if(c == '"' || c == '\\')
+        {
+            s += '\\';
+            s += c;
+        }
+        else if(c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            s += buf;
+        }
+        else
+            s += c;
+    }
+    s += '"';
+}
+
+static void appendJsonPair(std::string& s, const PoolStr& k, const PoolStr& v)
+{
+    if(!s.empty())
+        s += ',';
+    appendJsonStr(s, k.s, k.len);
+    s += ':';
+    appendJsonStr(s, v.s, v.len);
+}
+
+void MxLookupResult::writeJson(BufferedWriteStream& dst) const
+{
+    dst.Put('{');
+    bool first = true;
+    for(size_t i = 0; i < chunks.size(); ++i)
+    {
+        const std::string& c = chunks[i];
+        if(c.empty())
+            continue;
+        if(!first)
+            dst.Put(',');
+        dst.Write(c.c_str(), c.length());
+        first = false;
+    }
+    dst.Put('}');
+}
+
+// Look up addrs[begin..end) in the cache and append the hits to out.
+// Only reads from the cache, so this can run in parallel with other readers.
+static size_t lookupChunk(std::string *out, const PoolStr *addrs, size_t begin, size_t end,
+    const Var::Map *cache, const TreeMem *cachemem)
+{
+    size_t n = 0;
+    for(size_t i = begin; i < end; ++i)
+    {
+        const PoolStr& pshash = addrs[i];
+        // NB: If we get invalid base64 here, there will simply be no match.
+        // so we don't even need to decode what the client sent us
+        if(const Var *v = cache->get(*cachemem, pshash.s, pshash.len))
+        {
+            PoolStr ps = v->asString(*cachemem);
+            if(ps.s)
+            {
+                appendJsonPair(*out, pshash, ps);
+                ++n;
+            }
+        }
+    }
+    return n;
+}
+
+MxError MxStore::hashedBulkLookup(MxLookupResult& res, VarCRef in, const char *algo, const char *pepper)
 {
     const Var *a = in.v->array();
     const size_t n = in.size();
@@ -364,73 +439,118 @@ MxError MxStore::hashedBulkLookup(VarRef dst, VarCRef in, const char *algo, cons
     std::shared_lock lock(hashcache.mutex);
     //---------------------------------------
 
-    VarRef cache = hashcache.root().lookup(algo);
-    if(!cache)
-        return M_INVALID_PARAM; // unsupported algo
+    // Pepper rotation and (re-)generating a cache modify the cache, so those need exclusive access.
+    // Check first, and if that's necessary, do it and come back.
+    bool checkRotate = true;
+    for(;;)
+    {
+        VarCRef cache = hashcache.root().lookup(algo);
+        if(!cache)
+            return M_INVALID_PARAM; // unsupported algo
 
-    // This will also rotate the pepper if necessary
-    std::string mypepper = this->getHashPepper_nolock(true);
-    if(mypepper != pepper)
-        return M_INVALID_PEPPER;
+        const bool rotate = checkRotate && hashPepperTS + config.hashcache.pepperTime < timeNowMS();
+        // value is 'false' if marked as 'no cache available' aka 'cache was dropped'
+        const bool generate = cache.type() != Var::TYPE_MAP;
+        if(!rotate && !generate)
+            break;
 
-    // value is 'false' if marked as 'no cache available' aka 'cache was dropped'
-    if(cache.type() == Var::TYPE_BOOL && !cache.asBool())
-    {
-        MxError err = _generateHashCache_nolock(cache, algo);
-        if(err != M_OK)
-            return err;
+        lock.unlock();
+        {
+            std::unique_lock wlock(hashcache.mutex);
+            //---------------------------------------
+            if(rotate)
+                getHashPepper_nolock(true); // rotates if nobody else did in the meantime
+            VarRef c = hashcache.root().lookup(algo);
+            if(c && c.type() != Var::TYPE_MAP)
+            {
+                MxError err = _generateHashCache_nolock(c, algo);
+                if(err != M_OK)
+                    return err;
+            }
+        }
+        lock.lock();
+        checkRotate = false;
     }
 
+    if(hashPepper != pepper)
+        return M_INVALID_PEPPER;
+
+    const Var::Map *cache = hashcache.root().lookup(algo).v->map();
     const bool isNoneAlgo = !strcmp(algo, "none");
 
     // ---- begin actual lookup ---
     ScopeTimer timer;
 
-    // try exact matches first
-    // this is also the only way to look up hashed 3pids
-    for(size_t i = 0; i < n; ++i)
+    // Each key may only appear once in the result, but clients may send the same address more than once,
+    // also once with and once without padding. Weed those out before splitting the work.
+    std::vector<PoolStr> addrs;
+    addrs.reserve(n);
     {
-        PoolStr pshash = a[i].asString(*in.mem);
-
-        // "none" is plaintext, not base64
-        if(!isNoneAlgo)
+        std::unordered_set<std::string_view> seen;
+        seen.reserve(n);
+        for(size_t i = 0; i < n; ++i)
         {
-            // Client sent padded base64? Trim the padding.
-            while(pshash.len && pshash.s[pshash.len-1] == '=')
-                --pshash.len;
-        }
+            PoolStr ps = a[i].asString(*in.mem);
+            if(!ps.s)
+                continue;
 
-        if(pshash.len < config.minSearchLen)
-            continue;
+            // "none" is plaintext, not base64
+            if(!isNoneAlgo)
+            {
+                // Client sent padded base64? Trim the padding.
+                while(ps.len && ps.s[ps.len-1] == '=')
+                    --ps.len;
+            }
 
-        // NB: If we get invalid base64 here, there will simply be no match.
-        // so we don't even need to decode what the client sent us
-        if(VarRef v = cache.lookup(pshash.s, pshash.len))
+            if(ps.len >= config.minSearchLen && seen.insert(std::string_view(ps.s, ps.len)).second)
+                addrs.push_back(ps);
+        }
+    }
+    const size_t nuniq = addrs.size();
+
+    // try exact matches first
+    // this is also the only way to look up hashed 3pids
+    // Large lookups are split into chunks that are done in parallel.
+    enum { MIN_CHUNK_SIZE = 1024 };
+    size_t nchunks = (nuniq + MIN_CHUNK_SIZE - 1) / MIN_CHUNK_SIZE;
+    nchunks = std::max<size_t>(1, std::min<size_t>(nchunks, getNumCPUCores()));
+    const size_t chunksize = (nuniq + nchunks - 1) / nchunks;
+
+    res.chunks.clear();
+    res.chunks.resize(nchunks + isNoneAlgo); // the extra chunk is for the fuzzy lookup
+    res.count = 0;
+    {
+        std::vector<std::future<size_t> > futs;
+        futs.reserve(nchunks);
+        for(size_t i = 1; i < nchunks; ++i)
         {
-            PoolStr ps = v.asString();
-            if(ps.s)
-                dst[pshash].setStr(ps.s, ps.len);
+            const size_t begin = i * chunksize;
+            futs.push_back(std::async(std::launch::async, lookupChunk, &res.chunks[i],
+                addrs.data(), begin, std::min(begin + chunksize, nuniq), cache, &hashcache));
         }
+        // do the first chunk in this thread
+        res.count = lookupChunk(&res.chunks[0], addrs.data(), 0, std::min(chunksize, nuniq), cache, &hashcache);
+        for(size_t i = 0; i < futs.size(); ++i)
+            res.count += futs[i].get();
     }
 
     // and if not hashed, try to find identifiers that somewhat match
     if(isNoneAlgo)
-        unhashedFuzzyLookup_nolock(dst, in);
-
+        res.count += unhashedFuzzyLookup_nolock(res.chunks.back(), in, res);
 
-    logdebug("MxStore: Lookup (%u in, %u out) took %ju ms\n",
-        (unsigned)n, (unsigned)dst.size(), timer.ms());
+    logdebug("MxStore: Lookup (%u in, %u out, %u chunks) took %ju ms\n",
+        (unsigned)n, (unsigned)res.count, (unsigned)nchunks, timer.ms());
 
     return M_OK;
 }
 
 // unhashed bulk lookup if "none" algo
-MxError MxStore::unhashedFuzzyLookup_nolock(VarRef dst, VarCRef in)
+size_t MxStore::unhashedFuzzyLookup_nolock(std::string& out, VarCRef in, const MxLookupResult& exact)
 {
     VarCRef cache = hashcache.root().lookup("none");
     const Var::Map *m = cache ? cache.v->map() : NULL;
     if(!m)
-        return M_NOT_FOUND;
+        return 0;
 
     // cache input strings so we don't have to go through the string pool every single time
 
@@ -450,6 +570,8 @@ MxError MxStore::unhashedFuzzyLookup_nolock(VarRef dst, VarCRef in)
         {
             // this is probably in the format "3pid medium" -- split it up
             PoolStr addr = a[i].asString(*in.mem);
+            if(!addr.s)
+                continue;
             PoolStr med = {};
             if(const char *spc = strchr(addr.s, ' '))
             {
@@ -466,8 +588,24 @@ MxError MxStore::unhashedFuzzyLookup_nolock(VarRef dst, VarCRef in)
     }
     const size_t N = find.size();
     if(!N)
-        return M_OK;
+        return 0;
+
+    // Keys that were an exact match are already in the result and must not appear twice.
+    // They look exactly like the input, so we can tell them apart by the input strings.
+    std::unordered_set<std::string_view> skip;
+    if(exact.count)
+    {
+        const Var *a = in.v->array();
+        const size_t n = in.size();
+        for(size_t i = 0; i < n; ++i)
+        {
+            PoolStr ps = a[i].asString(*in.mem);
+            if(ps.s && m->get(*cache.mem, ps.s, ps.len))
+                skip.insert(std::string_view(ps.s, ps.len));
+        }
+    }
 
+    size_t found = 0;
     for(Var::Map::Iterator it = m->begin(); it != m->end(); ++it)
     {
         const PoolStr k = cache.mem->getSL(it.key());
@@ -485,6 +623,9 @@ MxError MxStore::unhashedFuzzyLookup_nolock(VarRef dst, VarCRef in)
         if(!klen)
             continue;
 
+        PoolStr ps = it.value().asString(*cache.mem);
+        assert(ps.s); // the cache only ever gets strings
+
         for(size_t i = 0; i < N; ++i)
         {
             if(klen < find[i].addr.len)
@@ -500,8 +641,12 @@ MxError MxStore::unhashedFuzzyLookup_nolock(VarRef dst, VarCRef in)
 
             // TODO: do we want to also search values (ie. mxids), or does the matrix server already do that?
 
-            PoolStr ps = it.value().asString(*cache.mem);
-            dst[k].setStr(ps.s, ps.len); // here we use the original k so that both 3pid and medium are part of the key
+            if(skip.find(std::string_view(k.s, k.len)) == skip.end())
+            {
+                appendJsonPair(out, k, ps); // here we use the original k so that both 3pid and medium are part of the key
+                ++found;
+            }
+            break; // each key only once
         }
     }
 
@@ -509,7 +654,7 @@ MxError MxStore::unhashedFuzzyLookup_nolock(VarRef dst, VarCRef in)
     // Would be better to keep a cache for their results too
     // and only do an external call if uncached or too old
 
-    return M_OK;
+    return found;
 }
 
 void MxStore::rebuildHashCache_nolock()
@@ -525,14 +670,12 @@ void MxStore::rebuildHashCache_nolock()
     }
 }
 
-// TODO periodic defragment auth to get rid of leftover map keys
-
-
 void MxStore::rotateHashPepper_nolock(u64 now)
 {
     int r = RandomNumberBetween((int)config.hashcache.pepperLenMin, (int)config.hashcache.pepperLenMax);
     hashPepper = GenerateHashPepper(r);
     hashPepperTS = now;
+    ++hashPepperGen;
     log("Hash pepper update, is now [%s]", hashPepper.c_str());
 
     rebuildHashCache_nolock();
@@ -540,6 +683,35 @@ void MxStore::rotateHashPepper_nolock(u64 now)
 
 static const unsigned char s_space = ' ';
 
+// Calculate the key for a 3pid in the hash cache, the same way a client would do.
+// hd == NULL is the "none" algo. Returns the length of the key, 0 on failure.
+static size_t hash3pidKey(std::string& dst, const ltc_hash_descriptor *hd, const PoolStr& tp, const PoolStr& medium, const std::string& pepper)
+{
+    if(!hd)
+    {
+        // don't need the pepper here
+        dst.assign(tp.s, tp.len);
+        dst += ' ';
+        dst.append(medium.s, medium.len);
+        return dst.length();
+    }
+
+    unsigned char *hashOut = (unsigned char*)alloca(hd->hashsize);
+    hash_state h;
+    hd->init(&h);
+    hd->process(&h, (const unsigned char*)tp.s, tp.len);
+    hd->process(&h, &s_space, 1);
+    hd->process(&h, (const unsigned char*)medium.s, medium.len);
+    hd->process(&h, &s_space, 1);
+    hd->process(&h, (const unsigned char*)pepper.c_str(), pepper.length());
+    hd->done(&h, hashOut);
+
+    dst.resize(base64size(hd->hashsize));
+    size_t enc = base64enc(&dst[0], dst.size(), hashOut, hd->hashsize, false);
+    dst.resize(enc);
+    return enc;
+}
+
 MxError MxStore::_generateHashCache_nolock(VarRef cache, const char* algo)
 {
     // only "none" is fine, otherwise we need a valid descriptor
@@ -555,15 +727,13 @@ MxError MxStore::_generateHashCache_nolock(VarRef cache, const char* algo)
 
     Var::Map *mdst = cache.makeMap().v->map();
 
-    // TODO: lock threepid?
-
-    const Var::Map *mmed = threepid.root().v->map();
+    DataTree::LockedCRef locked = threepid.lockedCRef();
+    //---------------------------------------
 
-    unsigned char *hashOut = (unsigned char*)(hd ? alloca(hd->hashsize) : NULL);
-    const size_t hashBase64Len = hd ? base64size(hd->hashsize) : 0;
-    char *hashBase64 = (char*)(hd ? alloca(hashBase64Len) : NULL);
+    const Var::Map *mmed = locked.ref.lookup("3pid").v->map();
 
     ScopeTimer timer;
+    std::string key;
 
     for(Var::Map::Iterator j = mmed->begin(); j != mmed->end(); ++j)
     {
@@ -578,50 +748,18 @@ MxError MxStore::_generateHashCache_nolock(VarRef cache, const char* algo)
 
         // TODO: this could be done in parallel as long as we output to a local temp array and merge in the end
 
-        if(hd)
+        for(Var::Map::Iterator it = m->begin(); it != m->end(); ++it)
         {
-            for(Var::Map::Iterator it = m->begin(); it != m->end(); ++it)
+            PoolStr ups = it.value().asString(threepid); // value: mxid
+            if(!ups.s)
+                continue; // not an mxid; only possible with a loaded file that wasn't written by us
+            PoolStr kps = threepid.getSL(it.key()); // key: some 3pid
+            assert(kps.s);
+            if(size_t len = hash3pidKey(key, hd, kps, mediumps, hashPepper))
             {
-                PoolStr kps = threepid.getSL(it.key()); // key: some 3pid
-                PoolStr ups = it.value().asString(threepid); // value: mxid
-                assert(kps.s && ups.s);
-                hash_state h;
-                hd->init(&h);
-                hd->process(&h, (const unsigned char*)kps.s, kps.len);
-                hd->process(&h, &s_space, 1);
-                hd->process(&h, (const unsigned char*)mediumps.s, mediumps.len);
-                hd->process(&h, &s_space, 1);
-                hd->process(&h, (const unsigned char*)hashPepper.c_str(), hashPepper.length());
-                hd->done(&h, hashOut);
-
-                size_t enc = base64enc(hashBase64, hashBase64Len, hashOut, hd->hashsize, false);
-                if(enc)
-                {
-                    Var *dst = mdst->putKey(*cache.mem, hashBase64, enc);
-                    if(!dst)
-                        return M_LIMIT_EXCEEDED;
-                    dst->setStr(*cache.mem, ups.s, ups.len);
-                    ++done;
-                }
-            }
-
-        }
-        else // "none"
-        {
-            std::string tmp;
-            for(Var::Map::Iterator it = m->begin(); it != m->end(); ++it)
-            {
-                PoolStr kps = threepid.getSL(it.key()); // key: some 3pid
-                PoolStr ups = it.value().asString(threepid); // value: mxid
-                assert(kps.s && ups.s);
-                tmp = kps.s;
-                tmp += ' ';
-                tmp += mediumps.s;
-                // don't need the pepper here
-                Var *dst = mdst->putKey(*cache.mem, tmp.c_str(), tmp.length());
+                Var *dst = mdst->putKey(*cache.mem, key.c_str(), len);
                 if(!dst)
                     return M_LIMIT_EXCEEDED;
-
                 dst->setStr(*cache.mem, ups.s, ups.len);
                 ++done;
             }
@@ -633,6 +771,56 @@ MxError MxStore::_generateHashCache_nolock(VarRef cache, const char* algo)
     return M_OK;
 }
 
+void MxStore::_patchHashCache_nolock(const ThreepidChanges& changes)
+{
+    Var::Map *caches = hashcache.root().v->map();
+    if(!caches || changes.empty())
+        return;
+
+    ScopeTimer timer;
+    std::string key;
+
+    for(Var::Map::MutIterator it = caches->begin(); it != caches->end(); ++it)
+    {
+        Var::Map *m = it.value().map();
+        if(!m)
+            continue; // not generated; will pick up the changes when it is
+
+        PoolStr algo = hashcache.getSL(it.key());
+        const ltc_hash_descriptor *hd = NULL;
+        if(strcmp(algo.s, "none"))
+        {
+            hd = hash_getdesc(algo.s);
+            if(!hd)
+                continue;
+        }
+
+        for(size_t i = 0; i < changes.size(); ++i)
+        {
+            const ThreepidChange& c = changes[i];
+            PoolStr tp = { c.threepid.c_str(), c.threepid.length() };
+            PoolStr med = { c.medium.c_str(), c.medium.length() };
+            size_t len = hash3pidKey(key, hd, tp, med, hashPepper);
+            if(!len)
+                continue;
+            if(c.added)
+            {
+                if(Var *dst = m->putKey(hashcache, key.c_str(), len))
+                    dst->setStr(hashcache, c.mxid.c_str(), c.mxid.length());
+            }
+            else if(Var *dst = m->get(hashcache, key.c_str(), len))
+            {
+                // only drop if it still points to the user that lost the 3pid
+                const char *mxid = dst->asCString(hashcache);
+                if(mxid && c.mxid == mxid)
+                    m->erase(hashcache, key.c_str(), len);
+            }
+        }
+    }
+
+    logdebug("MxStore: Patched hash caches with %zu changes in %ju ms", changes.size(), timer.ms());
+}
+
 void MxStore::_clearHashCache_nolock()
 {
     Var::Map *m = hashcache.root().v->map();
@@ -657,62 +845,213 @@ void MxStore::markForRehash_nolock()
     return s;
 }
 
-void MxStore::_Rebuild3pidMap(VarRef dst, VarCRef src, const char* fromkey)
+static bool sameStr(const PoolStr& a, const PoolStr& b)
+{
+    return a.len == b.len && (a.s == b.s || (a.s && b.s && !memcmp(a.s, b.s, a.len)));
+}
+
+// true if another field of mxid still has tp as its value
+static bool claimedElsewhere(const std::vector<const Var::Map*>& siblings, TreeMem& mem, const PoolStr& tp, const PoolStr& mxid)
+{
+    for(size_t i = 0; i < siblings.size(); ++i)
+        if(const Var *v = siblings[i]->get(mem, mxid.s, mxid.len))
+            if(sameStr(v->asString(mem), tp))
+                return true;
+    return false;
+}
+
+// drop addrs[tp] if it still belongs to mxid and no other field of mxid maps to it
+static bool remove3pid(Var::Map *addrs, TreeMem& mem, const PoolStr& tp, const PoolStr& mxid, const std::vector<const Var::Map*>& siblings)
+{
+    Var *v = addrs->get(mem, tp.s, tp.len);
+    if(!v || !sameStr(v->asString(mem), mxid) || claimedElsewhere(siblings, mem, tp, mxid))
+        return false;
+    return addrs->erase(mem, tp.s, tp.len);
+}
+
+size_t MxStore::_Update3pidMap(ThreepidChanges& changes, VarRef addrs, VarRef users, const UserMaps& siblings, VarCRef src, const char* fromkey, const char *medium)
 {
     const Var::Map* m = src.v->map();
-    Var::Map* dm = dst.v->map();
+    Var::Map* am = addrs.v->map();
+    Var::Map* um = users.v->map();
+    TreeMem& mem = *addrs.mem;
 
-    assert(m && dm);
+    assert(am && um && addrs.mem == users.mem);
 
-    StrRef keyref = src.mem->lookup(fromkey, strlen(fromkey));
-    if (!keyref || !m || !dm)
-        return; // string isn't present -> can't possibly have this as key
+    if(!m)
+        return 0;
+
+    StrRef keyref = src.mem->lookup(fromkey, strlen(fromkey)); // if not present, nobody has the field
 
     ScopeTimer timer;
-    size_t n = 0;
+    const size_t oldchanges = changes.size();
+    ThreepidChange c;
+    c.medium = medium;
 
+    // new and changed users
     for (Var::Map::Iterator it = m->begin(); it != m->end(); ++it)
     {
-        StrRef mxidRef = it.key();
-        const Var* val = it.value().lookup(keyref); // val = d[mxid]
+        const Var* val = keyref ? it.value().lookup(keyref) : NULL; // val = d[mxid]
+        PoolStr psVal = {};
         if (val && val->type() == Var::TYPE_STRING)
+            psVal = val->asString(*src.mem);
+        PoolStr psMxid = src.mem->getSL(it.key());
+
+        Var *u = psVal.s
+            ? um->putKey(mem, psMxid.s, psMxid.len)
+            : um->get(mem, psMxid.s, psMxid.len);
+        if(!u)
+            continue; // not known and doesn't have a 3pid
+
+        PoolStr old = u->asString(mem);
+        if(sameStr(old, psVal))
+            continue; // unchanged
+
+        c.mxid.assign(psMxid.s, psMxid.len);
+        if(old.s && remove3pid(am, mem, old, psMxid, siblings))
         {
-            PoolStr psMxid = src.mem->getSL(mxidRef);
-            PoolStr psVal = src.mem->getSL(val->asStrRef());
-            // dm[mxid] = val
-            Var *d = dm->putKey(*dst.mem, psMxid.s, psMxid.len);
+            c.threepid.assign(old.s, old.len);
+            c.added = false;
+            changes.push_back(c);
+        }
+        if(psVal.s)
+        {
+            Var *d = am->putKey(mem, psVal.s, psVal.len); // addrs[3pid] = mxid
             if(!d)
-                return;
-            d->setStr(*dst.mem, psVal.s, psVal.len);
-            ++n;
+                break;
+            d->setStr(mem, psMxid.s, psMxid.len);
+            u->setStr(mem, psVal.s, psVal.len);
+            c.threepid.assign(psVal.s, psVal.len);
+            c.added = true;
+            changes.push_back(c);
         }
+        else
+            um->erase(mem, psMxid.s, psMxid.len);
     }
 
-    logdebug("MxStore: Rebuilt 3pid from [%s], %zu entries in %u ms", fromkey, n, (unsigned)timer.ms());
+    // users that are gone entirely
+    std::vector<StrRef> gone; // can't erase while iterating
+    for (Var::Map::Iterator it = um->begin(); it != um->end(); ++it)
+    {
+        PoolStr old = it.value().asString(mem);
+        if(!old.s)
+            continue;
+        PoolStr psMxid = mem.getSL(it.key());
+        if(m->get(*src.mem, psMxid.s, psMxid.len))
+            continue;
+        if(remove3pid(am, mem, old, psMxid, siblings))
+        {
+            c.mxid.assign(psMxid.s, psMxid.len);
+            c.threepid.assign(old.s, old.len);
+            c.added = false;
+            changes.push_back(c);
+        }
+        gone.push_back(it.key());
+    }
+    for(size_t i = 0; i < gone.size(); ++i)
+        um->erase(mem, gone[i]);
+
+    const size_t n = changes.size() - oldchanges;
+    logdebug("MxStore: Updated 3pid from [%s], %zu changes in %u ms", fromkey, n, (unsigned)timer.ms());
+    return n;
 }
 
-void MxStore::onTreeRebuilt(VarCRef src)
+void MxStore::onTreeRebuilt(const MxTreeSnapshotRef& snap)
 {
     logdev("MxStore::onTreeRebuilt() ...");
+    const VarCRef src = snap->tree.root();
 
-    DataTree::LockedRef lockdst = threepid.lockedRef();
-    //-------------------------------------------
+    ThreepidChanges changes;
+    {
+        DataTree::LockedRef lockdst = threepid.lockedRef();
+        //-------------------------------------------
+
+        // users = { field => { mxid => 3pid } }, per field since several fields may map to the same medium.
+        // Create all of them first so that each field can see what the others still claim.
+        for (Config::Media::iterator it = config.media.begin(); it != config.media.end(); ++it)
+            lockdst.ref["user"][it->first.c_str()].makeMap();
+
+        // update configured 3pid media from source fields
+        UserMaps siblings;
+        for (Config::Media::iterator it = config.media.begin(); it != config.media.end(); ++it)
+        {
+            const char* nameOfField = it->first.c_str();
+            const char* nameOf3pid = it->second.c_str();
+            siblings.clear();
+            for (Config::Media::iterator jt = config.media.begin(); jt != config.media.end(); ++jt)
+                if(jt != it && jt->second == it->second)
+                    siblings.push_back(lockdst.ref["user"][jt->first.c_str()].v->map());
+            VarRef addrs = lockdst.ref["3pid"][nameOf3pid].makeMap();
+            VarRef users = lockdst.ref["user"][nameOfField];
+            _Update3pidMap(changes, addrs, users, siblings, src, nameOfField, nameOf3pid);
+        }
+        // Any strings that were dropped are cleaned up later by defrag()
+    }
+
+    // Generating a hash cache takes the threepid lock, so don't hold it here.
+    // A full rehash is only necessary when the pepper changes;
+    // otherwise it's enough to update the entries that changed.
+    std::unique_lock hlock(hashcache.mutex);
+    _patchHashCache_nolock(changes);
+}
+
+static std::string threepidFileName(const char *dir)
+{
+    return std::string(dir) + "mxstore.3pid";
+}
+
+bool MxStore::save(const char *dir) const
+{
+    ScopeTimer timer;
+    std::vector<char> buf;
+    {
+        DataTree::LockedCRef lock = threepid.lockedCRef();
+        //-------------------------------------------
+        if(lock.ref.type() != Var::TYPE_MAP || !flatmap::encode(buf, lock.ref))
+            return false;
+    }
+    const bool ok = flatmap::write(threepidFileName(dir).c_str(), buf);
+    logdebug("MxStore::save(): Wrote %zu KB of 3pid maps in %u ms, success = %d", buf.size() / 1024, (unsigned)timer.ms(), ok);
+    return ok;
+}
+
+bool MxStore::load(const char *dir)
+{
     ScopeTimer timer;
+    flatmap::File f;
+    if(!f.open(threepidFileName(dir).c_str()))
+        return false;
 
-    // update configured 3pid media from source fields
-    for (Config::Media::iterator it = config.media.begin(); it != config.media.end(); ++it)
+    bool ok;
     {
-        const char* nameOfField = it->first.c_str();
-        const char* nameOf3pid = it->second.c_str();
-        VarRef dst = threepid.root()[nameOf3pid].makeMap();
-        _Rebuild3pidMap(dst, src, nameOfField);
+        DataTree::LockedRef lock = threepid.lockedRef();
+        //-------------------------------------------
+        lock.ref.clear();
+        ok = flatmap::decode(lock.ref, f.root());
+        if(!ok)
+            lock.ref.clear(); // will be rebuilt from scratch
+        // Lookups expect these to exist, same as after construction
+        lock.ref.makeMap();
+        lock.ref["3pid"].makeMap();
+        lock.ref["user"].makeMap();
     }
-    lockdst.ref.mem->defrag();
+    logdebug("MxStore::load(): Loaded 3pid maps in %u ms, success = %d", (unsigned)timer.ms(), ok);
+    return ok;
+}
 
-    // FIXME: could unlock R+W and re-lock for reading only,
-    // since the hash cache requires only reading at this point.
-    // But it would be better to integrate the hash cache so that
-    // it uses the same mem as the threepid, to same some extra RAM.
-    std::unique_lock hlock(hashcache.mutex);
-    rebuildHashCache_nolock();
+void MxStore::onTreeSaved(const MxTreeSnapshotRef& snap, const char *dir)
+{
+    save(dir);
+}
+
+void MxStore::onTreeLoaded(const MxTreeSnapshotRef& snap, const char *dir, bool exact)
+{
+    load(dir);
+}
+
+bool MxStore::getUsedFields(std::vector<std::string>& fields) const
+{
+    for(Config::Media::const_iterator it = config.media.begin(); it != config.media.end(); ++it)
+        fields.push_back(it->first);
+    return true;
 }
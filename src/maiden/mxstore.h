@@ -5,29 +5,37 @@
 #include "mxdefines.h"
 #include "cachetable.h"
 #include <unordered_map>
+#include <vector>
 #include "serialize.h"
 #include "mxsearchalgo.h"
 #include "mxsearch.h"
 #include "mxvirtual.h"
+#include "mxauthstore.h"
+#include "mxresolvcache.h"
 
 class MxSources;
 
+// Result of a bulk lookup, already formatted as JSON.
+// Each chunk is a comma-separated list of "key":"mxid" pairs, and may be empty.
+struct MxLookupResult
+{
+    MxLookupResult() : count(0) {}
+    void writeJson(BufferedWriteStream& dst) const; // writes all pairs as one JSON object
+
+    std::vector<std::string> chunks;
+    size_t count;
+};
+
 class MxStore : public EvTreeRebuilt
 {
 public:
     MxStore(MxSources& sources);
     ~MxStore();
 
-    enum LookupResult
-    {
-        UNKNOWN, // not cached
-        VALID,   // valid, cached
-        EXPIRED, // valid, old values still in cache
-        FAILED,  // cached, known invalid
-    };
+    typedef MxResolvCache::Status LookupResult;
 
     bool init(VarCRef config);
-    void defrag();
+    void defrag(); // Call regularly from a background thread. Does a small bit of cleanup work if needed, and drops expired auth tokens.
 
     // --- authentication ---
     bool register_(const char *token, size_t tokenLen, size_t expireInMS, const char *account); // return false is already exists
@@ -38,52 +46,68 @@ public:
     // --- well-known ---
     void storeHomeserverForHost(const char *host, const char *hs, unsigned port);
     void storeFailForHost(const char *host);
-    LookupResult getCachedHomeserverForHost(const char *host, std::string& hsOut, unsigned& portOut) const;
+    LookupResult getCachedHomeserverForHost(const char *host, std::string& hsOut, unsigned& portOut);
+    MxResolvList lookupHomeserverForHost(const char *host); // blocking; caches failure but not success
+    void refreshHomeserverForHostAsync(const char *host); // re-lookup and store in the background
 
     // --- hash pepper (NOT zero-terminated!) ---
     enum { HASH_PEPPER_BUFSIZE = 20 };
     static std::string GenerateHashPepper(size_t len);
     std::string getHashPepper(bool allowUpdate);
     void rotateHashPepper();
+    // Like getHashPepper(), but also returns a number that changes whenever the pepper is rotated.
+    // Pass pepper == NULL to only check. Only takes the write lock if the pepper is due for rotation.
+    u64 getHashPepperGen(std::string *pepper, bool allowUpdate);
 
     // -- lookup API --
-    MxError hashedBulkLookup(VarRef dst, VarCRef in, const char *algo, const char *pepper); // dst is made a map, in is an array
+    MxError hashedBulkLookup(MxLookupResult& res, VarCRef in, const char *algo, const char *pepper); // in is an array
 
     // -- update --
     void _clearHashCache_nolock();
     void markForRehash_nolock();
 
-    // create files in path with specified settings
-    //bool save(const char *path, serialize::Compression comp, serialize::Format fmt) const;
-    //bool load(const char *path, serialize::Compression comp, serialize::Format fmt);
-
-    // use storage directory and settings from config
-    bool save() const;
-    bool load();
+    // store/load the 3pid maps in dir (see flatmap.h)
+    bool save(const char *dir) const;
+    bool load(const char *dir);
 
 private:
     std::string getHashPepper_nolock(bool allowUpdate);
     void rotateHashPepper_nolock(u64 now);
     MxError _generateHashCache_nolock(VarRef cache, const char *algo);
-    MxError unhashedFuzzyLookup_nolock(VarRef dst, VarCRef in); // only for algo == "none"
+    size_t unhashedFuzzyLookup_nolock(std::string& out, VarCRef in, const MxLookupResult& exact); // only for algo == "none"
     void rebuildHashCache_nolock();
 
-    // dst becomes { 3pid => mxid }, where src is a list of { mxid => { ..., <fromkey>=3pid, ... }
-    // Actually src is the large user-to-data table returned by an import script, and ffromkey is the key under which to look up
-    // and entry that is to be used as a medium; so dst is likely some map stored under <medium> as a key, but the caller has to take care of that
-    static void _Rebuild3pidMap(VarRef dst, VarCRef src, const char* fromkey);
+    struct ThreepidChange
+    {
+        std::string medium, threepid, mxid;
+        bool added; // false if removed
+    };
+    typedef std::vector<ThreepidChange> ThreepidChanges;
+    typedef std::vector<const Var::Map*> UserMaps;
 
-    DataTree authdata; // stores auth tokens. small. saved to disk.
-    DataTree wellknown; // cache wellknown data for other servers. small. RAM only.
+    // Brings addrs = { 3pid => mxid } and users = { mxid => 3pid } up to date with src, and records what changed.
+    // src is the large user-to-data table returned by an import script, and fromkey is the key under which to look up
+    // an entry that is to be used as a medium; so dst is likely some map stored under <medium> as a key, but the caller has to take care of that.
+    // Removed entries are erased from the maps.
+    // users is per field; siblings are the users maps of other fields with the same medium.
+    // An address is only removed from addrs when none of these still maps the user to it.
+    static size_t _Update3pidMap(ThreepidChanges& changes, VarRef addrs, VarRef users, const UserMaps& siblings, VarCRef src, const char* fromkey, const char *medium);
+    void _patchHashCache_nolock(const ThreepidChanges& changes);
+
+    MxAuthStore authdata; // stores auth tokens. small. RAM only.
+    MxResolvCache wellknown; // cache wellknown data for other servers. small. RAM only.
 
     // large. RAM only
     DataTree hashcache; // {base64(hash) => mxid} // TODO: maybe don't store the mxid here, it's a duplicate and wastes mem
 
     // large, stored to disk.
-    DataTree threepid; // {medium => {3pid => mxid}}
+    // { "3pid": {medium => {3pid => mxid}}, "user": {medium => {mxid => 3pid}} }
+    // The latter is to remember each user's previous 3pid so that updates can be applied incrementally.
+    DataTree threepid;
 
     std::string hashPepper;
     u64 hashPepperTS; // timestamp at which the pepper was generated
+    u64 hashPepperGen; // incremented on each rotation
 
     // --- config --- (same structure as JSON in config file)
 
@@ -101,9 +125,11 @@ public:
         struct
         {
             u64 cacheTime;
+            u64 staleTime;
             u64 failTime;
             u64 requestTimeout;
             u64 requestMaxSize;
+            u64 maxEntries;
         } wellknown;
 
         struct
@@ -119,6 +145,8 @@ public:
 
         size_t minSearchLen; // TODO: move this to search and use it there
 
+        u64 defragPercent; // clean up string lookup tables once this many % of their entries are tombstones
+
         typedef std::unordered_map<std::string, Hash> Hashes;
         Hashes hashes;
 
@@ -135,6 +163,10 @@ private:
 
 public:
     // Inherited via EvTreeRebuilt
-    virtual void onTreeRebuilt(VarCRef src) override;
+    virtual void onTreeRebuilt(const MxTreeSnapshotRef& snap) override;
+    // The 3pid maps are always brought up to date incrementally, so they don't need to match the tree exactly
+    virtual void onTreeSaved(const MxTreeSnapshotRef& snap, const char *dir) override;
+    virtual void onTreeLoaded(const MxTreeSnapshotRef& snap, const char *dir, bool exact) override;
+    virtual bool getUsedFields(std::vector<std::string>& fields) const override;
 
 };
@@ -1,8 +1,34 @@
 #pragma once
 
 #include "variant.h"
+#include "datatree.h"
+#include "refcounted.h"
+#include <vector>
+#include <string>
+
+// One published version of a tree. Never modified once published, so it can be read
+// without any locking. Hold a CountedPtr to it to keep it (and any StrRefs into it) alive.
+struct MxTreeSnapshot : public Refcounted
+{
+    DataTree tree;
+    u64 version = 0; // increases with each published snapshot
+};
+typedef CountedPtr<const MxTreeSnapshot> MxTreeSnapshotRef;
 
 struct EvTreeRebuilt
 {
-    virtual void onTreeRebuilt(VarCRef src) = 0;
+    virtual void onTreeRebuilt(const MxTreeSnapshotRef& snap) = 0;
+
+    // Optional. Listeners that keep data derived from the tree can store it next to the tree's copy on disk.
+    // Before a new copy is written, anything stored for the old copy must be dropped...
+    virtual void onTreeSaving(const char *dir) {}
+    // ... and once snap was written, store whatever goes with it.
+    virtual void onTreeSaved(const MxTreeSnapshotRef& snap, const char *dir) {}
+    // snap was loaded from dir. Sent before onTreeRebuilt(snap).
+    // exact is false if changes were applied on top of what was saved, so any data stored along with it is outdated.
+    virtual void onTreeLoaded(const MxTreeSnapshotRef& snap, const char *dir, bool exact) {}
+
+    // Optional. Add the names of all fields of a user entry that this listener ever reads.
+    // Fields that no listener reads are dropped when ingesting. Return false to keep everything.
+    virtual bool getUsedFields(std::vector<std::string>& fields) const { return false; }
 };
@@ -170,6 +170,18 @@ public:
         return CountedPtr<V>();
     }
 
+    // Calls f(const Key&, const V&) for every slot that holds something, with the table locked for reading
+    template<typename F>
+    void forEach(F f) const
+    {
+        const size_t N = _vals.size();
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for(size_t i = 0; i < N; ++i)
+            if(const V *v = _vals[i].content())
+                f(_keys[i], *v);
+    }
+
+    size_t slots() const { return _vals.size(); }
 
 };
 
@@ -8,6 +8,7 @@
 ServerConfig::ServerConfig()
     : listen_threads(0)
     , expose_debug_apis(false)
+    , expose_memstats(false)
     , mimetype("text/json; charset=utf-8")
 {
     Listen def { "127.0.0.1", 8080, false };
@@ -50,6 +51,9 @@ bool ServerConfig::apply(const VarCRef& root)
     VarCRef xdebugapi = root.lookup("expose_debug_apis");
     expose_debug_apis = xdebugapi && xdebugapi.asBool();
 
+    VarCRef xmemstats = root.lookup("expose_memstats");
+    expose_memstats = xmemstats && xmemstats.asBool();
+
     if(VarCRef xmimetype = root.lookup("mimetype"))
         if(const char *mime = xmimetype.asCString())
             mimetype = mime;
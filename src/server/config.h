@@ -16,6 +16,7 @@ struct ServerConfig
     std::string cert;
     u32 listen_threads;
     bool expose_debug_apis;
+    bool expose_memstats; // serve MemStatsHandler under /debug/memory
     struct
     {
         u32 rows, columns;
@@ -0,0 +1,60 @@
+#include "handler_memstats.h"
+#include "memaccounting.h"
+#include "datatree.h"
+#include "json_out.h"
+
+static const char * const s_classNames[MemStats::NUM_CLASSES] =
+{
+    "1-8", "9-16", "17-32", "33-64", "65-128", "129-256", "large"
+};
+
+MemStatsHandler::MemStatsHandler(const char* prefix)
+    : RequestHandler(prefix, "application/json")
+{
+}
+
+MemStatsHandler::~MemStatsHandler()
+{
+}
+
+static void fillStats(VarRef dst, const MemStats& st)
+{
+    dst["used"] = u64(st.used);
+    dst["reserved"] = u64(st.reserved);
+    dst["fragmentation"] = st.fragmentation();
+    dst["extra"] = u64(st.extra);
+    VarRef s = dst["strings"];
+    s["count"] = u64(st.strCount);
+    s["bytes"] = u64(st.strBytes);
+    s["tables"] = u64(st.strTables);
+    VarRef c = dst["classes"];
+    for(unsigned i = 0; i < MemStats::NUM_CLASSES; ++i)
+    {
+        VarRef x = c[s_classNames[i]];
+        x["bytes"] = u64(st.classBytes[i]);
+        x["count"] = u64(st.classCount[i]);
+    }
+}
+
+int MemStatsHandler::onRequest(BufferedWriteStream& dst, mg_connection* conn, const Request& rq) const
+{
+    MemAccounting::Totals totals;
+    MemAccounting::Collect(totals);
+
+    ScratchTree scratch(StringPool::TINY);
+    DataTree& out = *scratch;
+    MemStats all;
+    VarRef subs = out.root()["subsystems"].makeMap();
+    for(MemAccounting::Totals::const_iterator it = totals.begin(); it != totals.end(); ++it)
+    {
+        VarRef x = subs[it->first.c_str()];
+        x["owners"] = u64(it->second.owners);
+        x["busy"] = u64(it->second.busy);
+        fillStats(x, it->second.stats);
+        all.add(it->second.stats);
+    }
+    fillStats(out.root()["total"], all);
+
+    writeJson(dst, out.root(), !!(rq.flags & RQF_PRETTY));
+    return 0;
+}
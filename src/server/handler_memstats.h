@@ -0,0 +1,13 @@
+#pragma once
+
+#include "webserver.h"
+
+// Serves the numbers collected by MemAccounting as JSON, per subsystem and in total.
+// Cheap enough to be polled, so memory regressions can be tracked over time.
+class MemStatsHandler : public RequestHandler
+{
+public:
+    MemStatsHandler(const char *prefix);
+    virtual ~MemStatsHandler();
+    virtual int onRequest(BufferedWriteStream& dst, struct mg_connection* conn, const Request& rq) const override;
+};
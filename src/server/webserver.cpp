@@ -10,6 +10,8 @@
 #include "brstream.h"
 #include "zstdstream.h"
 #include "json_out.h"
+#include "memaccounting.h"
+#include "handler_memstats.h"
 
 
 WebServer::WebServer()
@@ -125,6 +127,9 @@ bool WebServer::start(const ServerConfig& cfg)
 
     _ctx = ctx;
 
+    if(cfg.expose_memstats)
+        registerHandler(new MemStatsHandler("/debug/memory"), true);
+
     for(size_t i = 0; i < _storedHandlers.size(); ++i)
     {
         const StoredHandler& sh = _storedHandlers[i];
@@ -205,6 +210,8 @@ RequestHandler::RequestHandler(const char* prefix, const char *mimetype)
 
 RequestHandler::~RequestHandler()
 {
+    if(_cache.enabled())
+        MemAccounting::Remove(this);
 }
 
 // FIXME: re-integrate expirytime!!
@@ -213,6 +220,20 @@ void RequestHandler::setupCache(u32 rows, u32 cols, u64 maxtime)
 {
     _cache.resize(rows, cols);
     maxcachetime = maxtime;
+    if(_cache.enabled())
+        MemAccounting::Add(this, "replycache", _CollectCacheStats);
+}
+
+bool RequestHandler::_CollectCacheStats(const void* self, MemStats& st)
+{
+    const Cache& cache = static_cast<const RequestHandler*>(self)->_cache;
+    size_t bytes = cache.slots() * (sizeof(Cache::Key) + sizeof(CountedPtr<const StoredReply>));
+    cache.forEach([&bytes](const Cache::Key& k, const StoredReply& r)
+    {
+        bytes += k.obj.query.capacity() + k.obj.authorization.capacity() + sizeof(r) + r.data.capacity();
+    });
+    st.extra += bytes;
+    return true;
 }
 
 int RequestHandler::_onRequest(mg_connection* conn) const
@@ -249,7 +270,7 @@ int RequestHandler::_onRequest(mg_connection* conn) const
                 const StreamWriteMth writer = s_writer[k.obj.compression];
 
                 status = (this->*writer)(wr, conn, k.obj);
-                if(status >= 400) // is an error code?
+                if(status) // error code, or the handler already sent the reply on its own?
                     wr.setError(); // Make sure the stream destructor doesn't send anything
             }
             if(!status) // 0 means the handler didn't error out
@@ -322,10 +343,114 @@ int RequestHandler::_onRequest(mg_connection* conn) const
     }
 
     // when we have the complete cached request, just plonk it out entirely (the header is included)
-    mg_write(conn, srq->fulldata(), srq->fullsize());
+    return sendStoredReply(conn, *srq);
+}
+
+int RequestHandler::sendStoredReply(mg_connection* conn, const StoredReply& srq)
+{
+    mg_write(conn, srq.fulldata(), srq.fullsize());
     return 200;
 }
 
+CountedPtr<const StoredReply> RequestHandler::prepareStoredReply(const char* body, size_t len, CompressionType c) const
+{
+    StoredReply *rq = new StoredReply(hdrReserveSize);
+    CountedPtr<const StoredReply> srq = rq;
+    {
+        char buf[8 * 1024];
+        char zbuf[8 * 1024];
+        StoredReplyWriteStream wr(rq, buf, sizeof(buf));
+        wr.init();
+        // This is done once, so spend some more time on compression than for dynamic replies
+        switch(c)
+        {
+            case COMPR_NONE:
+                wr.Write(body, len);
+                break;
+            case COMPR_ZSTD:
+            {
+                ZstdWriteStream z(wr, 19, zbuf, sizeof(zbuf));
+                z.init();
+                z.Write(body, len);
+                z.finish();
+                break;
+            }
+            case COMPR_BROTLI:
+            {
+                BrotliWriteStream z(wr, 11, zbuf, sizeof(zbuf));
+                z.init();
+                z.Write(body, len);
+                z.finish();
+                break;
+            }
+            case COMPR_DEFLATE:
+            {
+                DeflateWriteStream z(wr, 9, zbuf, sizeof(zbuf));
+                z.init();
+                z.Write(body, len);
+                z.finish();
+                break;
+            }
+            default:
+                assert(false);
+                return NULL;
+        }
+    }
+
+    HeaderHelper hh(c, rq->bodysize());
+    if(!rq->spliceHeader(preparedHdr.c_str(), preparedHdr.size(), hh.buf, hh.size))
+        return NULL;
+    rq->data.shrink_to_fit();
+    return srq;
+}
+
+void RequestHandler::prepareStaticReply(StaticReply& dst, const char* body, size_t len, u64 version) const
+{
+    CountedPtr<const StoredReply> enc[COMPR_ARRAYSIZE];
+    for(size_t i = 0; i < COMPR_ARRAYSIZE; ++i)
+        enc[i] = prepareStoredReply(body, len, CompressionType(i)).content();
+
+    std::lock_guard<std::mutex> lock(dst._mtx);
+    //---------------------------------------
+    if(version < dst._version)
+        return; // someone else was faster with something newer
+    for(size_t i = 0; i < COMPR_ARRAYSIZE; ++i)
+        dst._enc[i] = std::move(enc[i]);
+    dst._version = version;
+}
+
+int RequestHandler::sendStaticReply(mg_connection* conn, const StaticReply& r, const Request& rq)
+{
+    CountedPtr<const StoredReply> srq = r.get(rq.compression);
+    if(!srq && rq.compression != COMPR_NONE)
+        srq = r.get(COMPR_NONE).content(); // encoding failed for some reason; send it plain
+    if(!srq)
+    {
+        mg_send_http_error(conn, 500, "static reply not prepared");
+        return 500;
+    }
+    return sendStoredReply(conn, *srq);
+}
+
+StaticReply::StaticReply()
+    : _version(0)
+{
+}
+
+CountedPtr<const StoredReply> StaticReply::get(CompressionType c) const
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    return _enc[c];
+}
+
+u64 StaticReply::version() const
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    //---------------------------------------
+    return _version;
+}
+
 int RequestHandler::onRequest_deflate(BufferedWriteStream& dst, mg_connection* conn, const Request& rq) const
 {
     char zbuf[8 * 1024];
@@ -1,13 +1,32 @@
 #pragma once
 
 #include <string>
+#include <mutex>
 #include "request.h"
 #include "cachetable.h"
 
 struct ServerConfig;
+struct MemStats;
 struct mg_context;
 typedef int (*mg_request_handler)(struct mg_connection* conn, void* cbdata);
 
+// A reply that is the same for every request, e.g. a small fixed JSON document.
+// Kept fully rendered (header + body) and pre-compressed for every supported encoding,
+// so that sending it is a single mg_write().
+// Safe to replace while other threads are sending it.
+class StaticReply
+{
+    friend class RequestHandler;
+public:
+    StaticReply();
+    CountedPtr<const StoredReply> get(CompressionType c) const;
+    u64 version() const;
+private:
+    mutable std::mutex _mtx;
+    CountedPtr<const StoredReply> _enc[COMPR_ARRAYSIZE];
+    u64 _version;
+};
+
 class RequestHandler
 {
 public:
@@ -35,13 +54,20 @@ public:
     void clearCache();
 
 protected:
-    int sendStoredRequest(mg_connection* conn, const CountedPtr<const StoredReply>& srq, const Request& r);
+    static int sendStoredReply(mg_connection* conn, const StoredReply& srq);
+
+    // Render body once per encoding, with our header, and store the results in dst.
+    // version is opaque and only stored; if dst already has a newer version nothing is replaced.
+    void prepareStaticReply(StaticReply& dst, const char *body, size_t len, u64 version = 0) const;
+    static int sendStaticReply(mg_connection* conn, const StaticReply& r, const Request& rq);
+    CountedPtr<const StoredReply> prepareStoredReply(const char *body, size_t len, CompressionType c) const;
 
 private:
     typedef int (RequestHandler::* StreamWriteMth)(BufferedWriteStream& dst, struct mg_connection* conn, const Request& rq) const;
     static const StreamWriteMth s_writer[COMPR_ARRAYSIZE];
 
     void prepareHeader(const char *mimetype);
+    static bool _CollectCacheStats(const void *self, MemStats& st);
 
     const std::string myPrefix;
     mutable Cache _cache;
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <random>
+#include "tinyhashmap.h"
+#include "treemem.h"
+#include "scopetimer.h"
+
+// Lookup throughput of TinyHashMap on large maps, with std::unordered_map as baseline.
+// Not a test; run it manually when touching the hashmap.
+
+enum { N = 1000000, ROUNDS = 5 };
+
+static void report(const char *what, u64 ns, size_t n, size_t found)
+{
+    printf("%-40s %7.2f Mlookups/s (%zu found)\n", what, (double(n) * 1000.0) / double(ns ? ns : 1), found);
+}
+
+static void benchTiny(const char *name, const std::vector<StrRef>& keys, const std::vector<StrRef>& misses)
+{
+    BlockAllocator mem;
+    TinyHashMap<u32> hm;
+    {
+        ScopeTimer t;
+        for(size_t i = 0; i < keys.size(); ++i)
+            *hm.at(mem, keys[i]) = u32(i);
+        printf("%s: inserted %zu keys in %ju ms\n", name, keys.size(), t.ms());
+    }
+
+    size_t found = 0;
+    ScopeTimer t;
+    for(unsigned r = 0; r < ROUNDS; ++r)
+        for(size_t i = 0; i < keys.size(); ++i)
+            found += !!hm.getp(keys[i]);
+    report("  TinyHashMap hits", t.ns(), ROUNDS * keys.size(), found);
+
+    found = 0;
+    ScopeTimer t2;
+    for(unsigned r = 0; r < ROUNDS; ++r)
+        for(size_t i = 0; i < misses.size(); ++i)
+            found += !!hm.getp(misses[i]);
+    report("  TinyHashMap misses", t2.ns(), ROUNDS * misses.size(), found);
+
+    hm.dealloc(mem);
+}
+
+static void benchStd(const char *name, const std::vector<StrRef>& keys, const std::vector<StrRef>& misses)
+{
+    std::unordered_map<StrRef, u32> m;
+    m.reserve(keys.size());
+    for(size_t i = 0; i < keys.size(); ++i)
+        m[keys[i]] = u32(i);
+
+    size_t found = 0;
+    ScopeTimer t;
+    for(unsigned r = 0; r < ROUNDS; ++r)
+        for(size_t i = 0; i < keys.size(); ++i)
+            found += m.find(keys[i]) != m.end();
+    report("  std::unordered_map hits", t.ns(), ROUNDS * keys.size(), found);
+
+    found = 0;
+    ScopeTimer t2;
+    for(unsigned r = 0; r < ROUNDS; ++r)
+        for(size_t i = 0; i < misses.size(); ++i)
+            found += m.find(misses[i]) != m.end();
+    report("  std::unordered_map misses", t2.ns(), ROUNDS * misses.size(), found);
+}
+
+static void bench(const char *name, std::vector<StrRef>& keys, std::vector<StrRef>& misses)
+{
+    // Look up in random order so that neither map profits from keys being inserted and looked up in the same order
+    std::mt19937 rng(1234);
+    std::shuffle(keys.begin(), keys.end(), rng);
+    std::shuffle(misses.begin(), misses.end(), rng);
+
+    printf("--- %s ---\n", name);
+    benchTiny(name, keys, misses);
+    benchStd(name, keys, misses);
+}
+
+int main(int argc, char **argv)
+{
+#if defined(__AVX2__)
+    puts("Key scan: AVX2");
+#elif defined(HASHHAT_SSE2)
+    puts("Key scan: SSE2");
+#else
+    puts("Key scan: scalar");
+#endif
+
+    std::vector<StrRef> keys, misses;
+    keys.reserve(N);
+    misses.reserve(N);
+
+    // Keys as they are used in the tree: handles from a string pool
+    {
+        TreeMem mem(StringPool::DEFAULT);
+        std::string s;
+        for(size_t i = 0; i < 2 * N; ++i)
+        {
+            s = "@user" + std::to_string(i) + ":example.com";
+            StrRef ref = mem.put(s.c_str(), s.length());
+            (i & 1 ? misses : keys).push_back(ref);
+        }
+        bench("1M pooled strings", keys, misses);
+    }
+
+    // Dense integers; the worst case for picking buckets by the low bits
+    keys.clear();
+    misses.clear();
+    for(size_t i = 0; i < N; ++i)
+    {
+        keys.push_back(StrRef(i) + 1);
+        misses.push_back(StrRef(i) + 1 + N);
+    }
+    bench("1M sequential keys", keys, misses);
+
+    // Only the high bits differ
+    keys.clear();
+    misses.clear();
+    for(size_t i = 0; i < N; ++i)
+    {
+        keys.push_back((StrRef(i) + 1) << 32);
+        misses.push_back((StrRef(i) + 1 + N) << 32);
+    }
+    bench("1M keys differing in upper 32 bits", keys, misses);
+
+    return 0;
+}
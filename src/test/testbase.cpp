@@ -8,6 +8,9 @@
 #include "accessor.h"
 #include "pathiter.h"
 #include "webstuff.h"
+#include "serialize.h"
+#include "subproc.h"
+#include "util.h"
 
 // Misc things to test for functionality, breakage, and to make sure everything compiles as it should
 
@@ -88,10 +91,71 @@ static void testweb()
     assert(t.path == "/page.html");
 }
 
+#ifndef _WIN32
+// Process output must be decoded as it comes in, whatever format it's in
+static void testprocload()
+{
+    const char *fn = "testbase_procload.tmp";
+    const char * const args[] = { "/bin/cat", fn, NULL };
+
+    DataTree src;
+    src.root()["a"] = "hello";
+    {
+        VarRef b = src.root()["b"].makeArray(0);
+        b.push_back() = u64(1);
+        b.push_back() = u64(42);
+    }
+    src.root()["c"]["d"] = 1.5;
+
+    const serialize::Format fmts[] = { serialize::JSON, serialize::BJ };
+    const serialize::Compression comps[] = { serialize::RAW, serialize::ZSTD };
+    for(size_t f = 0; f < Countof(fmts); ++f)
+        for(size_t c = 0; c < Countof(comps); ++c)
+        {
+            bool ok = serialize::save(fn, src.root(), comps[c], fmts[f]);
+            assert(ok);
+
+            DataTree dst;
+            unsigned char h[32];
+            ok = loadFromProcess(dst.root(), args, NULL, NULL, h);
+            assert(ok);
+            assert(src.root().v->equals(src, *dst.root().v, dst));
+
+            // the hash covers the raw output, not the decoded data
+            std::string raw;
+            FILE *fh = fopen(fn, "rb");
+            assert(fh);
+            for(int ch; (ch = fgetc(fh)) != EOF; )
+                raw += char(ch);
+            fclose(fh);
+            char expect[32];
+            hash_sha256(expect, raw.data(), raw.size());
+            assert(!memcmp(h, expect, sizeof(h)));
+        }
+
+    {
+        // shorter than any magic
+        FILE *fh = fopen(fn, "wb");
+        assert(fh);
+        fputs("7", fh);
+        fclose(fh);
+        DataTree dst;
+        bool ok = loadFromProcess(dst.root(), args, NULL, NULL, NULL);
+        assert(ok);
+        assert(dst.root().asUint() && *dst.root().asUint() == 7);
+    }
+
+    remove(fn);
+}
+#endif
+
 int main(int argc, char **argv)
 {
     testpathiter();
     testtree();
     testweb();
+#ifndef _WIN32
+    testprocload();
+#endif
     return 0;
 }
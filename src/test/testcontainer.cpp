@@ -1,8 +1,14 @@
 #include <stdio.h>
 #include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
 #include "tinyhashmap.h"
 #include "variant.h"
 #include "treemem.h"
+#include "datatree.h"
+#include "memaccounting.h"
+#include "flatmap.h"
 
 #define SHOWSIZE(x) printf("%s = %u\n", (#x), (unsigned)sizeof(x))
 
@@ -56,6 +62,423 @@ int main(int argc, char **argv)
 
     hm.dealloc(mem);
 
+    // erase every other key, with compaction happening along the way
+    for(unsigned N = 0; N < 2000; N += 7)
+    {
+        hm.clear(mem);
+        for(unsigned i = 0; i < N; ++i)
+            *hm.at(mem, StrRef(i)+1) = i;
+
+        unsigned removed = 0;
+        for(unsigned i = 0; i < N; i += 2)
+        {
+            unsigned v = 0;
+            bool ok = hm.erase(mem, StrRef(i)+1, v);
+            assert(ok && v == i);
+            ++removed;
+            assert(hm.size() == N - removed);
+        }
+        unsigned dummy = 0;
+        assert(!hm.erase(mem, StrRef(N)+1, dummy)); // not there
+
+        unsigned n = 0;
+        for(TinyHashMap<unsigned>::const_iterator it = hm.begin(); it != hm.end(); ++it, ++n)
+            assert(it.value() == it.key() - 1 && (it.value() & 1));
+        assert(n == hm.size());
+
+        for (unsigned i = 0; i < N; ++i)
+        {
+            unsigned *p = hm.getp(StrRef(i) + 1);
+            assert((i & 1) ? p && *p == i : !p);
+        }
+    }
+
+    hm.dealloc(mem);
+
+    // fresh maps around the small -> hashed switch, with erases before and after it
+    for(unsigned N = 0; N < 40; ++N)
+    {
+        TinyHashMap<unsigned> sm;
+        for(unsigned i = 0; i < N; ++i)
+        {
+            *sm.at(mem, StrRef(i)+1) = i;
+            if(i % 3 == 2)
+            {
+                unsigned v = 0;
+                bool ok = sm.erase(mem, StrRef(i-1)+1, v);
+                assert(ok && v == i-1);
+            }
+        }
+        unsigned n = 0;
+        for(TinyHashMap<unsigned>::const_iterator it = sm.begin(); it != sm.end(); ++it, ++n)
+            assert(it.value() == it.key() - 1 && (it.value() % 3 != 1 || it.value() + 1 == N));
+        assert(n == sm.size());
+        for(unsigned i = 0; i < N + 4; ++i)
+        {
+            const unsigned *p = sm.getp(StrRef(i) + 1);
+            assert(i < N && (i % 3 != 1 || i + 1 == N) ? p && *p == i : !p);
+        }
+        sm.dealloc(mem);
+    }
+
+    {
+        // keys of a Var map are refcounted, erasing must drop them from the pool
+        TreeMem tm(TreeMem::SMALL);
+        Var m;
+        Var::Map *vm = m.makeMap(tm);
+        vm->putKey(tm, "a", 1)->setStr(tm, "x", 1);
+        vm->putKey(tm, "b", 1)->setStr(tm, "y", 1);
+        bool ok = vm->erase(tm, "a", 1) && !vm->erase(tm, "a", 1) && vm->size() == 1;
+        assert(ok);
+        assert(!tm.lookup("a", 1) && !tm.lookup("x", 1) && tm.lookup("b", 1));
+        m.clear(tm);
+    }
+
+    {
+        // short strings are stored in the Var and never touch the pool
+        TreeMem tm(TreeMem::SMALL), tm2(TreeMem::SMALL);
+        Var a(tm, "1234567"), b(tm, "1234567"), c(tm, "12345678"), e(tm, "");
+        assert(!a.asStrRef() && !tm.lookup("1234567", 7));
+        assert(c.asStrRef() && tm.lookup("12345678", 8));
+        assert(a.type() == Var::TYPE_STRING && a.size() == 7 && !strcmp(a.asCString(tm), "1234567"));
+        assert(e.type() == Var::TYPE_STRING && e.size() == 0 && !*e.asCString(tm));
+        assert(a.equals(tm, b, tm) && a.compareExactSameMem(b) && !a.equals(tm, c, tm));
+        Var a2 = a.clone(tm2, tm);
+        assert(a2.equals(tm2, a, tm) && a.compareExact(tm, a2, tm2));
+        a.setStr(tm, a.asCString(tm) + 2, 3); // overlapping
+        assert(!strcmp(a.asCString(tm), "345") && !a.equals(tm, b, tm));
+        b.setStrRef(tm, c.asStrRef()); // long
+        assert(b.asStrRef() == c.asStrRef() && b.compareExactSameMem(c));
+        Var m;
+        StrRef k = e.asKeyRef(tm);
+        m.makeMap(tm)->put(tm, k, std::move(a));
+        tm.freeS(k);
+        assert(m.lookup(tm, "", 0) && !strcmp(m.lookup(tm, "", 0)->asCString(tm), "345"));
+        assert(tm.getRefcount(k) == 1); // held by the map alone
+        k = b.asKeyRef(tm); // long
+        assert(k == c.asStrRef() && tm.getRefcount(k) == 3);
+        tm.freeS(k);
+        Var u(tm, "unused");
+        k = u.asKeyRef(tm); // key that ends up not being stored
+        tm.freeS(k);
+        u.clear(tm);
+        assert(!tm.lookup("unused", 6));
+        m.clear(tm); b.clear(tm); c.clear(tm); e.clear(tm); a2.clear(tm2);
+        assert(!tm.lookup("12345678", 8));
+    }
+
+    {
+        // arrays grow with spare capacity, and must survive growing and shrinking in all ways
+        TreeMem tm(TreeMem::SMALL);
+        Var a;
+        VarRef r(tm, &a);
+        for(size_t i = 0; i < 10000; ++i)
+            r.push_back() = u64(i);
+        assert(a.size() == 10000 && *a[9999].asUint() == 9999);
+        a.makeArray(tm, 5000); // keeps memory
+        a.makeArray(tm, 100); // gives it back
+        a.makeArray(tm, 200);
+        assert(*a[99].asUint() == 99 && a[100].isNull() && a[199].isNull());
+        Var *x = a.subtreeOrFetch(tm, "/300", Var::SQ_CREATE);
+        assert(x && a.size() == 301 && x == &a[300]);
+        Var b;
+        b.makeArray(tm, 3)[2].setStr(tm, "a long string", 13);
+        a.makeMap(tm); // drop the array
+        a.makeMap(tm)->putKey(tm, "x", 1)->push_back(tm, b.clone(tm, tm));
+        VarRef(tm, &b).merge(VarCRef(tm, &a), MERGE_RECURSIVE | MERGE_APPEND_ARRAYS); // b becomes a map
+        a.makeArray(tm, 0);
+        assert(a.type() == Var::TYPE_ARRAY && !a.size());
+        a.clear(tm);
+        b.clear(tm);
+        assert(!tm.lookup("a long string", 13));
+    }
+
+    {
+        // scratch trees come back empty, with all strings gone, and are reused
+        StrRef r;
+        const DataTree *prev;
+        {
+            ScratchTree scratch(StringPool::TINY);
+            DataTree& t = *scratch;
+            t.root()["key"] = "a long string";
+            r = t.lookup("a long string", 13);
+            assert(r && t.BlockAllocator::usedBytes() && t.StringPool::usedBytes());
+            prev = &t;
+        }
+        {
+            ScratchTree scratch(StringPool::TINY);
+            DataTree& t = *scratch;
+            assert(&t == prev && t.root().isNull() && !t.getS(r) && !t.lookup("a long string", 13));
+            assert(!t.BlockAllocator::usedBytes() && !t.StringPool::usedBytes() && !t.peakBytes());
+            StrRef r2 = t.put("a long string", 13);
+            assert(r2 && r2 != r && !strcmp(t.getS(r2), "a long string"));
+            void *p = t.Alloc(100);
+            assert(t.BlockAllocator::usedBytes() == 100);
+            p = t.Realloc(p, 100, 200);
+            assert(t.BlockAllocator::usedBytes() == 200);
+            t.Free(p, 200);
+            assert(!t.BlockAllocator::usedBytes() && t.peakBytes() == 200);
+        }
+    }
+
+    {
+        // memory counters per size class, and per tag
+        DataTree t(StringPool::TINY);
+        t.setMemTag("test");
+        void *a = t.Alloc(8), *b = t.Alloc(9), *c = t.Alloc(1000);
+        t.put("a long string", 13);
+        MemAccounting::Totals tot;
+        MemAccounting::Collect(tot);
+        const MemAccounting::Entry& e = tot["test"];
+        const MemStats& st = e.stats;
+        assert(e.owners == 1 && !e.busy);
+        assert(st.classCount[0] == 1 && st.classBytes[1] == 9 && st.classBytes[MemStats::NUM_CLASSES-1] == 1000);
+        assert(st.strCount == 1 && st.strBytes > 13 && st.used == 8 + 9 + 1000 + st.strBytes);
+        assert(st.reserved >= st.used && st.strTables);
+        c = t.Realloc(c, 1000, 20);
+        t.Free(a, 8);
+        t.Free(b, 9);
+        t.Free(c, 20);
+        MemStats st2;
+        t.BlockAllocator::addStats(st2);
+        assert(!st2.used && !st2.classCount[2] && !st2.classCount[MemStats::NUM_CLASSES-1]);
+    }
+
+    {
+        // merge and clone into another pool; repeated strings are translated once, unique ones pass through
+        TreeMem tm(TreeMem::SMALL), tm2(TreeMem::SMALL);
+        Var src;
+        Var::Map *m = src.makeMap(tm);
+        for(unsigned i = 0; i < 100; ++i)
+        {
+            std::string k = "@user" + std::to_string(i) + ":example.com", v = "unique value " + std::to_string(i);
+            Var::Map *u = m->putKey(tm, k.c_str(), k.length())->makeMap(tm);
+            u->putKey(tm, "displayname", 11)->setStr(tm, v.c_str(), v.length());
+            u->putKey(tm, "department", 10)->setStr(tm, "a shared value", 14);
+        }
+        Var dst, cp = src.clone(tm2, tm);
+        VarRef(tm2, &dst).merge(VarCRef(tm, &src), MERGE_RECURSIVE);
+        assert(dst.equals(tm2, src, tm) && cp.equals(tm2, src, tm));
+        const Var *u = dst.lookup(tm2, "@user42:example.com", 19);
+        assert(u && !strcmp(u->lookup(tm2, "displayname", 11)->asCString(tm2), "unique value 42"));
+        assert(tm2.getRefcount(tm2.lookup("displayname", 11)) == 200);
+        assert(tm2.getRefcount(tm2.lookup("a shared value", 14)) == 200);
+        dst.clear(tm2);
+        cp.clear(tm2);
+        assert(!tm2.lookup("a shared value", 14) && !tm2.lookup("unique value 42", 15));
+        src.clear(tm);
+    }
+
+    {
+        // incremental defrag while another thread keeps looking up strings
+        StringPool sp(StringPool::DEFAULT);
+        std::vector<StrRef> refs;
+        for(unsigned i = 0; i < 20000; ++i)
+        {
+            std::string x = "string number " + std::to_string(i);
+            refs.push_back(sp.put(x.c_str(), x.length()));
+        }
+        for(unsigned i = 0; i < 20000; i += 2)
+            sp.freeS(refs[i]);
+        assert(sp.fragmentation() > 0.4f);
+        std::atomic<bool> done(false);
+        std::atomic<unsigned> bad(0);
+        std::thread reader([&]()
+        {
+            while(!done)
+                for(unsigned i = 1; i < 20000; i += 2)
+                {
+                    std::string x = "string number " + std::to_string(i);
+                    if(sp.lookup(x.c_str(), x.length()) != refs[i])
+                        ++bad;
+                }
+        });
+        unsigned steps = 0;
+        while(sp.defragStep(0.25f))
+            ++steps;
+        done = true;
+        reader.join();
+        assert(!bad && steps && sp.fragmentation() == 0.0f && !sp.defragStep(0.25f));
+        assert(sp.retiredBytes() && sp.freeRetired() && !sp.retiredBytes());
+        assert(!sp.lookup("string number 0", 15) && sp.lookup("string number 1", 15) == refs[1]);
+    }
+
+    {
+        // several threads putting and dropping the same strings
+        enum { THREADS = 4, ITER = 300, NSTR = 64 };
+        StringPool sp(StringPool::TINY);
+        std::vector<std::string> strs;
+        for(unsigned i = 0; i < NSTR; ++i)
+            strs.push_back("shared string " + std::to_string(i));
+        std::atomic<unsigned> bad(0);
+
+        // put vs. put: everyone must end up with the same refs, and no count gets lost
+        std::vector<StrRef> got[THREADS];
+        {
+            std::vector<std::thread> th;
+            for(unsigned t = 0; t < THREADS; ++t)
+                th.emplace_back([&, t]()
+                {
+                    for(unsigned k = 0; k < ITER; ++k)
+                        for(unsigned i = 0; i < NSTR; ++i)
+                        {
+                            StrRef r = sp.put(strs[i].c_str(), strs[i].length());
+                            if(!k)
+                                got[t].push_back(r);
+                            else if(got[t][i] != r)
+                                ++bad;
+                        }
+                });
+            for(std::thread& x : th)
+                x.join();
+        }
+        assert(!bad);
+        for(unsigned i = 0; i < NSTR; ++i)
+        {
+            StrRef r = sp.lookup(strs[i].c_str(), strs[i].length());
+            for(unsigned t = 0; t < THREADS; ++t)
+                assert(got[t][i] == r);
+            assert(sp.getRefcount(r) == THREADS * ITER);
+        }
+        {
+            std::vector<std::thread> th;
+            for(unsigned t = 0; t < THREADS; ++t)
+                th.emplace_back([&, t]()
+                {
+                    for(unsigned k = 0; k < ITER; ++k)
+                        for(unsigned i = 0; i < NSTR; ++i)
+                            sp.freeS(got[t][i]);
+                });
+            for(std::thread& x : th)
+                x.join();
+        }
+        for(unsigned i = 0; i < NSTR; ++i)
+            assert(!sp.lookup(strs[i].c_str(), strs[i].length()) && !sp.getS(got[0][i]) && !sp.getRefcount(got[0][i]));
+        assert(!sp.usedBytes());
+
+        // put vs. freeS: the shared strings keep dropping to refcount 0 while other threads put them again.
+        // Each thread also cycles through strings of its own so that slots are reused, and keeps the old refs.
+        std::vector<StrRef> old[THREADS];
+        {
+            std::vector<std::thread> th;
+            for(unsigned t = 0; t < THREADS; ++t)
+                th.emplace_back([&, t]()
+                {
+                    for(unsigned k = 0; k < ITER; ++k)
+                    {
+                        for(unsigned i = 0; i < NSTR; ++i)
+                        {
+                            StrRef r = sp.put(strs[i].c_str(), strs[i].length());
+                            const char *p = sp.getS(r);
+                            if(!p || strs[i] != p)
+                                ++bad;
+                            sp.freeS(r);
+                        }
+                        std::string mine = "thread " + std::to_string(t) + " string " + std::to_string(k);
+                        StrRef r = sp.put(mine.c_str(), mine.length());
+                        const char *p = sp.getS(r);
+                        if(!p || mine != p)
+                            ++bad;
+                        old[t].push_back(r);
+                        sp.freeS(r);
+                    }
+                });
+            for(std::thread& x : th)
+                x.join();
+        }
+        assert(!bad);
+        for(unsigned i = 0; i < NSTR; ++i)
+            assert(!sp.lookup(strs[i].c_str(), strs[i].length()));
+        // Slots were reused, but the generation keeps old refs from resolving to the new string
+        unsigned reused = 0;
+        for(unsigned t = 0; t < THREADS; ++t)
+            for(size_t k = 0; k < old[t].size(); ++k)
+            {
+                assert(!sp.getS(old[t][k]) && !sp.getRefcount(old[t][k]));
+                if(k && u32(old[t][k]) == u32(old[t][k-1]))
+                    ++reused;
+            }
+        assert(reused);
+        assert(!sp.usedBytes());
+
+        // dropping the pool while strings are still alive releases them all at once
+        sp.put("leftover", 8);
+        sp.put(std::string(1000, 'x').c_str(), 1000); // too large for the block allocator
+    }
+
+    {
+        // flat mappable encoding: round trip, lookups, and truncated or corrupt input
+        DataTree src(StringPool::TINY), expect(StringPool::TINY);
+        for(DataTree *t : { &src, &expect })
+        {
+            VarRef r = t->root().makeMap();
+            r["a"] = "a long string value";
+            r[""] = "";
+            r["c"]["d"] = "nested";
+            r["c"]["e"].makeMap();
+            for(unsigned i = 0; i < 50; ++i)
+                r["m"][std::to_string(i).c_str()] = std::to_string(i * i).c_str();
+        }
+        src.root()["skipped"] = u64(42); // only maps and strings are stored
+        src.root()["c"]["null"];
+
+        std::vector<char> buf;
+        bool ok = flatmap::encode(buf, src.root());
+        assert(ok && buf.size() > 4 && !memcmp(buf.data(), "FLM1", 4));
+        const char * const begin = buf.data() + 4, * const end = buf.data() + buf.size();
+
+        flatmap::Node root(begin, end);
+        assert(root && root.size() == 4);
+        assert(!strcmp(root.lookup("a", 1).str().s, "a long string value"));
+        assert(root.lookup("", 0).isString() && !root.lookup("", 0).str().len);
+        assert(!root.lookup("skipped", 7) && !root.lookup("b", 1) && !root.lookup("aa", 2));
+        flatmap::Node c = root.lookup("c", 1).map();
+        assert(c && c.size() == 2 && !strcmp(c.lookup("d", 1).str().s, "nested") && c.lookup("e", 1).map());
+        assert(!strcmp(root.lookup("m", 1).map().lookup("49", 2).str().s, "2401"));
+
+        DataTree dec(StringPool::TINY);
+        ok = flatmap::decode(dec.root(), root);
+        assert(ok && dec.root().v->equals(dec, *expect.root().v, expect));
+
+        const char *fn = "testcontainer_flatmap.tmp";
+        ok = flatmap::write(fn, buf);
+        assert(ok);
+        {
+            flatmap::File f;
+            ok = f.open(fn);
+            assert(ok && f.root() && !strcmp(f.root().lookup("a", 1).str().s, "a long string value"));
+        }
+        buf[0] = 'X'; // wrong magic
+        ok = flatmap::write(fn, buf);
+        assert(ok);
+        {
+            flatmap::File f;
+            assert(!f.open(fn) && !f.root());
+        }
+        remove(fn);
+        buf[0] = 'F';
+
+        // every truncation cuts off part of the last entry, so it must be rejected
+        for(const char *cut = begin; cut < end; ++cut)
+        {
+            DataTree t(StringPool::TINY);
+            assert(!flatmap::decode(t.root(), flatmap::Node(begin, cut)));
+        }
+
+        // corrupt each byte in turn; may or may not decode, but must stay within the buffer
+        const unsigned char junk[] = { 0x00, 0x7f, 0x80, 0xff };
+        for(size_t i = 4; i < buf.size(); ++i)
+            for(size_t j = 0; j < sizeof(junk); ++j)
+            {
+                std::vector<char> bad(buf);
+                bad[i] = char(junk[j]);
+                DataTree t(StringPool::TINY);
+                flatmap::Node n(bad.data() + 4, bad.data() + bad.size());
+                flatmap::decode(t.root(), n);
+                n.lookup("m", 1).map().lookup("7", 1).str();
+            }
+    }
+
     {
         TreeMem tm(TreeMem::SMALL);
         Var big;
@@ -0,0 +1,244 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "datatree.h"
+#include "util.h"
+#include "tomcrypt.h"
+#include "mxstore.h"
+#include "mxsources.h"
+#include "mxauthstore.h"
+
+// Bulk lookups against an MxStore, without any web server in between
+
+static std::string joinChunks(const MxLookupResult& res)
+{
+    std::string s;
+    for(size_t i = 0; i < res.chunks.size(); ++i)
+        if(!res.chunks[i].empty())
+        {
+            if(!s.empty())
+                s += ',';
+            s += res.chunks[i];
+        }
+    return s;
+}
+
+static size_t countOf(const std::string& s, const std::string& what)
+{
+    size_t n = 0;
+    for(size_t pos = s.find(what); pos != std::string::npos; pos = s.find(what, pos + what.length()))
+        ++n;
+    return n;
+}
+
+// Same as a client would do it
+static std::string hashAddr(const char *addr, const char *medium, const std::string& pepper)
+{
+    const ltc_hash_descriptor *hd = hash_getdesc("sha256");
+    assert(hd);
+    unsigned char out[32];
+    hash_state h;
+    hd->init(&h);
+    hd->process(&h, (const unsigned char*)addr, strlen(addr));
+    hd->process(&h, (const unsigned char*)" ", 1);
+    hd->process(&h, (const unsigned char*)medium, strlen(medium));
+    hd->process(&h, (const unsigned char*)" ", 1);
+    hd->process(&h, (const unsigned char*)pepper.c_str(), pepper.length());
+    hd->done(&h, out);
+    std::string s(base64size(sizeof(out)), 0);
+    s.resize(base64enc(&s[0], s.size(), out, sizeof(out), true));
+    return s;
+}
+
+static void testDuplicateLookups()
+{
+    MxSources sources;
+    MxStore store(sources);
+
+    DataTree cfg(DataTree::TINY);
+    cfg.root()["media"]["mail"] = "email";
+    cfg.root()["hashes"]["none"] = true;
+    cfg.root()["hashes"]["sha256"] = true;
+    bool ok = store.init(cfg.root());
+    assert(ok);
+
+    MxTreeSnapshot *snap = new MxTreeSnapshot;
+    snap->tree.root()["@alice:example.com"]["mail"] = "alice@example.com";
+    snap->tree.root()["@bob:example.com"]["mail"] = "bob@example.com";
+    store.onTreeRebuilt(MxTreeSnapshotRef(snap));
+
+    const std::string pepper = store.getHashPepper(true);
+
+    {
+        // the same plaintext address twice, and again in another chunk
+        DataTree in(DataTree::TINY);
+        VarRef a = in.root().makeArray(0);
+        for(size_t i = 0; i < 3000; ++i)
+            a.push_back() = (i == 0 || i == 1 || i == 2999) ? "alice@example.com email" : "nobody@example.com email";
+        MxLookupResult res;
+        MxError err = store.hashedBulkLookup(res, in.root(), "none", pepper.c_str());
+        assert(err == M_OK);
+        const std::string s = joinChunks(res);
+        assert(countOf(s, "\"alice@example.com email\"") == 1);
+    }
+
+    {
+        // the same hash with and without padding
+        const std::string h = hashAddr("bob@example.com", "email", pepper);
+        assert(!h.empty() && h.back() == '=');
+        const std::string unpadded = h.substr(0, h.find('='));
+        DataTree in(DataTree::TINY);
+        VarRef a = in.root().makeArray(0);
+        a.push_back() = h.c_str();
+        a.push_back() = unpadded.c_str();
+        a.push_back() = h.c_str();
+        MxLookupResult res;
+        MxError err = store.hashedBulkLookup(res, in.root(), "sha256", pepper.c_str());
+        assert(err == M_OK);
+        const std::string s = joinChunks(res);
+        assert(res.count == 1 && countOf(s, unpadded) == 1 && countOf(s, "@bob:example.com") == 1);
+    }
+}
+
+// true if addr is known as an email address of mxid
+static bool hasAddr(MxStore& store, const char *addr, const char *mxid)
+{
+    DataTree in(DataTree::TINY);
+    std::string s = std::string(addr) + " email";
+    in.root().makeArray(0).push_back() = s.c_str();
+    MxLookupResult res;
+    MxError err = store.hashedBulkLookup(res, in.root(), "none", store.getHashPepper(true).c_str());
+    assert(err == M_OK);
+    return res.count == 1 && countOf(joinChunks(res), mxid) == 1;
+}
+
+static void testFieldsSharingMedium()
+{
+    MxSources sources;
+    MxStore store(sources);
+
+    DataTree cfg(DataTree::TINY);
+    cfg.root()["media"]["mail"] = "email";
+    cfg.root()["media"]["mail2"] = "email";
+    cfg.root()["hashes"]["none"] = true;
+    bool ok = store.init(cfg.root());
+    assert(ok);
+
+    {
+        MxTreeSnapshot *snap = new MxTreeSnapshot;
+        VarRef r = snap->tree.root();
+        r["@one:x"]["mail"] = "one@x";
+        r["@two:x"]["mail"] = "two@x";
+        r["@two:x"]["mail2"] = "two2@x";
+        r["@same:x"]["mail"] = "same@x";
+        r["@same:x"]["mail2"] = "same@x";
+        r["@gone:x"]["mail"] = "gone@x";
+        r["@gone:x"]["mail2"] = "gone@x";
+        store.onTreeRebuilt(MxTreeSnapshotRef(snap));
+    }
+    for(int i = 0; i < 2; ++i) // the same again must not change anything
+    {
+        assert(hasAddr(store, "one@x", "@one:x"));
+        assert(hasAddr(store, "two@x", "@two:x"));
+        assert(hasAddr(store, "two2@x", "@two:x"));
+        assert(hasAddr(store, "same@x", "@same:x"));
+        assert(hasAddr(store, "gone@x", "@gone:x"));
+
+        MxTreeSnapshot *snap = new MxTreeSnapshot;
+        VarRef r = snap->tree.root();
+        r["@one:x"]["mail"] = "one@x";
+        r["@two:x"]["mail"] = "two@x";
+        r["@two:x"]["mail2"] = "two2@x";
+        r["@same:x"]["mail"] = "same@x";
+        r["@same:x"]["mail2"] = "same@x";
+        r["@gone:x"]["mail"] = "gone@x";
+        r["@gone:x"]["mail2"] = "gone@x";
+        store.onTreeRebuilt(MxTreeSnapshotRef(snap));
+    }
+
+    {
+        // one field changes or goes away, the other keeps its address
+        MxTreeSnapshot *snap = new MxTreeSnapshot;
+        VarRef r = snap->tree.root();
+        r["@one:x"]["mail"] = "one@x";
+        r["@two:x"]["mail"] = "two-new@x";
+        r["@two:x"]["mail2"] = "two2@x";
+        r["@same:x"]["mail2"] = "same@x";
+        store.onTreeRebuilt(MxTreeSnapshotRef(snap));
+    }
+    assert(hasAddr(store, "one@x", "@one:x"));
+    assert(!hasAddr(store, "two@x", "@two:x"));
+    assert(hasAddr(store, "two-new@x", "@two:x"));
+    assert(hasAddr(store, "two2@x", "@two:x"));
+    assert(hasAddr(store, "same@x", "@same:x"));
+    assert(!hasAddr(store, "gone@x", "@gone:x"));
+}
+
+// A 3pid file that can't be decoded must leave a usable, empty store behind
+static void testLoadCorrupt()
+{
+    MxSources sources;
+    MxStore store(sources);
+
+    DataTree cfg(DataTree::TINY);
+    cfg.root()["media"]["mail"] = "email";
+    cfg.root()["hashes"]["none"] = true;
+    bool ok = store.init(cfg.root());
+    assert(ok);
+
+    const char *fn = "./mxstore.3pid";
+    FILE *fh = fopen(fn, "wb");
+    assert(fh);
+    // valid header, but the only entry points way past the end
+    static const unsigned char bad[] = { 'F','L','M','1', 1,0,0,0, 0xff,0xff,0xff,0x7f, 0,0,0,0 };
+    fwrite(bad, 1, sizeof(bad), fh);
+    fclose(fh);
+    ok = store.load("./");
+    remove(fn);
+    assert(!ok);
+
+    assert(!hasAddr(store, "nobody@x", "@nobody:x"));
+}
+
+static void testAuthStore()
+{
+    const u64 H = 60 * 60 * 1000;
+    const u64 now = timeNowMS();
+    MxAuthStore st;
+    std::string acc;
+
+    bool ok = st.add("tok", 3, "@a:x", now + 1000);
+    assert(ok && !st.add("tok", 3, "@b:x", now + 5000));
+    assert(st.authorize("tok", now) == M_OK && st.authorize("nope", now) == M_NOT_FOUND);
+    assert(st.getAccount(acc, "tok") && acc == "@a:x");
+    assert(st.authorize("tok", now + 2000) == M_SESSION_EXPIRED);
+
+    // expired, but not long enough ago to be forgotten
+    assert(st.expire(now + 2000) == 0 && st.authorize("tok", now + 2000) == M_SESSION_EXPIRED);
+    assert(st.expire(now + 3 * H) == 1 && st.size() == 0);
+    assert(st.authorize("tok", now + 3 * H) == M_NOT_FOUND);
+
+    // logging out and in again with the same token must not expire the new one with the old one's time
+    ok = st.add("tok2", 4, "@a:x", now + 1000);
+    assert(ok && st.remove("tok2") && !st.remove("tok2"));
+    assert(st.authorize("tok2", now) == M_NOT_FOUND);
+    ok = st.add("tok2", 4, "@a:x", now + 100 * H); // further than the wheel can see
+    assert(ok);
+    assert(st.expire(now + 3 * H) == 0 && st.authorize("tok2", now + 3 * H) == M_OK);
+    assert(st.expire(now + 50 * H) == 0 && st.authorize("tok2", now + 50 * H) == M_OK);
+    assert(st.expire(now + 100 * H + 1) == 0 && st.authorize("tok2", now + 100 * H + 1) == M_SESSION_EXPIRED);
+    assert(st.expire(now + 102 * H) == 1 && st.size() == 0);
+}
+
+int main(int argc, char **argv)
+{
+    testDuplicateLookups();
+    testFieldsSharingMedium();
+    testLoadCorrupt();
+    testAuthStore();
+
+    puts("All good");
+
+    return 0;
+}
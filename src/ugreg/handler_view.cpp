@@ -27,7 +27,8 @@ static void writeToStream(BufferedWriteStream& ws, VarCRef sub, const Request& r
 
 int ViewHandler::onRequest(BufferedWriteStream& dst, mg_connection* conn, const Request& rq) const
 {
-    TreeMem work(StringPool::SMALL);
+    ScratchTree scratch(StringPool::SMALL);
+    TreeMem& work = *scratch;
     view::VM vm(work);
 
     PathIter it(rq.query.c_str());
@@ -93,7 +94,8 @@ int ViewDebugHandler::onRequest(BufferedWriteStream& dst, mg_connection* conn, c
         ++query;
 
     logdebug("ViewDebugHandler: %s\n", query);
-    TreeMem work(StringPool::SMALL);
+    ScratchTree scratch(StringPool::SMALL);
+    TreeMem& work = *scratch;
     view::VM vm(work);
     view::Executable exe(work);
     std::string err;
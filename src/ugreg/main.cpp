@@ -73,6 +73,7 @@ int main(int argc, char** argv)
 
     // TEST DATA START
     DataTree tree;
+    tree.setMemTag("tree");
 
     // register fetchers
     if(VarCRef fetch = cfgtree.subtree("/fetch"))